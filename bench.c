@@ -0,0 +1,633 @@
+/*
+ * bench.c
+ *	Measure term without any hardware
+ *
+ * We open pty pairs in place of the serial port and the user's
+ * terminal, start term on them, and play both the device and the
+ * user: sustained receive throughput, keystroke-to-wire latency,
+ * paste throughput, what session capture costs, and (with two
+ * terms talking to each other) transfer throughput for each
+ * protocol.  Receive runs both on the splice() fast path and
+ * copying (-c); -t runs some other build of term, say an older one
+ * to compare against.  With -o, only options every version of term
+ * has are used.
+ *
+ * Build:  cc -O2 -o bench bench.c -lutil
+ */
+#ifdef __linux__
+#define _GNU_SOURCE		/* memmem() */
+#endif
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <termios.h>
+#include <signal.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <pty.h>
+#else
+#include <util.h>
+#endif
+
+#define CHUNK (16*1024)		/* Device/user write size */
+#define TIMEOUT (60)		/* sec, any one test */
+#define MAXARGS (16)
+
+static char *term = "./term";	/* -t */
+static long long rxbytes = 64*1024*1024;	/* -n */
+static int samples = 2000;	/* -k, latency */
+static int oldopts = 0;		/* -o */
+static char *tests = "rx,lat,paste,log,xfer";	/* -T */
+static char tmpdir[] = "/tmp/benchXXXXXX";
+
+/*
+ * A running term; "dev" is our end of its serial port, "user" our
+ * end of its terminal.
+ */
+struct sess {
+    pid_t pid;
+    int dev, user;
+    char tail[512];		/* Last of what it showed the user */
+};
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+"Usage is: bench [-o] [-t <term>] [-n <bytes>] [-k <samples>] [-T <test>,...]\n"
+"Tests: rx, lat, paste, log, xfer\n");
+    exit(1);
+}
+
+/* usec on the monotonic clock */
+static long long
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000);
+}
+
+/* Has the test gone on too long? */
+static int
+expired(long long start)
+{
+    return((now() - start) > (TIMEOUT * 1000000LL));
+}
+
+/*
+ * showed()
+ *	Keep the end of what term wrote to the user, and return how
+ *	many bytes it was
+ */
+static int
+showed(struct sess *s)
+{
+    char buf[CHUNK];
+    int x, keep;
+
+    if ((x = read(s->user, buf, sizeof(buf))) <= 0) {
+	return(0);
+    }
+    keep = (x < (int)sizeof(s->tail) - 1) ? x : (int)sizeof(s->tail) - 1;
+    x -= keep;
+    memmove(s->tail, s->tail + keep, sizeof(s->tail) - 1 - keep);
+    memcpy(s->tail + sizeof(s->tail) - 1 - keep, buf + x, keep);
+    return(x + keep);
+}
+
+/* Wait until term has shown "what" */
+static int
+await(struct sess *s, char *what, int secs)
+{
+    long long start = now();
+    struct pollfd pfd;
+
+    while ((now() - start) < (secs * 1000000LL)) {
+	if (memmem(s->tail, sizeof(s->tail), what, strlen(what))) {
+	    return(0);
+	}
+	pfd.fd = s->user;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 100) > 0) {
+	    showed(s);
+	}
+    }
+    return(-1);
+}
+
+/*
+ * start()
+ *	Run term on a fresh pair of ptys, in directory "dir"
+ *
+ * "args" is a NULL-terminated list of options.
+ */
+static int
+start(struct sess *s, char **args, char *dir)
+{
+    char *argv[MAXARGS + 3], devname[64];
+    struct termios t;
+    int devs, users, x;
+
+    memset(s, 0, sizeof(*s));
+    if ((openpty(&s->dev, &devs, devname, NULL, NULL) < 0) ||
+	    (openpty(&s->user, &users, NULL, NULL, NULL) < 0)) {
+	perror("openpty");
+	exit(1);
+    }
+    tcgetattr(s->dev, &t);
+    cfmakeraw(&t);
+    tcsetattr(s->dev, TCSANOW, &t);
+    argv[0] = term;
+    for (x = 0; args[x] && (x < MAXARGS); ++x) {
+	argv[x+1] = args[x];
+    }
+    argv[x+1] = devname;
+    argv[x+2] = NULL;
+
+    if ((s->pid = fork()) < 0) {
+	perror("fork");
+	exit(1);
+    }
+    if (s->pid == 0) {
+	setsid();
+	close(devs);
+	close(s->dev);
+	close(s->user);
+	(void)ioctl(users, TIOCSCTTY, 0);
+	dup2(users, 0);
+	dup2(users, 1);
+	dup2(users, 2);
+	if (users > 2) {
+	    close(users);
+	}
+	if (dir && (chdir(dir) < 0)) {
+	    perror(dir);
+	    _exit(1);
+	}
+	execv(term, argv);
+	perror(term);
+	_exit(1);
+    }
+    close(devs);
+    close(users);
+    (void)fcntl(s->dev, F_SETFL, O_NONBLOCK);
+    (void)fcntl(s->user, F_SETFL, O_NONBLOCK);
+    if (await(s, "ready", 5) < 0) {
+	fprintf(stderr, "%s didn't start\n", term);
+	return(-1);
+    }
+    return(0);
+}
+
+static void
+stop(struct sess *s)
+{
+    kill(s->pid, SIGTERM);
+    waitpid(s->pid, NULL, 0);
+    close(s->dev);
+    close(s->user);
+}
+
+/*
+ * Results
+ */
+static void
+report(char *what, long long bytes, long long usec)
+{
+    printf("%-24s %8.1f MB in %6.2f s  %8.2f MB/s\n", what,
+	bytes / 1048576.0, usec / 1e6,
+	usec ? (bytes / 1048576.0) / (usec / 1e6) : 0.0);
+    fflush(stdout);
+}
+
+static void
+failed(char *what, char *why)
+{
+    printf("%-24s failed: %s\n", what, why);
+    fflush(stdout);
+}
+
+/* Fill "buf" with printable junk, nothing term would act on */
+static void
+pattern(char *buf, int len)
+{
+    int x;
+
+    for (x = 0; x < len; ++x) {
+	buf[x] = 'A' + (x % 58);
+    }
+}
+
+/*
+ * pump()
+ *	Write "total" bytes to "to", reading them back from "from"
+ *
+ * Returns usec from the first byte written to the last one read,
+ * or -1 if they didn't all make it.  Anything else term says is
+ * just read along the way.
+ */
+static long long
+pump(int to, struct sess *s, int from, long long total)
+{
+    char buf[CHUNK], junk[CHUNK];
+    long long sent = 0, got = 0, t0 = now();
+    struct pollfd pfd[2];
+    int x;
+
+    pattern(buf, sizeof(buf));
+    while (got < total) {
+	if (expired(t0)) {
+	    return(-1);
+	}
+	pfd[0].fd = from;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = to;
+	pfd[1].events = (sent < total) ? POLLOUT : 0;
+	if (poll(pfd, 2, 1000) <= 0) {
+	    continue;
+	}
+	if (pfd[1].revents & POLLOUT) {
+	    x = (total - sent) < CHUNK ? (total - sent) : CHUNK;
+	    if ((x = write(to, buf, x)) > 0) {
+		sent += x;
+	    }
+	}
+	if (pfd[0].revents & POLLIN) {
+	    if (from == s->user) {
+		got += showed(s);
+	    } else if ((x = read(from, junk, sizeof(junk))) > 0) {
+		got += x;
+	    }
+	}
+
+	/* Keep the other side of the session drained */
+	if (from != s->user) {
+	    showed(s);
+	}
+    }
+    return(now() - t0);
+}
+
+/*
+ * Receive throughput: device floods, user sees it all
+ */
+static void
+bench_rx(char *what, char **args)
+{
+    struct sess s;
+    long long t;
+
+    if (start(&s, args, NULL) < 0) {
+	failed(what, "start");
+	return;
+    }
+    if ((t = pump(s.dev, &s, s.user, rxbytes)) < 0) {
+	failed(what, "timed out");
+    } else {
+	report(what, rxbytes, t);
+    }
+    stop(&s);
+}
+
+static int
+cmpll(const void *a, const void *b)
+{
+    long long x = *(long long *)a, y = *(long long *)b;
+
+    return((x < y) ? -1 : (x > y));
+}
+
+/*
+ * Keystroke latency: one key at a time, until it shows up on the
+ * wire
+ */
+static void
+bench_lat(char *what, char **args)
+{
+    struct sess s;
+    long long *lat, t0;
+    struct pollfd pfd;
+    char c = 'k';
+    int x, n;
+
+    if (start(&s, args, NULL) < 0) {
+	failed(what, "start");
+	return;
+    }
+    lat = malloc(samples * sizeof(long long));
+    for (n = 0; n < samples; ++n) {
+	t0 = now();
+	write(s.user, &c, 1);
+	pfd.fd = s.dev;
+	pfd.events = POLLIN;
+	if ((poll(&pfd, 1, 1000) <= 0) || (read(s.dev, &c, 1) != 1)) {
+	    break;
+	}
+	lat[n] = now() - t0;
+	c = 'k';
+    }
+    if (n < samples) {
+	failed(what, "keystroke lost");
+    } else {
+	qsort(lat, n, sizeof(long long), cmpll);
+	x = (n * 99) / 100;
+	printf("%-24s p50 %6lld us  p99 %6lld us  max %6lld us\n", what,
+	    lat[n / 2], lat[x], lat[n - 1]);
+	fflush(stdout);
+    }
+    free(lat);
+    stop(&s);
+}
+
+/*
+ * Paste throughput: user pastes, device takes it all
+ */
+static void
+bench_paste(char *what, char **args)
+{
+    struct sess s;
+    long long t, total = rxbytes / 8;
+
+    if (start(&s, args, NULL) < 0) {
+	failed(what, "start");
+	return;
+    }
+    if ((t = pump(s.user, &s, s.dev, total)) < 0) {
+	failed(what, "timed out");
+    } else {
+	report(what, total, t);
+    }
+    stop(&s);
+}
+
+/*
+ * same()
+ *	Did dir "b" get the same "f" which dir "a" sent?
+ *
+ * XMODEM pads the last block, so "padded" lets the copy run on
+ * past "size".  Returns what's wrong, or NULL.
+ */
+static char *
+same(char *a, char *b, long long size, int padded)
+{
+    char path[2][sizeof(tmpdir) + 32], buf[2][CHUNK];
+    int fd[2], x, n[2];
+    long long got = 0;
+    char *why = NULL;
+
+    for (x = 0; x < 2; ++x) {
+	snprintf(path[x], sizeof(path[x]), "%s/f", x ? b : a);
+	fd[x] = open(path[x], O_RDONLY);
+    }
+    if ((fd[0] < 0) || (fd[1] < 0)) {
+	why = "nothing received";
+    }
+    while (!why && (got < size)) {
+	n[0] = read(fd[0], buf[0], sizeof(buf[0]));
+	n[1] = (n[0] > 0) ? read(fd[1], buf[1], n[0]) : 0;
+	if (n[0] <= 0) {
+	    why = "sent file went away";
+	} else if (n[1] < n[0]) {
+	    why = "short file";
+	} else if (memcmp(buf[0], buf[1], n[0])) {
+	    why = "file differs";
+	}
+	got += n[0];
+    }
+    if (!why && !padded && (read(fd[1], buf[1], 1) > 0)) {
+	why = "long file";
+    }
+    for (x = 0; x < 2; ++x) {
+	if (fd[x] >= 0) {
+	    close(fd[x]);
+	}
+    }
+    return(why);
+}
+
+/*
+ * Transfers: two terms with their serial ports cross-connected
+ * through us.  The sender goes first, so the receiver's first
+ * request gets answered at once; then it's the time from starting
+ * the receive until both ends say they're done.
+ */
+static void
+bench_xfer(char *what, char *proto, long long size)
+{
+    char *args[3], dir[2][sizeof(tmpdir) + 4], path[sizeof(tmpdir) + 32];
+    char buf[CHUNK], hold[2][CHUNK];
+    int held[2] = {0, 0}, off[2];
+    struct sess s[2];
+    struct pollfd pfd[4];
+    long long t0, w;
+    int fd, x, n, ok = -1;
+    char *p;
+
+    args[0] = "-p";
+    args[1] = proto;
+    args[2] = NULL;
+    for (x = 0; x < 2; ++x) {
+	snprintf(dir[x], sizeof(dir[x]), "%s/%c", tmpdir, 'a' + x);
+	mkdir(dir[x], 0700);
+	snprintf(path, sizeof(path), "%s/f", dir[x]);
+	unlink(path);
+    }
+
+    /* Something to send */
+    snprintf(path, sizeof(path), "%s/f", dir[0]);
+    if ((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0600)) < 0) {
+	perror(path);
+	exit(1);
+    }
+    for (w = 0; w < size; w += x) {
+	for (x = 0; x < (int)sizeof(buf); ++x) {
+	    buf[x] = random();
+	}
+	x = ((size - w) < (long long)sizeof(buf)) ? (size - w) : sizeof(buf);
+	write(fd, buf, x);
+    }
+    close(fd);
+
+    if (start(&s[0], args, dir[0]) < 0) {
+	failed(what, "start");
+	return;
+    }
+    if (start(&s[1], args, dir[1]) < 0) {
+	stop(&s[0]);
+	failed(what, "start");
+	return;
+    }
+    write(s[0].user, "\032sf\r", 4);
+    usleep(200000);
+    t0 = now();
+    write(s[1].user, (proto[0] == 'x') ? "\032rf\r" : "\032r", (proto[0] == 'x') ? 4 : 2);
+
+    while (!expired(t0)) {
+	if (memmem(s[0].tail, sizeof(s[0].tail), "done", 4) &&
+		memmem(s[1].tail, sizeof(s[1].tail), "done", 4)) {
+	    ok = 0;
+	    break;
+	}
+	for (x = 0; x < 2; ++x) {
+	    pfd[x].fd = s[x].dev;
+	    pfd[x].events = (held[!x] > 0) ? POLLOUT : POLLIN;
+	    pfd[x+2].fd = s[x].user;
+	    pfd[x+2].events = POLLIN;
+	}
+	if (poll(pfd, 4, 1000) <= 0) {
+	    continue;
+	}
+	for (x = 0; x < 2; ++x) {
+	    if (pfd[x+2].revents & POLLIN) {
+		showed(&s[x]);
+	    }
+
+	    /*
+	     * Across to the other one; what it won't take yet waits,
+	     * and we don't read any more from this side until it has.
+	     */
+	    if ((pfd[x].revents & POLLIN) && (held[x] == 0) &&
+		    ((n = read(s[x].dev, hold[x], CHUNK)) > 0)) {
+		held[x] = n;
+		off[x] = 0;
+	    }
+	    while (held[x] > 0) {
+		if ((w = write(s[!x].dev, hold[x] + off[x], held[x])) <= 0) {
+		    break;
+		}
+		off[x] += w;
+		held[x] -= w;
+	    }
+	}
+    }
+    t0 = now() - t0;
+    stop(&s[0]);
+    stop(&s[1]);
+    if (ok < 0) {
+	failed(what, "timed out");
+	return;
+    }
+    if ((p = same(dir[0], dir[1], size, proto[0] == 'x')) != NULL) {
+	failed(what, p);
+	return;
+    }
+    report(what, size, t0);
+}
+
+static void
+cleanup(void)
+{
+    char path[sizeof(tmpdir) + 16];
+    int x;
+
+    for (x = 0; x < 2; ++x) {
+	snprintf(path, sizeof(path), "%s/%c/f", tmpdir, 'a' + x);
+	unlink(path);
+	path[strlen(path) - 2] = '\0';
+	rmdir(path);
+    }
+    snprintf(path, sizeof(path), "%s/log", tmpdir);
+    unlink(path);
+    rmdir(tmpdir);
+}
+
+int
+main(int argc, char **argv)
+{
+    static char *plain[] = {NULL}, *copy[] = {"-c", NULL};
+    static char *paste[] = {"-P", NULL};
+    char *logargs[4], logname[sizeof(tmpdir) + 8];
+    char *p;
+    int x;
+
+    while ((x = getopt(argc, argv, "t:n:k:T:o")) != -1) {
+	switch (x) {
+	case 't':
+	    term = optarg;
+	    break;
+	case 'n':
+	    if ((rxbytes = strtoll(optarg, &p, 0)) <= 0) {
+		usage();
+	    }
+	    if ((*p == 'k') || (*p == 'K')) {
+		rxbytes <<= 10;
+	    } else if ((*p == 'm') || (*p == 'M')) {
+		rxbytes <<= 20;
+	    }
+	    break;
+	case 'k':
+	    if ((samples = atoi(optarg)) <= 0) {
+		usage();
+	    }
+	    break;
+	case 'T':
+	    tests = optarg;
+	    break;
+	case 'o':
+	    oldopts = 1;
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (optind != argc) {
+	usage();
+    }
+    /* The transfer tests run it from their own directories */
+    if ((access(term, X_OK) < 0) || ((p = realpath(term, NULL)) == NULL)) {
+	perror(term);
+	exit(1);
+    }
+    term = p;
+    if (mkdtemp(tmpdir) == NULL) {
+	perror("mkdtemp");
+	exit(1);
+    }
+    atexit(cleanup);
+    signal(SIGPIPE, SIG_IGN);
+    srandom(time(NULL));
+    snprintf(logname, sizeof(logname), "%s/log", tmpdir);
+
+    if (strstr(tests, "rx")) {
+	bench_rx(oldopts ? "rx" : "rx (splice)", plain);
+	if (!oldopts) {
+	    bench_rx("rx (copy)", copy);
+	}
+    }
+    if (strstr(tests, "lat")) {
+	bench_lat("keystroke latency", plain);
+    }
+    if (strstr(tests, "paste")) {
+	bench_paste("paste", oldopts ? plain : paste);
+    }
+    if (strstr(tests, "log")) {
+	logargs[0] = "-l";
+	logargs[1] = logname;
+	logargs[2] = NULL;
+	bench_rx(oldopts ? "rx + log" : "rx + log (splice)", logargs);
+	if (!oldopts) {
+	    logargs[2] = "-c";
+	    logargs[3] = NULL;
+	    bench_rx("rx + log (copy)", logargs);
+	}
+    }
+    if (strstr(tests, "xfer")) {
+	bench_xfer("xmodem-1k send+receive", "x", rxbytes / 16);
+	bench_xfer("ymodem send+receive", "y", rxbytes / 16);
+	if (!oldopts) {
+	    bench_xfer("ymodem-g send+receive", "y,stream", rxbytes / 16);
+	}
+	bench_xfer("zmodem send+receive", "z", rxbytes / 4);
+    }
+    exit(0);
+}
@@ -0,0 +1,474 @@
+/*
+ * capdump.c
+ *	Turn a stamped session capture back into text
+ *
+ * term -L format=stamped keeps what it received and sent as
+ * records, each with the time it happened, and every megabyte of
+ * the capture opens with an index record (see CAP_SPAN in term.c).
+ * We print the records a line at a time, "<" for received and ">"
+ * for sent, stamped with seconds since the capture started (or,
+ * with -a, the time of day).  -t skips to a point in the capture;
+ * the index lets us binary search for it instead of reading what
+ * comes before.  Anything that won't print is shown as \xNN.  A
+ * mark a trigger left (term -T) gets a line of its own, with "*".
+ * So does each frame term -F took out, in hex after its length,
+ * with "#" (or "!" for one which failed its CRC).
+ *
+ * A compressed capture needs to come through zstd -dc or lz4 -dc
+ * first; give "-" (or no file) to read it from stdin.
+ *
+ * -m <name> follows a live tap (term -M <name>) instead, from
+ * whatever comes next until term exits.  See "Live tap" in term.c
+ * for how the ring works.
+ *
+ * Build:  cc -O2 -o capdump capdump.c
+ */
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#define CAP_MAGIC "TERMCAP1"
+#define CAP_SPAN (1024*1024)
+#define CAP_HDR (16)
+#define CAP_INDEX (40)
+#define CAP_RX (1)
+#define CAP_TX (2)
+#define CAP_I (3)
+#define CAP_MARK (4)
+#define CAP_FRAME (5)
+#define CAP_BADFRAME (6)
+
+#define TAP_MAGIC "TERMTAP1"
+#define TAP_REC (24)
+
+struct taphdr {
+    char magic[8];
+    unsigned int hdrsize;
+    unsigned int live;
+    unsigned long long size;
+    unsigned long long head;
+    unsigned long long lo;
+};
+struct taprec {
+    unsigned long long seq;
+    unsigned long long usec;
+    unsigned int len;
+    unsigned int type;
+};
+
+static int wall;		/* -a */
+static long long skip = -1;	/* -t, usec */
+
+static unsigned char *cap;	/* The capture... */
+static size_t caplen;		/*  ...and its length */
+
+static long long base;		/* usec on term's clock at the start */
+static long long wbase, wmono;	/* Last index: wall clock, term clock */
+static int dir;			/* Direction of the line we're on, or 0 */
+static char *tap;		/* -m */
+
+static void
+usage(void)
+{
+    fprintf(stderr, "Usage is: capdump [-a] [-t <sec>] [<file>|-]\n"
+	"\tcapdump [-a] -m <tap>\n");
+    exit(1);
+}
+
+/* Fetch "n" bytes little-endian at "p" */
+static unsigned long long
+le(unsigned char *p, int n)
+{
+    unsigned long long v = 0;
+
+    while (n--) {
+	v = (v << 8) | p[n];
+    }
+    return(v);
+}
+
+/*
+ * load()
+ *	Get the capture into memory
+ *
+ * A file is just mapped; a pipe is read into a buffer which grows
+ * as it needs to.
+ */
+static void
+load(char *name)
+{
+    struct stat sb;
+    size_t size = 0;
+    ssize_t x;
+    int fd;
+
+    if (!name || !strcmp(name, "-")) {
+	fd = 0;
+    } else if ((fd = open(name, O_RDONLY)) < 0) {
+	perror(name);
+	exit(1);
+    }
+    if ((fstat(fd, &sb) == 0) && S_ISREG(sb.st_mode) && (sb.st_size > 0)) {
+	caplen = sb.st_size;
+	cap = mmap(NULL, caplen, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (cap == MAP_FAILED) {
+	    perror("mmap");
+	    exit(1);
+	}
+	(void)madvise(cap, caplen, MADV_SEQUENTIAL);
+	return;
+    }
+    for (;;) {
+	if (caplen == size) {
+	    size = size ? (size * 2) : CAP_SPAN;
+	    if ((cap = realloc(cap, size)) == NULL) {
+		perror("capdump");
+		exit(1);
+	    }
+	}
+	if ((x = read(fd, cap + caplen, size - caplen)) > 0) {
+	    caplen += x;
+	} else if (x == 0) {
+	    break;
+	} else if (errno != EINTR) {
+	    perror(name ? name : "stdin");
+	    exit(1);
+	}
+    }
+}
+
+/*
+ * span()
+ *	The index record opening span "n", or NULL
+ */
+static unsigned char *
+span(size_t n)
+{
+    unsigned char *r;
+
+    if (((n * CAP_SPAN) + CAP_HDR + CAP_INDEX) > caplen) {
+	return(NULL);
+    }
+    r = cap + (n * CAP_SPAN);
+    if ((le(r + 8, 4) != CAP_INDEX) || (le(r + 12, 4) != CAP_I) ||
+	    memcmp(r + CAP_HDR, CAP_MAGIC, 8)) {
+	return(NULL);
+    }
+    return(r);
+}
+
+/*
+ * seek()
+ *	Where to start reading for -t
+ *
+ * The last span which opens at or before the time asked for; the
+ * records are in time order, so that's where to start.
+ */
+static size_t
+seek(long long when)
+{
+    size_t lo = 0, hi = caplen / CAP_SPAN, mid;
+    unsigned char *r;
+
+    while (lo < hi) {
+	mid = lo + (hi - lo + 1) / 2;
+	if (((r = span(mid)) == NULL) || ((long long)le(r, 8) > when)) {
+	    hi = mid - 1;
+	} else {
+	    lo = mid;
+	}
+    }
+    return(lo * CAP_SPAN);
+}
+
+/* usec on the monotonic clock, as term keeps it */
+static long long
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000);
+}
+
+/* Start a line for data going direction "d" at "t" */
+static void
+stamp(int d, long long t)
+{
+    time_t sec;
+    struct tm *tm;
+    char buf[32];
+
+    if (wall) {
+	t = wbase + (t - wmono);
+	sec = t / 1000000;
+	tm = localtime(&sec);
+	strftime(buf, sizeof(buf), "%H:%M:%S", tm);
+	printf("%s.%06lld %c ", buf, t % 1000000, "?<>?*#!"[d]);
+    } else {
+	t -= base;
+	printf("%lld.%06lld %c ", t / 1000000, t % 1000000, "?<>?*#!"[d]);
+    }
+    dir = d;
+}
+
+/*
+ * show()
+ *	Print a record's data
+ *
+ * A line ends at a newline (a CR just before it is dropped), or
+ * when the direction changes.
+ */
+static void
+show(int d, long long t, unsigned char *p, size_t n)
+{
+    unsigned char c;
+
+    if (dir && (dir != d)) {
+	putchar('\n');
+	dir = 0;
+    }
+    while (n--) {
+	c = *p++;
+	if (!dir) {
+	    stamp(d, t);
+	}
+	if (c == '\n') {
+	    putchar('\n');
+	    dir = 0;
+	} else if ((c == '\r') && n && (*p == '\n')) {
+	    continue;
+	} else if (c == '\\') {
+	    fputs("\\\\", stdout);
+	} else if (((c >= ' ') && (c < 0x7F)) || (c == '\t')) {
+	    putchar(c);
+	} else {
+	    printf("\\x%02x", c);
+	}
+    }
+}
+
+/* Print a frame, on a line of its own */
+static void
+frame(int d, long long t, unsigned char *p, size_t n)
+{
+    if (dir) {
+	putchar('\n');
+    }
+    stamp(d, t);
+    printf("%zu:", n);
+    while (n--) {
+	printf(" %02x", *p++);
+    }
+    putchar('\n');
+    dir = 0;
+}
+
+/*
+ * follow()
+ *	Print a live tap as it goes
+ *
+ * Each record is copied out and then checked against "lo"; if term
+ * has written over it meanwhile, we say so and skip to the newest.
+ */
+static void
+follow(char *name)
+{
+    unsigned long long pos, head, size, last = 0, lost;
+    struct taphdr *h;
+    struct taprec rec;
+    struct stat sb;
+    struct timeval tv;
+    unsigned char *ring, *buf;
+    size_t off;
+    char path[256];
+    int fd, torn, seen = 0;
+
+    if (*name != '/') {
+	snprintf(path, sizeof(path), "/%s", name);
+	name = path;
+    }
+    if (((fd = shm_open(name, O_RDONLY, 0)) < 0) || (fstat(fd, &sb) < 0)) {
+	perror(name);
+	exit(1);
+    }
+    h = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (h == MAP_FAILED) {
+	perror(name);
+	exit(1);
+    }
+    close(fd);
+    if ((sb.st_size < sizeof(*h)) || memcmp(h->magic, TAP_MAGIC, 8) ||
+	    ((h->hdrsize + h->size) > sb.st_size)) {
+	fprintf(stderr, "%s: not a term tap\n", name);
+	exit(1);
+    }
+    ring = (unsigned char *)h + h->hdrsize;
+    size = h->size;
+    if ((buf = malloc(size / 4)) == NULL) {
+	perror("capdump");
+	exit(1);
+    }
+
+    /* Times are from now, or the time of day */
+    gettimeofday(&tv, NULL);
+    wbase = (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+    base = wmono = now();
+
+    pos = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+    for (;;) {
+	head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+	if (pos == head) {
+	    if (!__atomic_load_n(&h->live, __ATOMIC_ACQUIRE) &&
+		    (head == __atomic_load_n(&h->head, __ATOMIC_ACQUIRE))) {
+		break;
+	    }
+	    fflush(stdout);
+	    usleep(1000);
+	    continue;
+	}
+	off = pos % size;
+	if ((size - off) < TAP_REC) {
+	    pos += size - off;
+	    continue;
+	}
+	memcpy(&rec, ring + off, sizeof(rec));
+	/* tap_put() never writes more than size / 4 at once */
+	torn = (rec.type != 0) && ((rec.len > (size - off - TAP_REC)) ||
+	    (rec.len > (size / 4)));
+	if (!torn && (rec.type != 0)) {
+	    memcpy(buf, ring + off + TAP_REC, rec.len);
+	}
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (pos < __atomic_load_n(&h->lo, __ATOMIC_RELAXED)) {
+	    torn = 1;
+	}
+	if (torn) {
+	    if (dir) {
+		putchar('\n');
+		dir = 0;
+	    }
+	    printf("[overrun]\n");
+	    pos = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+	    continue;
+	}
+	if (rec.type == 0) {
+	    pos += size - off;
+	    continue;
+	}
+	pos += (TAP_REC + rec.len + 7) & ~7;
+	if (seen && ((lost = rec.seq - last - 1) != 0)) {
+	    if (dir) {
+		putchar('\n');
+		dir = 0;
+	    }
+	    printf("[%llu records lost]\n", lost);
+	}
+	seen = 1;
+	last = rec.seq;
+	if ((rec.type == CAP_FRAME) || (rec.type == CAP_BADFRAME)) {
+	    frame(rec.type, rec.usec, buf, rec.len);
+	} else {
+	    show(rec.type, rec.usec, buf, rec.len);
+	}
+    }
+    if (dir) {
+	putchar('\n');
+    }
+    exit(0);
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t off, left, n;
+    unsigned char *r;
+    long long t;
+    int x, type;
+    char *p;
+
+    while ((x = getopt(argc, argv, "at:m:")) > 0) {
+	switch (x) {
+	case 'a':
+	    wall = 1;
+	    break;
+	case 'm':
+	    tap = optarg;
+	    break;
+	case 't':
+	    skip = (long long)(strtod(optarg, &p) * 1000000);
+	    if ((p == optarg) || *p || (skip < 0)) {
+		usage();
+	    }
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (argc > (optind + 1)) {
+	usage();
+    }
+    if (tap) {
+	follow(tap);
+    }
+    load(argv[optind]);
+    if ((r = span(0)) == NULL) {
+	fprintf(stderr, "%s: not a stamped capture\n",
+	    argv[optind] ? argv[optind] : "stdin");
+	exit(1);
+    }
+    base = le(r, 8);
+
+    off = 0;
+    if (skip >= 0) {
+	skip += base;
+	off = seek(skip);
+    }
+    while ((off + CAP_HDR) <= caplen) {
+	left = CAP_SPAN - (off % CAP_SPAN);
+	r = cap + off;
+	type = le(r + 12, 4);
+	if ((left <= CAP_HDR) || (type == 0)) {
+	    off += left;		/* Filler to the end of the span */
+	    continue;
+	}
+	t = le(r, 8);
+	n = le(r + 8, 4);
+	if ((n > (left - CAP_HDR)) || ((off + CAP_HDR + n) > caplen)) {
+	    break;			/* Cut short; still being written? */
+	}
+	if (type == CAP_I) {
+	    if ((n == CAP_INDEX) && !memcmp(r + CAP_HDR, CAP_MAGIC, 8)) {
+		wbase = le(r + CAP_HDR + 8, 8);
+		wmono = t;
+	    }
+	} else if ((skip >= 0) && (t < skip)) {
+	    ;
+	} else if ((type == CAP_RX) || (type == CAP_TX)) {
+	    show(type, t, r + CAP_HDR, n);
+	} else if (type == CAP_MARK) {
+	    if (dir) {
+		putchar('\n');
+	    }
+	    stamp(type, t);
+	    fwrite(r + CAP_HDR, 1, n, stdout);
+	    putchar('\n');
+	    dir = 0;
+	} else if ((type == CAP_FRAME) || (type == CAP_BADFRAME)) {
+	    frame(type, t, r + CAP_HDR, n);
+	}
+	off += CAP_HDR + n;
+    }
+    if (dir) {
+	putchar('\n');
+    }
+    return(0);
+}
@@ -2,6 +2,9 @@
  * term.c
  *	Terminal program, so you can type into a serial port
  */
+#ifdef __linux__
+#define _GNU_SOURCE		/* splice(), tee() */
+#endif
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
@@ -9,25 +12,229 @@
 #include <signal.h>
 #include <errno.h>
 #include <string.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <regex.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <libgen.h>
+#include <sched.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <linux/serial.h>
+#endif
+#ifdef __APPLE__
+#include <IOKit/serial/ioss.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+#if defined(__linux__) && defined(SPLICE_F_MOVE)
+#define HAVE_SPLICE
+#endif
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define HAVE_URING
+#endif
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__SSE2__))
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 /* Default TTY to access */
 #define DEFAULT_TTY "/dev/ttyUSB0"
 
-#define BUFSIZE (30)		/* # chars read in at a time, max */
+#define RXSIZE (64*1024)	/* Default serial receive buffer */
+#define RXHOLD_MAX (10)		/* Longest we let a busy port fill, msec */
+#define TTYQ (4096)		/* What a tty holds before it throttles */
+#define LOGRING (1024*1024)	/* Default session capture ring */
+#define KBDSIZE (256)		/* Keyboard read size, typing */
+#define PASTESIZE (16*1024)	/*  ...and while pasting */
+#define TXSIZE (64*1024)	/* Keyboard -> serial queue */
 
 static struct termios ntty, otty, ext;
-static int baud = B9600;
-static void proto_xfer();
-static FILE *logfp = NULL;
+static long speed = 9600;	/* Bits/sec, -s (ports' default) */
+static void proto_xfer(), xfer_start(int, char *);
+static void zm_send(char *), zm_recv(void);
+static void xm_send(char *, int), xm_recv(char *, int);
+static void ts_send(char *);
+static int trig_format(char *, size_t, int), rt_format(char *, size_t, int);
+static int frame_format(char *, size_t, int);
+static char *logname = NULL;	/* First port's session capture, -l */
 
-static int ttyfd, child;	/* Needed for quit function */
+static int ttyfd, rs232;	/* User's terminal, serial port */
+static volatile sig_atomic_t quitsig;	/* Set by SIGTERM/SIGHUP */
+static int exit_code;		/* What done() exits with */
 
-static int parodd, pareven,	/* Parity? */
+static int parodd, pareven,	/* Parity? (ports' default) */
     seven_bits;			/* 7 bit format (else 8) */
+static int flow;		/* FLOW_* bits, -f (ports' default) */
+static int lowlat;		/*  ...and low latency there, too */
+static int parmrk;		/*  ...and PARMRK: 1 marks errors, 2 shows them */
+#define FLOW_RTS (1)		/* RTS/CTS */
+#define FLOW_XON (2)		/* XON/XOFF */
 
 static int raw_kbd = 0;		/* Don't map \r to \n on input typing? */
+static int strip_hi = -1;	/* Strip data to 7 bits? (-m, -8; else -7) */
+static int relay_copy = 0;	/* Never splice(), always copy (-c) */
+static char *net_addr;		/* Serve the port on [<host>:]<port>, -N */
+static int ntrigs;		/* Patterns we're watching for, -T */
+static int fr_kind;		/* Frames to take out, FR_*, -F */
+static char *fr_name;		/*  ...and where the first port's go */
+static int paste_mode = 0;	/* Bulk keyboard transfer (-P, ^Z-p) */
+static int reconnect;		/* Wait out a port going away (-a) */
+static char *batch_name;	/* Script to run on every port, -B */
+
+/*
+ * Keystrokes are read a block at a time; kbuf[kbpos..kblen) is
+ * what's been read but not yet looked at (proto_xfer() and
+ * prompt_read() take their characters from here first).  What's
+ * bound for the serial port waits in txbuf[txoff..txlen) until the
+ * port will take it.  (In batch mode each port has a queue of its
+ * own, and txbuf is the current one's.)
+ */
+static char kbuf[PASTESIZE];
+static int kbpos, kblen;
+static char txbuf0[TXSIZE], *txbuf = txbuf0;
+static int txoff, txlen;
+
+/*
+ * Serial receive.  Reads are non-blocking and take whatever is
+ * there, up to rxsize.  When the line is quiet every byte is
+ * handed on as soon as it arrives; when it's busy we let the port
+ * fill for rxhold msec between reads, so at high speed we make a
+ * few big reads rather than thousands of tiny ones.  With -b auto
+ * (the default) rxhold follows the traffic.
+ */
+static char *rxbuf;
+static int rxsize = RXSIZE;
+static int rxauto = 1;		/* Adapt rxhold to the traffic? */
+static int rxhold;		/* msec to let a busy port fill, -b */
+
+/* The attached port's reads go here instead; see "Receive fan-out" */
+static char *rxpool;
+static size_t rxpool_size;
+static unsigned long long rx_head;	/* Pool is written up to here */
+static struct evtimer rxpool_timer;	/* Full; try again soon */
+static int disp_skip;			/* -D full=skip */
+
+#ifdef HAVE_SPLICE
+/*
+ * When nothing needs to see or change the received bytes, they go
+ * port -> rxpipe -> terminal without coming up to user space, with
+ * tee() handing the log its own copy; see splice_input().
+ */
+static int relay_fast;		/* Using the splice() path */
+static int rxpipe[2] = {-1, -1};
+#endif
+
+/*
+ * Speeds which have a B* constant.  Anything else has to be set
+ * through a side door; see set_custom_speed().
+ */
+static struct speed {
+    long rate;
+    speed_t code;
+} speeds[] = {
+    {50, B50}, {75, B75}, {110, B110}, {134, B134}, {150, B150},
+    {200, B200}, {300, B300}, {600, B600}, {1200, B1200},
+    {1800, B1800}, {2400, B2400}, {4800, B4800}, {9600, B9600},
+    {19200, B19200}, {38400, B38400},
+#ifdef B57600
+    {57600, B57600},
+#endif
+#ifdef B115200
+    {115200, B115200},
+#endif
+#ifdef B230400
+    {230400, B230400},
+#endif
+#ifdef B460800
+    {460800, B460800},
+#endif
+#ifdef B500000
+    {500000, B500000},
+#endif
+#ifdef B576000
+    {576000, B576000},
+#endif
+#ifdef B921600
+    {921600, B921600},
+#endif
+#ifdef B1000000
+    {1000000, B1000000},
+#endif
+#ifdef B1152000
+    {1152000, B1152000},
+#endif
+#ifdef B1500000
+    {1500000, B1500000},
+#endif
+#ifdef B2000000
+    {2000000, B2000000},
+#endif
+#ifdef B2500000
+    {2500000, B2500000},
+#endif
+#ifdef B3000000
+    {3000000, B3000000},
+#endif
+#ifdef B3500000
+    {3500000, B3500000},
+#endif
+#ifdef B4000000
+    {4000000, B4000000},
+#endif
+    {0, 0}
+};
+
+/*
+ * Linux takes arbitrary rates through the termios2 ioctls.  We
+ * can't include <asm/termbits.h> next to <termios.h>, so the
+ * kernel's structure is spelled out here; its size is encoded in
+ * TCGETS2, so a mismatch gets ENOTTY rather than a scribble.
+ */
+#if defined(__linux__) && defined(TCGETS2)
+#define HAVE_TERMIOS2
+#ifndef BOTHER
+#define BOTHER (0010000)
+#endif
+#ifndef IBSHIFT
+#define IBSHIFT (16)
+#endif
+struct termios2 {
+    tcflag_t c_iflag;
+    tcflag_t c_oflag;
+    tcflag_t c_cflag;
+    tcflag_t c_lflag;
+    cc_t c_line;
+    cc_t c_cc[19];
+    speed_t c_ispeed;
+    speed_t c_ospeed;
+};
+#endif
 
 /*
  * Protocols to receive under
@@ -38,450 +245,10221 @@ static int raw_kbd = 0;		/* Don't map \r to \n on input typing? */
 #define PROTO_TXT 4
 static int proto = PROTO_RZ;
 #define PROTO_CHAR '\32'	/* Control-Z starts protocol transfer */
+static int xfer_resume = 0;	/* Pick up interrupted transfers (-p ,resume) */
+static int xfer_blk = 0;	/* Block size (-p ,block=), 0 for default */
+static int xfer_stream = 0;	/* Ask for YMODEM-G (-p y,stream) */
+static int ts_cdelay, ts_ldelay;	/* Text pacing, msec (-p txt,cdelay=,ldelay=) */
+static char *ts_prompt;		/* Wait for this after each line (-p txt,prompt=) */
+static int ts_echo;		/*  ...or for the line to echo (-p txt,echo) */
+static int ts_cr;		/* Send newlines as CR (-p txt,cr) */
 
-/* For suspending reader/writer during file transfer */
-static void
-usr2(int dummy)
+/*
+ * Event loop
+ *
+ * Every descriptor we service (serial port, keyboard, and whatever
+ * else comes along) is described by an evsrc.  ev_wait() sleeps
+ * until one or more of them is ready, then calls their handlers.
+ * Since it's all one process, a handler can look at or change any
+ * of our state; no more signalling a reader child to get out of
+ * the way during a file transfer.
+ *
+ * Linux uses epoll, everybody else gets poll(); -E uring asks for
+ * io_uring instead, where there is one.
+ */
+#define EV_IN (1)		/* Wake for input */
+#define EV_OUT (2)		/* Wake when output would not block */
+#define EV_ERR (4)		/* (revents only) error or hangup */
+
+struct evsrc {
+    int fd;
+    int events;			/* EV_IN|EV_OUT wanted, 0 if idle */
+    void (*handler)(struct evsrc *, int);
+    int slot;			/* io_uring's name for it, or 0 */
+};
+static struct evsrc kbd_src;
+static int ev_uring;		/* -E uring, and we have it */
+
+/*
+ * Timers; an armed evtimer's handler is called from ev_wait()
+ * once its time (on the ev_now() clock) has come.
+ */
+struct evtimer {
+    long long when;		/* usec */
+    void (*handler)(struct evtimer *);
+    struct evtimer *next;
+    int armed;
+    struct port *port;		/* -B: whose it is; made current first */
+};
+static struct evtimer *evtimers;	/* Armed ones, soonest first */
+
+/*
+ * A protocol transfer in progress.  While there is one, received
+ * data goes to its input routine instead of the user, keystrokes
+ * to its key routine, and whenever the transmit queue has room its
+ * pump routine (if any) may queue more.  The timer is first so a
+ * timer handler can find its transfer.
+ */
+struct xfer {
+    struct evtimer timer;
+    char *proto;		/* Protocol name, for messages */
+    void (*input)(struct xfer *, unsigned char *, int);
+    void (*pump)(struct xfer *);
+    void (*key)(struct xfer *, int);
+    void (*end)(struct xfer *);	/* Free up; remote is done with us */
+    long long started, shown;	/* usec; start, last progress line */
+    int ok;			/* Finished as it should (xfer_done()) */
+    int raw;			/* Unescaped binary; XON/XOFF off meanwhile */
+};
+static struct xfer *xfer;	/* Active one, if any */
+static int xfer_input(unsigned char *, int);
+static int xfer_rest;		/* What it didn't take, if it ended */
+static void xfer_key(int), xfer_finish(char *), xfer_done(char *);
+static void net_put(void), net_arm(void);
+static void disp_sync(void), disp_kick(void);
+static unsigned long long disp_elided(void);
+static char *rx_room(int *);
+static void rx_out(struct port *, char *, int);
+
+/*
+ * Serial ports; each tty argument is one.  The keyboard and screen
+ * are attached to one at a time, "cur", and rs232 is its
+ * descriptor (also our stdin and stdout, for external programs).
+ * The others are still read, so their capture carries on and
+ * their devices don't back up, but what they say isn't shown.
+ * Buffers are shared; only settings and receive pacing are kept
+ * for each port.
+ */
+struct port {
+    struct evsrc src;		/* Must be first */
+    char *tty;
+    int num;			/* 1, 2, ... */
+    long speed;
+    int parodd, pareven,	/* Parity? */
+	seven_bits;		/* 7 bit format (else 8) */
+    int strip_hi;		/* Strip received data to 7 bits? */
+    int flow;			/* FLOW_* */
+    int lowlat;			/* Asked for low latency */
+    int oldflags, oldtimer;	/*  ...and what to put back, or -1 */
+    struct logring *log;	/* Session capture, -l or ,l= */
+    int fast;			/* Port takes splice() */
+    int rxhold;			/* msec to let it fill, if busy */
+    int rxheld;			/*  ...and we're doing that now */
+    long long rxlast;		/* When we last read it, usec */
+    struct evtimer rx_timer;
+    int reconnect;		/* If it goes away, wait for it */
+    long long lost;		/*  ...since when it has, usec, or 0 */
+    struct job *job;		/* -B: its run of the script */
+    int parmrk;			/* Mark line errors (2: and show them) */
+    int pmstate;		/*  ...part way through a mark */
+    unsigned long long rxpos;	/*  ...bytes it's said, marks out */
+    unsigned long long rxerrs, rxerrlast;	/*  ...and how many of them */
+						/*  had errors, the last where */
+    struct framer *fr;		/* -F: taking frames out */
+    struct logring *frlog;	/*  ...and where they go, file= or ,frames= */
+#ifdef HAVE_URING
+    int ureading;		/* -E uring: a read of it is out */
+    int ustop;			/*  ...and has been told to stop */
+#endif
+#ifdef TIOCGICOUNT
+    struct serial_icounter_struct icount0;	/* UART counts at start */
+#endif
+};
+static struct port *ports, *cur;
+static int nports;
+static void rx_release(struct evtimer *), serial_lowlat(struct port *, int);
+static void port_lost(struct port *), port_switch(struct port *);
+static void batch_input(struct port *, char *, int);
+static void batch_xfer(int, char *);
+static int batch_queued(struct port *);
+static void disp_mark(unsigned long long), disp_say(int, char *, int);
+static struct framer *frame_new(void);
+static void crc_init(void);
+static unsigned short crc16_upd(unsigned short, unsigned char *, size_t);
+static unsigned int crc32_upd(unsigned int, unsigned char *, size_t);
+#define PORT_OF(p, field) ((struct port *)((char *)(p) - offsetof(struct port, field)))
+
+static struct evsrc **evsrcs;	/* Registered sources */
+static int nevsrc, maxevsrc;
+#ifdef __linux__
+static int epfd = -1;
+#endif
+
+#ifdef HAVE_URING
+/*
+ * io_uring (-E uring)
+ *
+ * The same sources, but what each one is waiting for is a one-shot
+ * IORING_OP_POLL_ADD, posted again after it fires (so, like epoll
+ * here, it's level triggered).  Changes are only noted as they're
+ * made; however many times a source is re-armed in a pass through
+ * the loop, just the last of it goes to the kernel, along with the
+ * wait, in one io_uring_enter().  A port the keyboard isn't
+ * attached to needn't cost a syscall of its own at all; it is read
+ * from the ring too (see uring_read()).
+ *
+ * A completion names a slot rather than a source, as a source can
+ * be freed while a poll of it is on its way back.  Each slot
+ * numbers its polls, and one whose number is out of date is old
+ * news.
+ */
+#define UR_ENTRIES (256)	/* Submission queue */
+#define UR_IGNORE (~0ULL)	/* user_data of replies we don't want */
+#define UR_READ (1ULL)		/* ...of a port's read, not a poll */
+#define UR_BGID (1)		/* Our read buffers' group */
+#define UR_DATA(slot, seq) (((unsigned long long)(seq) << 32) | ((slot) << 1))
+
+static struct {
+    int fd;
+    unsigned *sqhead, *sqtail, *sqarray, sqmask, tail;
+    unsigned *cqhead, *cqtail, cqmask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    int reads;			/* Ports are read through it */
+    struct io_uring_buf_ring *br;	/*  ...into buffers from here, */
+    char *buf;			/*  ...which are these */
+    int nbuf, bsize;
+    unsigned short btail;	/* Buffers handed over so far */
+} ur = {-1};
+
+struct evslot {
+    struct evsrc *src;		/* 0 once it's gone */
+    unsigned seq;		/* Number of its latest poll */
+    int armed;			/*  ...which is out, for these events */
+    int dirty;			/* On ur_dirty[], to be looked at */
+};
+static struct evslot *evslots;	/* [0] isn't used */
+static int nevslot, *ur_dirty, ndirty;
+
+static void uring_input(struct port *, int, unsigned);
+static void uring_give(int);
+static int uring_read(struct port *, int);
+
+/*
+ * ur_init()
+ *	Set up the ring; -1 if it won't be used
+ */
+static int
+ur_init(void)
+{
+    struct io_uring_params prm;
+    struct io_uring_buf_reg reg;
+    size_t sqlen, cqlen;
+    char *sq, *cq;
+    int x;
+
+    /* Only the event loop ever touches it */
+    memset(&prm, 0, sizeof(prm));
+    prm.flags = IORING_SETUP_SINGLE_ISSUER|IORING_SETUP_DEFER_TASKRUN;
+    if ((ur.fd = syscall(__NR_io_uring_setup, UR_ENTRIES, &prm)) < 0) {
+	memset(&prm, 0, sizeof(prm));
+	if ((ur.fd = syscall(__NR_io_uring_setup, UR_ENTRIES, &prm)) < 0) {
+	    return(-1);
+	}
+    }
+    if (!(prm.features & IORING_FEAT_EXT_ARG)) {
+	close(ur.fd);
+	errno = ENOSYS;
+	return(-1);
+    }
+    sqlen = prm.sq_off.array + prm.sq_entries * sizeof(unsigned);
+    cqlen = prm.cq_off.cqes + prm.cq_entries * sizeof(struct io_uring_cqe);
+    if (prm.features & IORING_FEAT_SINGLE_MMAP) {
+	sqlen = cqlen = (sqlen > cqlen) ? sqlen : cqlen;
+    }
+    sq = mmap(NULL, sqlen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+	ur.fd, IORING_OFF_SQ_RING);
+    cq = (prm.features & IORING_FEAT_SINGLE_MMAP) ? sq : mmap(NULL, cqlen,
+	PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ur.fd,
+	IORING_OFF_CQ_RING);
+    ur.sqes = mmap(NULL, prm.sq_entries * sizeof(struct io_uring_sqe),
+	PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ur.fd, IORING_OFF_SQES);
+    if ((sq == MAP_FAILED) || (cq == MAP_FAILED) || (ur.sqes == MAP_FAILED)) {
+	close(ur.fd);
+	return(-1);
+    }
+    ur.sqhead = (unsigned *)(sq + prm.sq_off.head);
+    ur.sqtail = (unsigned *)(sq + prm.sq_off.tail);
+    ur.sqarray = (unsigned *)(sq + prm.sq_off.array);
+    ur.sqmask = *(unsigned *)(sq + prm.sq_off.ring_mask);
+    ur.tail = *ur.sqtail;
+    ur.cqhead = (unsigned *)(cq + prm.cq_off.head);
+    ur.cqtail = (unsigned *)(cq + prm.cq_off.tail);
+    ur.cqmask = *(unsigned *)(cq + prm.cq_off.ring_mask);
+    ur.cqes = (struct io_uring_cqe *)(cq + prm.cq_off.cqes);
+
+    /*
+     * The ports share one ring of read buffers, which the kernel
+     * only takes from once there's something to read, so idle ports
+     * don't tie any up.  Each port only ever has one read out, and
+     * its buffer comes back before we wait again, so one apiece will
+     * do.  Buffer rings are Linux 5.19; without them it's polls all
+     * round.
+     */
+    for (ur.nbuf = 16; ur.nbuf < nports; ur.nbuf *= 2)
+	;
+    ur.bsize = (rxsize < TTYQ) ? rxsize : TTYQ;
+    if (posix_memalign((void **)&ur.br, 4096,
+	    ur.nbuf * sizeof(struct io_uring_buf)) ||
+	    !(ur.buf = malloc(ur.nbuf * ur.bsize))) {
+	perror("read buffers");
+	exit(1);
+    }
+    memset(ur.br, 0, ur.nbuf * sizeof(struct io_uring_buf));
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long long)(uintptr_t)ur.br;
+    reg.ring_entries = ur.nbuf;
+    reg.bgid = UR_BGID;
+    if (syscall(__NR_io_uring_register, ur.fd, IORING_REGISTER_PBUF_RING,
+	    &reg, 1) == 0) {
+	for (x = 0; x < ur.nbuf; ++x) {
+	    uring_give(x);
+	}
+	ur.reads = 1;
+    } else {
+	free(ur.br);
+	free(ur.buf);
+    }
+    return(0);
+}
+
+/*
+ * ur_enter()
+ *	Hand the kernel what's queued, and maybe wait for completions
+ *
+ * "usec" is how long to wait, -1 forever; returns as for
+ * io_uring_enter().
+ */
+static int
+ur_enter(int wait, long long usec)
 {
-    signal(SIGUSR2, usr2);
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+
+    memset(&arg, 0, sizeof(arg));
+    if (wait && (usec >= 0)) {
+	ts.tv_sec = usec / 1000000;
+	ts.tv_nsec = (usec % 1000000) * 1000;
+	arg.ts = (unsigned long long)(uintptr_t)&ts;
+    }
+    __atomic_store_n(ur.sqtail, ur.tail, __ATOMIC_RELEASE);
+    return(syscall(__NR_io_uring_enter, ur.fd,
+	ur.tail - __atomic_load_n(ur.sqhead, __ATOMIC_ACQUIRE), wait,
+	(wait ? IORING_ENTER_GETEVENTS : 0) | IORING_ENTER_EXT_ARG,
+	&arg, sizeof(arg)));
+}
+
+/*
+ * ur_sqe()
+ *	Next free submission entry, cleared
+ *
+ * If the queue's filled up, what's in it goes in now.
+ */
+static struct io_uring_sqe *
+ur_sqe(void)
+{
+    struct io_uring_sqe *sqe;
+
+    while ((ur.tail - __atomic_load_n(ur.sqhead, __ATOMIC_ACQUIRE)) >
+	    ur.sqmask) {
+	if ((ur_enter(0, -1) < 0) && (errno != EINTR) && (errno != EBUSY)) {
+	    perror("io_uring_enter");
+	    exit(1);
+	}
+    }
+    sqe = &ur.sqes[ur.tail & ur.sqmask];
+    memset(sqe, 0, sizeof(*sqe));
+    ur.sqarray[ur.tail & ur.sqmask] = ur.tail & ur.sqmask;
+    ur.tail += 1;
+    return(sqe);
 }
 
+/*
+ * ur_mark()
+ *	Source "src" wants something else; sort it out before we wait
+ */
 static void
-usr1(int dummy)
+ur_mark(struct evsrc *src)
 {
-    signal(SIGUSR1, usr1);
-    pause();
+    int x, n;
+
+    if (!src->slot) {
+	for (x = 1; (x < nevslot) && evslots[x].src; ++x)
+	    ;
+	if (x >= nevslot) {
+	    n = nevslot;
+	    nevslot = n ? (n * 2) : 16;
+	    evslots = realloc(evslots, nevslot * sizeof(struct evslot));
+	    ur_dirty = realloc(ur_dirty, nevslot * sizeof(int));
+	    if (!evslots || !ur_dirty) {
+		perror("ev_add");
+		exit(1);
+	    }
+	    memset(&evslots[n], 0, (nevslot - n) * sizeof(struct evslot));
+	}
+	evslots[x].src = src;
+	src->slot = x;
+    }
+    if (!evslots[src->slot].dirty) {
+	evslots[src->slot].dirty = 1;
+	ur_dirty[ndirty++] = src->slot;
+    }
 }
 
-/* Entered when parent tells child to die */
-void
-do_term()
+/* Stop asking about slot "x"'s source */
+static void
+ur_unpoll(int x)
 {
-    if (logfp) {
-	fclose(logfp);
+    struct evslot *s = &evslots[x];
+    struct io_uring_sqe *sqe;
+
+    if (s->armed) {
+	sqe = ur_sqe();
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->addr = UR_DATA(x, s->seq);
+	sqe->user_data = UR_IGNORE;
+	s->seq += 1;
+	s->armed = 0;
     }
-    exit(0);
 }
 
-/* Tell what the command line options are */
+/*
+ * ur_forget()
+ *	Source "src" is going away
+ *
+ * Its slot can be used again right away; whatever's still to come
+ * back for it has the wrong number.
+ */
 static void
-usage(void)
+ur_forget(struct evsrc *src)
 {
-    fprintf(stderr,
-"Usage is: term [-eo7] [-s <speed>] [-p <protocol>] [-l <log>] [<tty>]\n");
-    exit(1);
+    if (src->slot) {
+	ur_unpoll(src->slot);
+	evslots[src->slot].src = NULL;
+	src->slot = 0;
+    }
 }
 
-/* Complain about bad parity selection (both even & odd) */
+/*
+ * ur_sync()
+ *	Queue up a poll for each source whose wants have changed, or
+ *	whose last poll has come back
+ */
 static void
-bad_parity(void)
+ur_sync(void)
 {
-    fprintf(stderr,
-	"Can't select both even and odd parity.\n");
-    usage();
+    struct io_uring_sqe *sqe;
+    struct evslot *s;
+    int x, want;
+
+    for (x = 0; x < ndirty; ++x) {
+	s = &evslots[ur_dirty[x]];
+	s->dirty = 0;
+	if (!s->src) {
+	    continue;
+	}
+	want = s->src->events;
+	if (s->armed != want) {
+	    ur_unpoll(ur_dirty[x]);
+	}
+	if (want && !s->armed) {
+	    sqe = ur_sqe();
+	    sqe->opcode = IORING_OP_POLL_ADD;
+	    sqe->fd = s->src->fd;
+	    sqe->poll32_events = ((want & EV_IN) ? POLLIN : 0) |
+		((want & EV_OUT) ? POLLOUT : 0);
+	    sqe->user_data = UR_DATA(ur_dirty[x], s->seq);
+	    s->armed = want;
+	}
+    }
+    ndirty = 0;
 }
 
 /*
- * done()
- *	Clean up and exit
+ * ur_poll()
+ *	ev_poll(), with io_uring
  */
 static void
-done(void)
+ur_poll(int timeout)
 {
-    kill(child, SIGTERM);
-    tcsetattr(ttyfd, TCSAFLUSH, &otty);
-    write(ttyfd, "Exiting\n", 8);
-    exit(0);
+    struct io_uring_cqe cqe;
+    struct evslot *s;
+    struct evsrc *src;
+    unsigned head;
+    int x, revents;
+
+    ur_sync();
+    if ((ur_enter(1, (timeout < 0) ? -1 : (timeout * 1000LL)) < 0) &&
+	    (errno != EINTR) && (errno != ETIME) && (errno != EBUSY)) {
+	perror("io_uring_enter");
+	exit(1);
+    }
+
+    /* Each is off the ring before it's acted on */
+    head = *ur.cqhead;
+    while (head != __atomic_load_n(ur.cqtail, __ATOMIC_ACQUIRE)) {
+	cqe = ur.cqes[head & ur.cqmask];
+	__atomic_store_n(ur.cqhead, ++head, __ATOMIC_RELEASE);
+	if (cqe.user_data == UR_IGNORE) {
+	    continue;
+	}
+	if (cqe.user_data & UR_READ) {
+	    uring_input((struct port *)(uintptr_t)(cqe.user_data & ~UR_READ),
+		cqe.res, cqe.flags);
+	    continue;
+	}
+	x = (int)((cqe.user_data & 0xFFFFFFFF) >> 1);
+	s = &evslots[x];
+	if (!(src = s->src) || ((cqe.user_data >> 32) != s->seq)) {
+	    continue;
+	}
+	s->seq += 1;
+	s->armed = 0;
+	ur_mark(src);
+	revents = (cqe.res < 0) ? EV_ERR :
+	    (((cqe.res & POLLIN) ? EV_IN : 0) |
+	    ((cqe.res & POLLOUT) ? EV_OUT : 0) |
+	    ((cqe.res & (POLLERR|POLLHUP|POLLNVAL)) ? EV_ERR : 0));
+	if (src->events && revents) {
+	    (*src->handler)(src, revents);
+	}
+    }
 }
+#endif
 
+#ifdef __linux__
 /*
- * setup_serial()
- *	Set serial port to our desired parameters
+ * ev_epoll()
+ *	Tell epoll a source went from "was" events to its current ones
  *
- * We have this in a function so we can do it not only when we
- * start up, but also after protocol transfers.  It turns out
- * that the serial port might not be left in the same state it
- * started in.
+ * Idle sources are taken out of the epoll set entirely; otherwise
+ * a hangup (which epoll always reports) would spin us.
  */
 static void
-setup_serial(rs232fd)
-	int rs232fd;
+ev_epoll(struct evsrc *src, int was)
 {
-    int fl;
+    struct epoll_event ev;
+    int op;
 
-    /*
-     * Set up serial port for local access.  Once we've
-     * set CLOCAL, turn off O_NDELAY.
-     */
-    tcgetattr(rs232fd, &ext);
-    ext.c_lflag &= ~(ECHO|ICANON|ISIG);
-    ext.c_cflag |= CLOCAL;	/* Ignore modem status */
-    ext.c_cflag &= ~(CSIZE);	/* Set # bits */
-    if (seven_bits) {
-	ext.c_cflag |= (CS7);
+#ifdef HAVE_URING
+    if (ev_uring) {
+	ur_mark(src);
+	return;
+    }
+#endif
+    if (!src->events) {
+	op = EPOLL_CTL_DEL;
+    } else if (!was) {
+	op = EPOLL_CTL_ADD;
     } else {
-	ext.c_cflag |= (CS8);
+	op = EPOLL_CTL_MOD;
     }
-    ext.c_cflag &= ~(CSTOPB);
-    if (!parodd && !pareven) {	/* Set parity */
-	ext.c_cflag &= ~(PARENB);
-    } else if (parodd) {
-	ext.c_cflag |= (PARODD);
+    ev.events = ((src->events & EV_IN) ? EPOLLIN : 0) |
+	((src->events & EV_OUT) ? EPOLLOUT : 0);
+    ev.data.ptr = src;
+    if ((epoll_ctl(epfd, op, src->fd, &ev) < 0) && (op != EPOLL_CTL_DEL)) {
+	perror("epoll_ctl");
+	exit(1);
     }
-    ext.c_oflag &= ~OPOST;
-    ext.c_iflag = 0;
-    ext.c_cc[VMIN] = BUFSIZE;
-    ext.c_cc[VTIME] = 1;
-    cfsetispeed(&ext, baud);
-    cfsetospeed(&ext, baud);
-    tcsetattr(rs232fd, TCSAFLUSH, &ext);
-
-    /* Permit sleeps on I/O now that we're ignoring modem control */
-    fl = fcntl(rs232fd, F_GETFL, 0);
-    fl &= ~(O_NDELAY);
-    (void)fcntl(rs232fd, F_SETFL, fl);
 }
+#endif
 
-int
-main(int argc, char **argv)
+/*
+ * ev_add()
+ *	Start watching a descriptor
+ */
+static void
+ev_add(struct evsrc *src)
 {
-    int rs232, x;
-    char c, *tty = DEFAULT_TTY;
-    extern char *optarg;
+    if (nevsrc == maxevsrc) {
+	maxevsrc = maxevsrc ? (maxevsrc * 2) : 8;
+	evsrcs = realloc(evsrcs, maxevsrc * sizeof(struct evsrc *));
+	if (!evsrcs) {
+	    perror("ev_add");
+	    exit(1);
+	}
+    }
+    evsrcs[nevsrc++] = src;
+#ifdef __linux__
+    if (src->events) {
+	ev_epoll(src, 0);
+    }
+#endif
+}
 
-    while ((x = getopt(argc, argv, "s:p:l:eo7r")) != -1) {
-	switch (x) {
+/*
+ * ev_set()
+ *	Change which events a source is waiting for
+ */
+static void
+ev_set(struct evsrc *src, int events)
+{
+    int was = src->events;
 
-	/*
-	 * Selection of baud rate
-	 */
-	case 's':
-	    if (!strcmp(optarg, "300")) {
-		baud = B300; 
-	    } else if (!strcmp(optarg, "1200")) {
-		baud = B1200; 
-	    } else if (!strcmp(optarg, "2400")) {
-		baud = B2400; 
-	    } else if (!strcmp(optarg, "9600")) {
-		baud = B9600; 
-	    } else if (!strcmp(optarg, "19200")) {
-		baud = B19200; 
-	    } else if (!strcmp(optarg, "38400")) {
-		baud = B38400; 
-	    } else if (!strcmp(optarg, "115200")) {
-		baud = B115200; 
-	    } else {
-		fprintf(stderr, "Illegal speed: %s\n", optarg);
-		usage();
-	    }
-	    break;
+    if (was == events) {
+	return;
+    }
+    src->events = events;
+#ifdef __linux__
+    ev_epoll(src, was);
+#endif
+}
 
-	/*
-	 * Selection of transfer protocol
-	 */
-	case 'p':
-	    if (!strcmp(optarg, "x")) {
-		proto = PROTO_RX;
-	    } else if (!strcmp(optarg, "y")) {
-		proto = PROTO_RY;
-	    } else if (!strcmp(optarg, "z")) {
-		proto = PROTO_RZ;
-	    } else if (!strcmp(optarg, "txt")) {
-		proto = PROTO_TXT;
-	    } else {
-		printf("Illegal protocol: %s\n", optarg);
-		usage();
-	    }
+/*
+ * ev_del()
+ *	Stop watching a descriptor
+ *
+ * The caller must not free the evsrc until the current ev_wait()
+ * has finished dispatching.
+ */
+static void
+ev_del(struct evsrc *src)
+{
+    int x;
+
+    for (x = 0; x < nevsrc; ++x) {
+	if (evsrcs[x] == src) {
+	    evsrcs[x] = evsrcs[--nevsrc];
 	    break;
+	}
+    }
+#ifdef __linux__
+    if (src->events) {
+	src->events = 0;
+	ev_epoll(src, 1);
+    }
+#endif
+#ifdef HAVE_URING
+    ur_forget(src);
+#endif
+    src->events = 0;
+}
 
-	/* Choose a log file */
-	case 'l':
-	    if ((logfp = fopen(optarg, "w")) == NULL) {
-		perror(optarg);
-		exit(1);
-	    }
+/*
+ * ev_now()
+ *	Monotonic clock, in usec
+ */
+static long long
+ev_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec * 1000000LL + ts.tv_nsec / 1000);
+}
+
+/*
+ * ev_untimer()
+ *	Cancel a timer (harmless if it isn't armed)
+ */
+static void
+ev_untimer(struct evtimer *t)
+{
+    struct evtimer **tp;
+
+    if (!t->armed) {
+	return;
+    }
+    for (tp = &evtimers; *tp; tp = &(*tp)->next) {
+	if (*tp == t) {
+	    *tp = t->next;
 	    break;
+	}
+    }
+    t->armed = 0;
+}
 
-	/* Set odd parity */
-	case 'o':
-	    if (pareven) {
-		bad_parity();
-	    }
-	    parodd = 1;
+/*
+ * ev_timer()
+ *	(Re)arm a timer to go off "usec" from now
+ */
+static void
+ev_timer(struct evtimer *t, long long usec)
+{
+    struct evtimer **tp;
+
+    ev_untimer(t);
+    t->when = ev_now() + usec;
+    for (tp = &evtimers; *tp; tp = &(*tp)->next) {
+	if ((*tp)->when > t->when) {
 	    break;
+	}
+    }
+    t->next = *tp;
+    *tp = t;
+    t->armed = 1;
+}
+
+/*
+ * ev_poll()
+ *	Wait up to "timeout" msec (-1 forever) and dispatch handlers
+ */
+static void
+ev_poll(int timeout)
+{
+    int x, n, revents;
+    struct evsrc *src;
+
+#ifdef __linux__
+    struct epoll_event evs[16];
+
+#ifdef HAVE_URING
+    if (ev_uring) {
+	ur_poll(timeout);
+	return;
+    }
+#endif
+    if ((n = epoll_wait(epfd, evs, 16, timeout)) < 0) {
+	if (errno == EINTR) {
+	    return;
+	}
+	perror("epoll_wait");
+	exit(1);
+    }
+    for (x = 0; x < n; ++x) {
+	src = evs[x].data.ptr;
+	revents = ((evs[x].events & EPOLLIN) ? EV_IN : 0) |
+	    ((evs[x].events & EPOLLOUT) ? EV_OUT : 0) |
+	    ((evs[x].events & (EPOLLERR|EPOLLHUP)) ? EV_ERR : 0);
+
+	/* Skip sources shut off by an earlier handler */
+	if (src->events && revents) {
+	    (*src->handler)(src, revents);
+	}
+    }
+#else
+    int nready = nevsrc;
+    struct evsrc *ready[nready ? nready : 1];
+    struct pollfd evpoll[nready ? nready : 1];
+
+    for (x = 0; x < nready; ++x) {
+	src = ready[x] = evsrcs[x];
+	evpoll[x].fd = src->events ? src->fd : -1;
+	evpoll[x].events = ((src->events & EV_IN) ? POLLIN : 0) |
+	    ((src->events & EV_OUT) ? POLLOUT : 0);
+	evpoll[x].revents = 0;
+    }
+    if ((n = poll(evpoll, nready, timeout)) < 0) {
+	if (errno == EINTR) {
+	    return;
+	}
+	perror("poll");
+	exit(1);
+    }
+    for (x = 0; (x < nready) && (n > 0); ++x) {
+	if (evpoll[x].revents == 0) {
+	    continue;
+	}
+	n -= 1;
+	src = ready[x];
+	revents = ((evpoll[x].revents & POLLIN) ? EV_IN : 0) |
+	    ((evpoll[x].revents & POLLOUT) ? EV_OUT : 0) |
+	    ((evpoll[x].revents & (POLLERR|POLLHUP|POLLNVAL)) ?
+		EV_ERR : 0);
+	if (src->events) {
+	    (*src->handler)(src, revents);
+	}
+    }
+#endif
+}
+
+/*
+ * ev_wait()
+ *	Wait for something to happen, and run it
+ *
+ * "timeout" is as for ev_poll(), but we'll wake sooner if a timer
+ * is due.
+ */
+static void
+ev_wait(int timeout)
+{
+    struct evtimer *t;
+    long long now;
+    int ms;
+
+    if (evtimers) {
+	now = ev_now();
+	ms = (evtimers->when > now) ? ((evtimers->when - now + 999) / 1000) : 0;
+	if ((timeout < 0) || (ms < timeout)) {
+	    timeout = ms;
+	}
+    }
+    ev_poll(timeout);
+    now = ev_now();
+    while ((t = evtimers) && (t->when <= now)) {
+	evtimers = t->next;
+	t->armed = 0;
+	if (t->port) {
+	    port_switch(t->port);
+	}
+	(*t->handler)(t);
+    }
+}
+
+/*
+ * ev_init()
+ *	Get the event loop ready to accept sources
+ */
+static void
+ev_init(void)
+{
+#ifdef HAVE_URING
+    if (ev_uring && (ur_init() < 0)) {
+	fprintf(stderr, "io_uring: %s; using epoll\r\n", strerror(errno));
+	ev_uring = 0;
+    }
+    if (ev_uring) {
+	return;
+    }
+#else
+    if (ev_uring) {
+	fprintf(stderr, "No io_uring here; using poll\r\n");
+	ev_uring = 0;
+    }
+#endif
+#ifdef __linux__
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+	perror("epoll_create");
+	exit(1);
+    }
+#endif
+}
+
+/* SIGTERM and friends; let the event loop notice and clean up */
+static void
+sigquit(int sig)
+{
+    quitsig = sig;
+}
+
+/*
+ * getsize()
+ *	Parse a byte count, with optional k/m/g suffix
+ *
+ * Returns -1 if it doesn't look like one.
+ */
+static long long
+getsize(char *str, char **endp)
+{
+    long long val;
+    char *p;
+
+    val = strtoll(str, &p, 10);
+    if ((p == str) || (val < 0)) {
+	return(-1);
+    }
+    switch (*p) {
+    case 'g': case 'G':
+	val *= 1024;
+	/* FALLTHROUGH */
+    case 'm': case 'M':
+	val *= 1024;
+	/* FALLTHROUGH */
+    case 'k': case 'K':
+	val *= 1024;
+	p += 1;
+	break;
+    }
+    if (endp) {
+	*endp = p;
+    } else if (*p) {
+	return(-1);
+    }
+    return(val);
+}
+
+/* Tell what the command line options are */
+static void
+usage(void)
+{
+    fprintf(stderr,
+"Usage is: term [-eo78mrPca] [-s <speed>] [-p <protocol>] [-l <log>]\n"
+"\t[-b auto|<bufsize>[,<msec>]] [-L <logopt>,...] [-S <sec>[,<file>]]\n"
+"\t[-f <flowopt>,...] [-N [<host>:]<port>[,rfc2217][,queue=<size>]]\n"
+"\t[-R <capture>[,x=<factor>][,max][,loop]] [-T <triggers>]\n"
+"\t[-M <name>[,size=<size>][,tx]] [-E poll|uring]\n"
+"\t[-D full=block|skip[,queue=<size>][,mode=raw|caret|hex|time]]\n"
+"\t[-B <script>|-] [-X fifo[=<prio>][,cpu=<n>][,mlock]]\n"
+"\t[-F slip|cobs|len[,sync=<hex>][,size=1|2|4][,be][,crc=16|32]\n"
+"\t    [,max=<size>][,file=<frames>]]\n"
+"\t[<tty>[,<portopt>...] ...]\n"
+"Flow options: rtscts, xonxoff, none, lowlat, parmrk[=show]\n"
+"Port options: s=<speed>, l=<log>, e, o, 7, 8, m, rtscts, xonxoff, noflow,\n"
+"\tlowlat, reconnect, parmrk[=show], frames=<file>\n"
+"Log options: ring=<size>, full=block|drop-oldest|drop-newest,\n"
+"\tcompress=none|zstd|lz4, flush=<sec>, rotate=<size>, every=<n>[smhd],\n"
+"\thook=<cmd>, format=raw|stamped\n"
+"Protocol: -p x|y|z|txt[,resume][,block=<size>][,stream]\n"
+"\t-p txt[,cdelay=<msec>][,ldelay=<msec>][,prompt=<text>][,echo][,cr]\n");
+    exit(1);
+}
+
+/*
+ * proto_options()
+ *	Parse the settings after -p <protocol>,
+ */
+static void
+proto_options(char *opts)
+{
+    static char *tokens[] = {"resume", "block", "stream", "cdelay", "ldelay",
+	"prompt", "echo", "cr", NULL};
+    char *val, *p;
+    long long size;
+    int x;
+
+    while (*opts) {
+	switch (x = getsubopt(&opts, tokens, &val)) {
+	case 0:
+	    xfer_resume = 1;
+	    break;
+
+	case 1:
+	    if (!val || ((size = getsize(val, NULL)) < 32) || (size > 8192)) {
+		fprintf(stderr, "Illegal block size\n");
+		usage();
+	    }
+	    xfer_blk = size;
+	    break;
+
+	case 2:
+	    xfer_stream = 1;
+	    break;
+
+	case 3:
+	case 4:
+	    if (!val || ((size = strtol(val, &p, 10)) < 0) || *p ||
+		    (p == val) || (size > 60000)) {
+		fprintf(stderr, "Illegal delay\n");
+		usage();
+	    }
+	    *((x == 3) ? &ts_cdelay : &ts_ldelay) = size;
+	    break;
+
+	case 5:
+	    if (!val || !*val) {
+		fprintf(stderr, "Missing prompt\n");
+		usage();
+	    }
+	    ts_prompt = val;
+	    break;
+
+	case 6:
+	    ts_echo = 1;
+	    break;
+
+	case 7:
+	    ts_cr = 1;
+	    break;
+
+	default:
+	    fprintf(stderr, "Illegal protocol option: %s\n", val);
+	    usage();
+	}
+    }
+}
+
+/* parmrk, or parmrk=show */
+static int
+parmrk_option(char *val)
+{
+    if (!val) {
+	return(1);
+    }
+    return(strcmp(val, "show") ? -1 : 2);
+}
+
+/*
+ * flow_options()
+ *	Parse -f's list: rtscts, xonxoff, none, lowlat, parmrk[=show]
+ */
+static void
+flow_options(char *opts)
+{
+    static char *tokens[] = {"rtscts", "xonxoff", "none", "lowlat", "parmrk",
+	NULL};
+    char *val;
+
+    while (*opts) {
+	switch (getsubopt(&opts, tokens, &val)) {
+	case 0:
+	    flow |= FLOW_RTS;
+	    break;
+
+	case 1:
+	    flow |= FLOW_XON;
+	    break;
+
+	case 2:
+	    flow = 0;
+	    break;
+
+	case 3:
+	    lowlat = 1;
+	    break;
+
+	case 4:
+	    if ((parmrk = parmrk_option(val)) < 0) {
+		fprintf(stderr, "Illegal parmrk: %s\n", val);
+		usage();
+	    }
+	    break;
+
+	default:
+	    fprintf(stderr, "Illegal flow option: %s\n", val);
+	    usage();
+	}
+    }
+}
+
+/* Complain about bad parity selection (both even & odd) */
+static void
+bad_parity(void)
+{
+    fprintf(stderr,
+	"Can't select both even and odd parity.\n");
+    usage();
+}
+
+/*
+ * Session capture (-l)
+ *
+ * The receive path only ever copies into the ring; a writer thread
+ * takes it from there to the file, so a slow or stuck disk backs
+ * up the ring rather than the serial port.  What happens when the
+ * ring does fill is up to -L full=...
+ *
+ * With -L compress=zstd or lz4 (if built with -DHAVE_ZSTD -lzstd,
+ * or -DHAVE_LZ4 -llz4) the writer compresses on its way to the
+ * file.  Every -L flush= seconds the frame is finished and a new one
+ * begun, so a crash loses at most that much, and a capture still
+ * being written can be read with zstdcat or lz4cat up to there.
+ *
+ * -L rotate=<size> and every=<time> start a new file (a segment)
+ * once the current one is that big or that old.  The -l name is
+ * an strftime() pattern, with .1, .2, ... added when it comes out
+ * the same as last time.  A helper thread keeps the next file
+ * opened and preallocated, so rotating is just a rename(); it also
+ * closes finished segments and runs -L hook=<cmd> on each.
+ */
+#define LOG_BLOCK (0)		/* Full ring: wait for the writer */
+#define LOG_DROPOLD (1)		/*  ...or throw away the oldest data */
+#define LOG_DROPNEW (2)		/*  ...or the newest */
+
+#define LOG_PLAIN (0)		/* Capture format: as received */
+#define LOG_ZSTD (1)		/*  ...zstd frames */
+#define LOG_LZ4 (2)		/*  ...LZ4 frames */
+#define LOG_FLUSH (5)		/* Seconds per compressed frame */
+#define LOG_RETRY (5)		/* Seconds before another go at rotating */
+
+/*
+ * -L format=stamped keeps each chunk as a record: a 16 byte header
+ * (usec on the ev_now() clock, data length and type, all little
+ * endian) and the data.  Each CAP_SPAN of the file opens with an
+ * index record, whose data is CAP_MAGIC, the wall clock time
+ * (usec), the span's number, and the rx and tx bytes before it; a
+ * reader can mmap() a capture and binary search those by time.  An
+ * all-zero header (or a span's last few bytes) is filler.  Rotated
+ * segments always break on a span, so each stands alone.  capdump
+ * turns a capture back into text.
+ */
+#define CAP_MAGIC "TERMCAP1"
+#define CAP_SPAN (1024*1024)	/* Index every this many bytes */
+#define CAP_HDR (16)		/* Record header */
+#define CAP_INDEX (40)		/* Index record data */
+#define CAP_CHUNK (64*1024)	/* Most data in one record */
+#define CAP_RX (1)		/* Record types: received... */
+#define CAP_TX (2)		/*  ...sent... */
+#define CAP_I (3)		/*  ...index... */
+#define CAP_MARK (4)		/*  ...a note, from a trigger... */
+#define CAP_FRAME (5)		/*  ...a frame, -F... */
+#define CAP_BADFRAME (6)	/*  ...and one which failed its CRC */
+
+struct logring {
+    int fd;
+    char *name;
+    int pipe[2];		/* Fed by tee() instead, on the fast path */
+    char *buf;
+    size_t size;
+    unsigned long long head;	/* Bytes put in, ever */
+    unsigned long long rd;	/* Next byte the writer will take */
+    unsigned long long tail;	/* Oldest byte still using the ring */
+    int busy;			/* Writer is working on [tail..rd) */
+    int done;			/* No more coming; drain and exit */
+    int policy;			/* LOG_* */
+    int err;			/* errno from a failed write */
+    unsigned long long dropped;	/* Bytes we had to throw away */
+    size_t high;		/* Most of the ring ever in use */
+    int stamped;		/* -L format=stamped */
+    unsigned char *stage;	/*  ...a record being put together */
+    unsigned long long soff;	/*  ...where it goes in the capture */
+    unsigned long long rxbytes, txbytes;	/*  ...data so far */
+    size_t spanleft;		/* Writer: how far to the next span */
+    int zip;			/* LOG_PLAIN, LOG_ZSTD, LOG_LZ4 */
+    void *zctx;			/* Compressor... */
+    char *zbuf;			/*  ...its output... */
+    size_t zsize;
+    int zopen;			/*  ...and a frame's been started */
+    struct timespec zdue;	/*  ...which is to end by then */
+    char *cur;			/* Segment being written */
+    char *base;			/*  ...its name, before any .N */
+    int seq;			/*  ...and that N */
+    unsigned long long segbytes;	/*  ...how much it has */
+    time_t segstart;		/*  ...and since when */
+    time_t rotwait;		/* Couldn't start the next; try then */
+    int nextfd;			/* Ready for the next segment, or -1 */
+    char *nextpath;		/*  ...under a temporary name */
+    struct logseg *old;		/* Finished segments, for log_rotator() */
+    int rotdone;		/* No more of those coming */
+    pthread_mutex_t rotlock;
+    pthread_cond_t rotwake;
+    pthread_t rotator;
+    pthread_mutex_t lock;
+    pthread_cond_t more, room;
+    pthread_t writer;
+};
+static size_t logring_size = LOGRING;	/* -L ring= */
+static int log_policy = LOG_BLOCK;	/* -L full= */
+static int log_stamped;			/* -L format= */
+static int log_zip = LOG_PLAIN;		/* -L compress= */
+static int log_flush = LOG_FLUSH;	/* -L flush= */
+static unsigned long long log_rotsize;	/* -L rotate= */
+static long log_every;			/* -L every=, seconds */
+static char *log_hook;			/* -L hook= */
+static mode_t log_mode = 0666;		/* Segments', after umask */
+
+/* A finished segment, waiting to be closed and hooked */
+struct logseg {
+    int fd;
+    char *path;
+    struct logseg *next;
+};
+
+/*
+ * log_raw()
+ *	Write to the capture file, remembering the first error
+ */
+static void
+log_raw(struct logring *lr, char *buf, size_t len)
+{
+    ssize_t x;
+
+    while (len && !lr->err) {
+	if ((x = write(lr->fd, buf, len)) < 0) {
+	    if (errno != EINTR) {
+		lr->err = errno;
+	    }
+	    continue;
+	}
+	buf += x;
+	len -= x;
+	lr->segbytes += x;
+    }
+}
+
+/*
+ * log_zinit()
+ *	Set up the compressor, if there's to be one
+ */
+static void
+log_zinit(struct logring *lr)
+{
+#ifdef HAVE_ZSTD
+    if (lr->zip == LOG_ZSTD) {
+	if ((lr->zctx = ZSTD_createCCtx()) == NULL) {
+	    fprintf(stderr, "%s: can't set up zstd\n", lr->name);
+	    exit(1);
+	}
+	(void)ZSTD_CCtx_setParameter(lr->zctx, ZSTD_c_compressionLevel, 3);
+	lr->zsize = ZSTD_CStreamOutSize();
+    }
+#endif
+#ifdef HAVE_LZ4
+    if (lr->zip == LOG_LZ4) {
+	LZ4F_cctx *c;
+
+	if (LZ4F_isError(LZ4F_createCompressionContext(&c, LZ4F_VERSION))) {
+	    fprintf(stderr, "%s: can't set up lz4\n", lr->name);
+	    exit(1);
+	}
+	lr->zctx = c;
+	lr->zsize = LZ4F_HEADER_SIZE_MAX + LZ4F_compressBound(64 * 1024, NULL);
+    }
+#endif
+    if (lr->zsize && ((lr->zbuf = malloc(lr->zsize)) == NULL)) {
+	perror(lr->name);
+	exit(1);
+    }
+}
+
+/*
+ * log_out()
+ *	Captured data on its way to the file, compressed if need be
+ */
+static void
+log_out(struct logring *lr, char *buf, size_t len)
+{
+    if (!lr->zip) {
+	log_raw(lr, buf, len);
+	return;
+    }
+    if (!len || lr->err) {
+	return;
+    }
+    if (!lr->zopen) {
+	clock_gettime(CLOCK_REALTIME, &lr->zdue);
+	lr->zdue.tv_sec += log_flush;
+	lr->zopen = 1;
+#ifdef HAVE_LZ4
+	if (lr->zip == LOG_LZ4) {
+	    size_t n = LZ4F_compressBegin(lr->zctx, lr->zbuf, lr->zsize, NULL);
+
+	    if (LZ4F_isError(n)) {
+		lr->err = EIO;
+		return;
+	    }
+	    log_raw(lr, lr->zbuf, n);
+	}
+#endif
+    }
+#ifdef HAVE_ZSTD
+    if (lr->zip == LOG_ZSTD) {
+	ZSTD_inBuffer in = {buf, len, 0};
+	ZSTD_outBuffer out;
+
+	while ((in.pos < in.size) && !lr->err) {
+	    out.dst = lr->zbuf;
+	    out.size = lr->zsize;
+	    out.pos = 0;
+	    if (ZSTD_isError(ZSTD_compressStream2(lr->zctx, &out, &in,
+		    ZSTD_e_continue))) {
+		lr->err = EIO;
+		break;
+	    }
+	    log_raw(lr, lr->zbuf, out.pos);
+	}
+    }
+#endif
+#ifdef HAVE_LZ4
+    if (lr->zip == LOG_LZ4) {
+	size_t n, chunk;
+
+	for (; len && !lr->err; buf += chunk, len -= chunk) {
+	    chunk = (len > (64 * 1024)) ? (64 * 1024) : len;
+	    n = LZ4F_compressUpdate(lr->zctx, lr->zbuf, lr->zsize,
+		buf, chunk, NULL);
+	    if (LZ4F_isError(n)) {
+		lr->err = EIO;
+		break;
+	    }
+	    log_raw(lr, lr->zbuf, n);
+	}
+    }
+#endif
+}
+
+/*
+ * log_zflush()
+ *	Finish the frame in progress, if it's due (or "now")
+ */
+static void
+log_zflush(struct logring *lr, int now)
+{
+    struct timespec ts;
+
+    if (!lr->zopen) {
+	return;
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if (!now && ((ts.tv_sec < lr->zdue.tv_sec) ||
+	    ((ts.tv_sec == lr->zdue.tv_sec) &&
+	    (ts.tv_nsec < lr->zdue.tv_nsec)))) {
+	return;
+    }
+    lr->zopen = 0;
+#ifdef HAVE_ZSTD
+    if (lr->zip == LOG_ZSTD) {
+	ZSTD_inBuffer in = {NULL, 0, 0};
+	ZSTD_outBuffer out;
+	size_t left;
+
+	do {
+	    out.dst = lr->zbuf;
+	    out.size = lr->zsize;
+	    out.pos = 0;
+	    left = ZSTD_compressStream2(lr->zctx, &out, &in, ZSTD_e_end);
+	    if (ZSTD_isError(left)) {
+		lr->err = EIO;
+		break;
+	    }
+	    log_raw(lr, lr->zbuf, out.pos);
+	} while (left && !lr->err);
+    }
+#endif
+#ifdef HAVE_LZ4
+    if (lr->zip == LOG_LZ4) {
+	size_t n = LZ4F_compressEnd(lr->zctx, lr->zbuf, lr->zsize, NULL);
+
+	if (LZ4F_isError(n)) {
+	    lr->err = EIO;
+	} else {
+	    log_raw(lr, lr->zbuf, n);
+	}
+    }
+#endif
+}
+
+/*
+ * log_segname()
+ *	Name for a segment starting at "now"; malloc()'d
+ */
+static char *
+log_segname(struct logring *lr, time_t now)
+{
+    char buf[1024], *name;
+    struct tm tm;
+
+    localtime_r(&now, &tm);
+    if (strftime(buf, sizeof(buf), lr->name, &tm) == 0) {
+	snprintf(buf, sizeof(buf), "%s", lr->name);
+    }
+    if (lr->base && !strcmp(buf, lr->base)) {
+	lr->seq += 1;
+    } else {
+	free(lr->base);
+	lr->base = strdup(buf);
+	lr->seq = 0;
+    }
+    if (lr->seq) {
+	snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), ".%d", lr->seq);
+    }
+    if ((name = strdup(buf)) == NULL) {
+	perror(lr->name);
+	exit(1);
+    }
+    return(name);
+}
+
+/*
+ * log_retire()
+ *	Give a finished segment to the rotator; "last" if it's the end
+ */
+static void
+log_retire(struct logring *lr, int fd, char *path, int last)
+{
+    struct logseg *seg, **sp;
+
+    if ((seg = malloc(sizeof(struct logseg))) == NULL) {
+	close(fd);
+	free(path);
+	path = NULL;
+    }
+    pthread_mutex_lock(&lr->rotlock);
+    if (path) {
+	seg->fd = fd;
+	seg->path = path;
+	seg->next = NULL;
+	for (sp = &lr->old; *sp; sp = &(*sp)->next) {
+	    ;
+	}
+	*sp = seg;
+    }
+    lr->rotdone = last;
+    pthread_cond_signal(&lr->rotwake);
+    pthread_mutex_unlock(&lr->rotlock);
+}
+
+/*
+ * log_rotate()
+ *	Move on to a new segment
+ *
+ * The rotator has normally got one waiting for us; if it hasn't,
+ * we'll just have to open it ourselves.  Should that fail we stay
+ * where we are, going on past rotate= if need be, and try again
+ * in a while.
+ */
+static void
+log_rotate(struct logring *lr)
+{
+    time_t now = time(NULL);
+    char *name, *was, *next;
+    int fd;
+
+    log_zflush(lr, 1);		/* Each segment stands alone */
+    name = log_segname(lr, now);
+    pthread_mutex_lock(&lr->rotlock);
+    fd = lr->nextfd;
+    next = lr->nextpath;
+    lr->nextfd = -1;
+    lr->nextpath = NULL;
+    pthread_mutex_unlock(&lr->rotlock);
+    if ((fd >= 0) && (rename(next, name) < 0)) {
+	close(fd);
+	(void)unlink(next);
+	fd = -1;
+    }
+    free(next);
+    if ((fd < 0) && ((fd = open(name, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC,
+	    0666)) < 0)) {
+	free(name);
+	lr->rotwait = now + LOG_RETRY;
+	return;
+    }
+    pthread_mutex_lock(&lr->rotlock);
+    was = lr->cur;
+    lr->cur = name;
+    pthread_mutex_unlock(&lr->rotlock);
+    log_retire(lr, lr->fd, was, 0);
+    lr->fd = fd;
+    lr->segbytes = 0;
+    lr->segstart = now;
+}
+
+/* Time for a new segment? */
+static int
+log_due(struct logring *lr)
+{
+    time_t now = time(NULL);
+
+    if (now < lr->rotwait) {
+	return(0);
+    }
+    return((log_rotsize && (lr->segbytes >= log_rotsize)) ||
+	(log_every && (now >= (lr->segstart + log_every))));
+}
+
+/* How much more fits in this segment, up to "n" */
+static size_t
+log_room(struct logring *lr, size_t n)
+{
+    if (log_rotsize && (lr->segbytes < log_rotsize) &&
+	    (n > (log_rotsize - lr->segbytes))) {
+	n = log_rotsize - lr->segbytes;
+    }
+    return(n);
+}
+
+/*
+ * log_emit()
+ *	Captured data for the file, starting new segments as need be
+ *
+ * Uncompressed, a segment breaks exactly at rotate=; compressed,
+ * within 64k of input past it.  A stamped capture only breaks at
+ * the start of a span, the first one after that.
+ */
+static void
+log_emit(struct logring *lr, char *buf, size_t len)
+{
+    size_t n;
+
+    if (!log_rotsize && !log_every) {
+	log_out(lr, buf, len);
+	return;
+    }
+    while (len && !lr->err) {
+	if ((!lr->stamped || (lr->spanleft == CAP_SPAN)) && log_due(lr)) {
+	    log_rotate(lr);
+	}
+	n = (len > (64 * 1024)) ? (64 * 1024) : len;
+	if (lr->stamped) {
+	    if (n > lr->spanleft) {
+		n = lr->spanleft;
+	    }
+	    if ((lr->spanleft -= n) == 0) {
+		lr->spanleft = CAP_SPAN;
+	    }
+	} else if (!lr->zip) {
+	    n = log_room(lr, n);
+	}
+	log_out(lr, buf, n);
+	buf += n;
+	len -= n;
+    }
+}
+
+/*
+ * log_hookrun()
+ *	Hand a finished segment to -L hook=, and wait for it
+ */
+static void
+log_hookrun(char *path)
+{
+    extern char **environ;
+    char *argv[6], cmd[1024];
+    pid_t pid;
+    int st;
+
+    snprintf(cmd, sizeof(cmd), "%s \"$1\"", log_hook);
+    argv[0] = "sh";
+    argv[1] = "-c";
+    argv[2] = cmd;
+    argv[3] = "sh";
+    argv[4] = path;
+    argv[5] = NULL;
+    if (posix_spawn(&pid, "/bin/sh", NULL, NULL, argv, environ) == 0) {
+	while ((waitpid(pid, &st, 0) < 0) && (errno == EINTR)) {
+	    ;
+	}
+    }
+}
+
+/*
+ * log_rotator()
+ *	Thread which gets segments ready, and finishes them off
+ *
+ * The next one is opened under a temporary name next to the
+ * current one, and (on Linux) given rotate= bytes of disk up front
+ * without changing its size, so the writer never waits on the
+ * filesystem to find room.
+ */
+static void *
+log_rotator(void *arg)
+{
+    struct logring *lr = arg;
+    struct logseg *seg;
+    char *path, *slash;
+    int fd;
+
+    pthread_mutex_lock(&lr->rotlock);
+    for (;;) {
+	while (!lr->old && (lr->nextfd != -1) && !lr->rotdone) {
+	    pthread_cond_wait(&lr->rotwake, &lr->rotlock);
+	}
+	if ((seg = lr->old) != NULL) {
+	    lr->old = seg->next;
+	    pthread_mutex_unlock(&lr->rotlock);
+	    close(seg->fd);
+	    if (log_hook) {
+		log_hookrun(seg->path);
+	    }
+	    free(seg->path);
+	    free(seg);
+	    pthread_mutex_lock(&lr->rotlock);
+	    continue;
+	}
+	if (lr->rotdone) {
+	    break;
+	}
+
+	/* Get the next one ready */
+	if ((path = malloc(strlen(lr->cur) + 32)) != NULL) {
+	    strcpy(path, lr->cur);
+	    slash = strrchr(path, '/');
+	    strcpy(slash ? (slash + 1) : path, ".term-next-XXXXXX");
+	}
+	pthread_mutex_unlock(&lr->rotlock);
+	if (!path || ((fd = mkostemp(path, O_CLOEXEC)) < 0)) {
+	    free(path);
+	    pthread_mutex_lock(&lr->rotlock);
+	    lr->nextfd = -2;	/* log_rotate() opens its own */
+	    continue;
+	}
+	(void)fchmod(fd, log_mode);	/* mkstemp() made it 0600 */
+#ifdef FALLOC_FL_KEEP_SIZE
+	if (log_rotsize) {
+	    (void)fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, (off_t)log_rotsize);
+	}
+#endif
+	pthread_mutex_lock(&lr->rotlock);
+	lr->nextpath = path;
+	lr->nextfd = fd;
+    }
+    if (lr->nextfd >= 0) {
+	close(lr->nextfd);
+	(void)unlink(lr->nextpath);
+    }
+    pthread_mutex_unlock(&lr->rotlock);
+    return(NULL);
+}
+
+/*
+ * log_writer()
+ *	Thread which moves captured data from the ring to the file
+ *
+ * The lock is only held to look at the ring; the write itself
+ * happens on a chunk we've claimed [tail..rd), which the receive
+ * side won't touch until we give it back.
+ */
+static void *
+log_writer(void *arg)
+{
+    struct logring *lr = arg;
+    size_t off, len;
+
+    pthread_mutex_lock(&lr->lock);
+    for (;;) {
+	while ((lr->rd == lr->head) && !lr->done) {
+	    if (!lr->zopen) {
+		pthread_cond_wait(&lr->more, &lr->lock);
+	    } else if (pthread_cond_timedwait(&lr->more, &lr->lock,
+		    &lr->zdue) == ETIMEDOUT) {
+		pthread_mutex_unlock(&lr->lock);
+		log_zflush(lr, 1);
+		pthread_mutex_lock(&lr->lock);
+	    }
+	}
+	if (lr->rd == lr->head) {
+	    break;
+	}
+	off = lr->rd % lr->size;
+	len = lr->head - lr->rd;
+	if (len > (lr->size - off)) {
+	    len = lr->size - off;
+	}
+	lr->rd += len;
+	lr->busy = 1;
+	pthread_mutex_unlock(&lr->lock);
+
+	log_emit(lr, lr->buf + off, len);
+	log_zflush(lr, 0);
+
+	pthread_mutex_lock(&lr->lock);
+	lr->busy = 0;
+	lr->tail = lr->rd;
+	pthread_cond_signal(&lr->room);
+    }
+    pthread_mutex_unlock(&lr->lock);
+    log_zflush(lr, 1);
+    return(NULL);
+}
+
+#ifdef HAVE_SPLICE
+/*
+ * log_splicer()
+ *	Writer thread for a piped log: pipe to file in the kernel
+ *
+ * A compressed capture has to come up to us, of course, and a
+ * frame that's due to finish gets us out of the read to do it.
+ */
+static void *
+log_splicer(void *arg)
+{
+    struct logring *lr = arg;
+    char buf[64*1024];
+    struct pollfd pfd;
+    struct timespec ts;
+    ssize_t x, n;
+    int copy = (lr->zip != LOG_PLAIN);
+
+    for (;;) {
+	if (!copy) {
+	    n = 1024*1024;
+	    if (log_rotsize || log_every) {
+		if (log_due(lr)) {
+		    log_rotate(lr);
+		}
+		n = log_room(lr, n);
+	    }
+	    x = splice(lr->pipe[0], NULL, lr->fd, NULL, n, SPLICE_F_MOVE);
+	    if ((x < 0) && (errno == EINVAL)) {
+		copy = 1;	/* Filesystem won't; do it by hand */
+		continue;
+	    }
+	    if (x > 0) {
+		lr->segbytes += x;
+	    }
+	} else {
+	    if (lr->zopen) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		pfd.fd = lr->pipe[0];
+		pfd.events = POLLIN;
+		x = (lr->zdue.tv_sec - ts.tv_sec) * 1000 +
+		    (lr->zdue.tv_nsec - ts.tv_nsec) / 1000000;
+		if ((x <= 0) || (poll(&pfd, 1, (int)x) == 0)) {
+		    log_zflush(lr, 1);
+		}
+	    }
+	    if ((x = read(lr->pipe[0], buf, sizeof(buf))) > 0) {
+		log_emit(lr, buf, x);
+		log_zflush(lr, 0);
+	    }
+	}
+	if (x == 0) {
+	    break;
+	}
+	if ((x < 0) && (errno != EINTR)) {
+	    lr->err = errno;
+	    copy = 1;		/* Keep draining so the pipe can't jam */
+	}
+    }
+    log_zflush(lr, 1);
+    return(NULL);
+}
+#endif
+
+/*
+ * log_open()
+ *	Create the capture file; the writer starts in log_start()
+ */
+static struct logring *
+log_open(char *name)
+{
+    struct logring *lr;
+
+    if ((lr = calloc(1, sizeof(struct logring))) == NULL) {
+	perror(name);
+	exit(1);
+    }
+    lr->name = name;
+    lr->segstart = time(NULL);
+    lr->cur = log_segname(lr, lr->segstart);
+    if ((lr->fd = open(lr->cur, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC,
+	    0666)) < 0) {
+	perror(lr->cur);
+	exit(1);
+    }
+    lr->pipe[0] = lr->pipe[1] = -1;
+    lr->nextfd = -1;
+    return(lr);
+}
+
+/*
+ * log_start()
+ *	Size the ring and start its writer
+ *
+ * If "piped", the capture arrives through a pipe (which takes the
+ * ring's place) rather than log_put()'s copies.  The writer
+ * doesn't take signals; those are for the event loop.
+ */
+static void
+log_start(struct logring *lr, int piped)
+{
+    sigset_t all, old;
+    void *(*writer)(void *) = log_writer;
+    int x;
+
+    lr->size = logring_size;
+    lr->policy = log_policy;
+    lr->zip = log_zip;
+    log_zinit(lr);
+    lr->stamped |= log_stamped;	/* A frame capture (-F) always is */
+    lr->spanleft = CAP_SPAN;
+    if (lr->stamped) {
+	if (lr->size < (4 * (CAP_HDR + CAP_CHUNK))) {
+	    lr->size = 4 * (CAP_HDR + CAP_CHUNK);	/* Room for whole records */
+	}
+	if ((lr->stage = malloc(CAP_HDR + CAP_CHUNK)) == NULL) {
+	    perror(lr->name);
+	    exit(1);
+	}
+    }
+#ifdef HAVE_SPLICE
+    if (piped) {
+	if (pipe2(lr->pipe, O_CLOEXEC) < 0) {
+	    perror(lr->name);
+	    exit(1);
+	}
+	if ((x = fcntl(lr->pipe[0], F_SETPIPE_SZ, (int)lr->size)) > 0) {
+	    lr->size = x;
+	}
+	(void)fcntl(lr->pipe[1], F_SETFL, O_NONBLOCK);
+	writer = log_splicer;
+    } else
+#endif
+    if ((lr->buf = malloc(lr->size)) == NULL) {
+	perror(lr->name);
+	exit(1);
+    }
+    pthread_mutex_init(&lr->lock, NULL);
+    pthread_cond_init(&lr->more, NULL);
+    pthread_cond_init(&lr->room, NULL);
+    pthread_mutex_init(&lr->rotlock, NULL);
+    pthread_cond_init(&lr->rotwake, NULL);
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    if ((errno = pthread_create(&lr->writer, NULL, writer, lr)) ||
+	    ((log_rotsize || log_every) &&
+	    (errno = pthread_create(&lr->rotator, NULL, log_rotator, lr)))) {
+	perror(lr->name);
+	exit(1);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * log_ring()
+ *	Add captured bytes to the ring; returns how many went in
+ */
+static size_t
+log_ring(struct logring *lr, char *buf, size_t len)
+{
+    size_t off, n, avail, d, took = len;
+    ssize_t x;
+    struct pollfd pfd;
+
+    /*
+     * A piped log (the fast path was on, and then wasn't) just
+     * gets written to its pipe.
+     */
+    if (lr->pipe[1] >= 0) {
+	while (len) {
+	    if ((x = write(lr->pipe[1], buf, len)) > 0) {
+		buf += x;
+		len -= x;
+	    } else if ((x < 0) && (errno == EAGAIN) &&
+		    (lr->policy == LOG_BLOCK)) {
+		pfd.fd = lr->pipe[1];
+		pfd.events = POLLOUT;
+		(void)poll(&pfd, 1, -1);
+	    } else if ((x < 0) && (errno != EINTR)) {
+		lr->dropped += len;
+		took -= len;
+		break;
+	    }
+	}
+	return(took);
+    }
+
+    pthread_mutex_lock(&lr->lock);
+    avail = lr->size - (lr->head - lr->tail);
+    if (len > avail) {
+	switch (lr->policy) {
+	case LOG_BLOCK:
+	    break;
+
+	/*
+	 * Whatever the writer hasn't claimed yet can go; if that's
+	 * not enough, the rest comes off the end of this chunk.  A
+	 * stamped capture's records can't be cut into, so there it's
+	 * all or nothing.
+	 */
+	case LOG_DROPOLD:
+	    d = lr->stamped ? 0 : (lr->head - lr->rd);
+	    if (d > (len - avail)) {
+		d = len - avail;
+	    }
+	    lr->rd += d;
+	    if (!lr->busy) {
+		lr->tail = lr->rd;
+	    }
+	    lr->dropped += d;
+	    avail = lr->size - (lr->head - lr->tail);
+	    /* FALLTHROUGH */
+
+	case LOG_DROPNEW:
+	    if (len > avail) {
+		if (lr->stamped) {
+		    avail = 0;
+		}
+		lr->dropped += len - avail;
+		took -= len - avail;
+		len = avail;
+	    }
+	    break;
+	}
+    }
+    while (len) {
+	while ((avail = lr->size - (lr->head - lr->tail)) == 0) {
+	    pthread_cond_wait(&lr->room, &lr->lock);
+	}
+	off = lr->head % lr->size;
+	n = lr->size - off;
+	if (n > avail) {
+	    n = avail;
+	}
+	if (n > len) {
+	    n = len;
+	}
+	memcpy(lr->buf + off, buf, n);
+	lr->head += n;
+	buf += n;
+	len -= n;
+	if ((lr->head - lr->tail) > lr->high) {
+	    lr->high = lr->head - lr->tail;
+	}
+	pthread_cond_signal(&lr->more);
+    }
+    pthread_mutex_unlock(&lr->lock);
+    return(took);
+}
+
+/* Store "v" little-endian in "n" bytes at "p" */
+static void
+cap_le(unsigned char *p, unsigned long long v, int n)
+{
+    while (n--) {
+	*p++ = v & 0xFF;
+	v >>= 8;
+    }
+}
+
+/* ...and fetch it back */
+static unsigned long long
+cap_get(unsigned char *p, int n)
+{
+    unsigned long long v = 0;
+
+    while (n--) {
+	v = (v << 8) | p[n];
+    }
+    return(v);
+}
+
+/*
+ * log_stamp()
+ *	Add a chunk to a stamped capture, as one or more records
+ *
+ * Every CAP_SPAN bytes of the capture starts with an index record,
+ * so a record never straddles a span; one that would is split, and
+ * the tail of a span too short for any record is zero filled.  A
+ * frame (-F) is never split: if it won't fit, the rest of the span
+ * is filler and it starts the next.
+ */
+static void
+log_stamp(struct logring *lr, int type, char *buf, size_t len)
+{
+    unsigned char *r = lr->stage;
+    long long now = ev_now();
+    struct timeval tv;
+    size_t pos, left, n;
+
+    while (len) {
+	pos = lr->soff % CAP_SPAN;
+	left = CAP_SPAN - pos;
+	if (pos == 0) {
+	    gettimeofday(&tv, NULL);
+	    cap_le(r, now, 8);
+	    cap_le(r + 8, CAP_INDEX, 4);
+	    cap_le(r + 12, CAP_I, 4);
+	    memcpy(r + CAP_HDR, CAP_MAGIC, 8);
+	    cap_le(r + CAP_HDR + 8,
+		(unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec, 8);
+	    cap_le(r + CAP_HDR + 16, lr->soff / CAP_SPAN, 8);
+	    cap_le(r + CAP_HDR + 24, lr->rxbytes, 8);
+	    cap_le(r + CAP_HDR + 32, lr->txbytes, 8);
+	    n = CAP_HDR + CAP_INDEX;
+	} else if ((left <= CAP_HDR) || ((len > (left - CAP_HDR)) &&
+		((type == CAP_FRAME) || (type == CAP_BADFRAME)))) {
+	    memset(r, 0, left);	/* A frame's less than the stage */
+	    n = left;
+	} else {
+	    n = left - CAP_HDR;
+	    if (n > len) {
+		n = len;
+	    }
+	    if (n > CAP_CHUNK) {
+		n = CAP_CHUNK;
+	    }
+	    cap_le(r, now, 8);
+	    cap_le(r + 8, n, 4);
+	    cap_le(r + 12, type, 4);
+	    memcpy(r + CAP_HDR, buf, n);
+	    if (log_ring(lr, (char *)r, CAP_HDR + n) == 0) {
+		return;
+	    }
+	    lr->soff += CAP_HDR + n;
+	    if (type == CAP_RX) {
+		lr->rxbytes += n;
+	    } else if (type == CAP_TX) {
+		lr->txbytes += n;
+	    }
+	    buf += n;
+	    len -= n;
+	    continue;
+	}
+	if (log_ring(lr, (char *)r, n) == 0) {
+	    return;
+	}
+	lr->soff += n;
+    }
+}
+
+/*
+ * log_put()
+ *	Add received data to the capture
+ */
+static void
+log_put(struct logring *lr, char *buf, size_t len)
+{
+    if (lr->stamped) {
+	log_stamp(lr, CAP_RX, buf, len);
+    } else {
+	(void)log_ring(lr, buf, len);
+    }
+}
+
+/*
+ * log_tx()
+ *	What we sent; only a stamped capture keeps that
+ */
+static void
+log_tx(struct logring *lr, char *buf, size_t len)
+{
+    if (lr->stamped) {
+	log_stamp(lr, CAP_TX, buf, len);
+    }
+}
+
+/*
+ * log_mark()
+ *	Note "text" in the capture
+ *
+ * A stamped capture gets a record of its own; otherwise it's a line
+ * in with the data, with the time of day.
+ */
+static void
+log_mark(struct logring *lr, char *text)
+{
+    char buf[256], when[16];
+    struct timeval tv;
+    time_t sec;
+    int n;
+
+    if (lr->stamped) {
+	log_stamp(lr, CAP_MARK, text, strlen(text));
+	return;
+    }
+    gettimeofday(&tv, NULL);
+    sec = tv.tv_sec;
+    strftime(when, sizeof(when), "%H:%M:%S", localtime(&sec));
+    n = snprintf(buf, sizeof(buf), "\r\n[mark %s.%03d: %s]\r\n", when,
+	(int)(tv.tv_usec / 1000), text);
+    if (n >= (int)sizeof(buf)) {
+	n = sizeof(buf) - 1;
+    }
+    (void)log_ring(lr, buf, n);
+}
+
+/*
+ * log_close()
+ *	Let the writer drain the ring, then close up
+ */
+static void
+log_close(struct logring *lr)
+{
+    char msg[128];
+
+    if (lr->pipe[1] >= 0) {
+	close(lr->pipe[1]);	/* EOF tells log_splicer() to finish */
+    }
+    pthread_mutex_lock(&lr->lock);
+    lr->done = 1;
+    pthread_cond_signal(&lr->more);
+    pthread_mutex_unlock(&lr->lock);
+    pthread_join(lr->writer, NULL);
+    if (log_rotsize || log_every) {
+	log_retire(lr, lr->fd, lr->cur, 1);	/* Hook the last one too */
+	pthread_join(lr->rotator, NULL);
+    } else {
+	close(lr->fd);
+    }
+    if (lr->err) {
+	snprintf(msg, sizeof(msg), "%s: %s\r\n", lr->name, strerror(lr->err));
+	write(ttyfd, msg, strlen(msg));
+    }
+    if (lr->dropped) {
+	snprintf(msg, sizeof(msg), "%s: %llu bytes dropped\r\n",
+	    lr->name, lr->dropped);
+	write(ttyfd, msg, strlen(msg));
+    }
+}
+
+/*
+ * log_options()
+ *	Parse -L's comma-separated list of capture settings
+ */
+static void
+log_options(char *opts)
+{
+    static char *tokens[] = {"ring", "full", "compress", "flush", "rotate",
+	"every", "hook", "format", NULL};
+    char *val, *p;
+    long long size;
+
+    while (*opts) {
+	switch (getsubopt(&opts, tokens, &val)) {
+	case 0:
+	    if (!val || ((size = getsize(val, NULL)) < 1024)) {
+		fprintf(stderr, "Illegal log ring size\n");
+		usage();
+	    }
+	    logring_size = size;
+	    break;
+
+	case 1:
+	    if (val && !strcmp(val, "block")) {
+		log_policy = LOG_BLOCK;
+	    } else if (val && !strcmp(val, "drop-oldest")) {
+		log_policy = LOG_DROPOLD;
+	    } else if (val && !strcmp(val, "drop-newest")) {
+		log_policy = LOG_DROPNEW;
+	    } else {
+		fprintf(stderr, "Illegal log full policy\n");
+		usage();
+	    }
+	    break;
+
+	case 2:
+	    if (val && !strcmp(val, "none")) {
+		log_zip = LOG_PLAIN;
+#ifdef HAVE_ZSTD
+	    } else if (val && !strcmp(val, "zstd")) {
+		log_zip = LOG_ZSTD;
+#endif
+#ifdef HAVE_LZ4
+	    } else if (val && !strcmp(val, "lz4")) {
+		log_zip = LOG_LZ4;
+#endif
+	    } else {
+		fprintf(stderr, "Log compression %s isn't built in\n",
+		    val ? val : "");
+		usage();
+	    }
+	    break;
+
+	case 3:
+	    if (!val || ((log_flush = strtol(val, &p, 10)) <= 0) || *p) {
+		fprintf(stderr, "Illegal log flush interval\n");
+		usage();
+	    }
+	    break;
+
+	case 4:
+	    if (!val || ((size = getsize(val, NULL)) < 4096)) {
+		fprintf(stderr, "Illegal log rotation size\n");
+		usage();
+	    }
+	    log_rotsize = size;
+	    break;
+
+	case 5:
+	    if (!val || ((log_every = strtol(val, &p, 10)) <= 0)) {
+		fprintf(stderr, "Illegal log rotation interval\n");
+		usage();
+	    }
+	    switch (*p) {
+	    case 'd':
+		log_every *= 24;
+		/* FALLTHROUGH */
+	    case 'h':
+		log_every *= 60;
+		/* FALLTHROUGH */
+	    case 'm':
+		log_every *= 60;
+		/* FALLTHROUGH */
+	    case 's':
+		p += 1;
+		break;
+	    }
+	    if (*p) {
+		fprintf(stderr, "Illegal log rotation interval\n");
+		usage();
+	    }
+	    break;
+
+	case 6:
+	    if (!val || !*val) {
+		fprintf(stderr, "Missing log hook command\n");
+		usage();
+	    }
+	    log_hook = val;
+	    break;
+
+	case 7:
+	    if (val && !strcmp(val, "raw")) {
+		log_stamped = 0;
+	    } else if (val && !strcmp(val, "stamped")) {
+		log_stamped = 1;
+	    } else {
+		fprintf(stderr, "Illegal log format\n");
+		usage();
+	    }
+	    break;
+
+	default:
+	    fprintf(stderr, "Illegal log option: %s\n", val);
+	    usage();
+	}
+    }
+}
+
+/*
+ * port_add()
+ *	Set up a port from a tty argument, <tty>[,<setting>...]
+ *
+ * Anything not set here comes from the command line options; the
+ * first port also gets -l's capture file unless it names its own,
+ * and likewise -F's file= for its frames.
+ */
+static void
+port_add(char *arg)
+{
+    static char *tokens[] = {"s", "l", "e", "o", "7", "8", "m",
+	"rtscts", "xonxoff", "noflow", "lowlat", "reconnect", "parmrk",
+	"frames", NULL};
+    struct port *p;
+    char *opts, *val, *q, *log = NULL, *frlog = NULL;
+
+    if ((ports = realloc(ports, (nports + 1) * sizeof(struct port))) == NULL) {
+	perror("ports");
+	exit(1);
+    }
+    p = &ports[nports];
+    memset(p, 0, sizeof(struct port));
+    p->num = ++nports;
+    p->speed = speed;
+    p->parodd = parodd;
+    p->pareven = pareven;
+    p->seven_bits = seven_bits;
+    p->strip_hi = strip_hi;
+    p->flow = flow;
+    p->lowlat = lowlat;
+    p->reconnect = reconnect;
+    p->parmrk = parmrk;
+    p->oldflags = p->oldtimer = -1;
+    p->rxhold = rxhold;
+    p->rx_timer.handler = rx_release;
+    if ((opts = strchr(arg, ',')) != NULL) {
+	*opts++ = '\0';
+    }
+    p->tty = arg;
+    while (opts && *opts) {
+	switch (getsubopt(&opts, tokens, &val)) {
+	case 0:
+	    if (!val || ((p->speed = strtol(val, &q, 10)) <= 0) || *q) {
+		fprintf(stderr, "Illegal speed: %s\n", val ? val : "");
+		usage();
+	    }
+	    break;
+
+	case 1:
+	    if (!val || !*val) {
+		fprintf(stderr, "Missing log file for %s\n", arg);
+		usage();
+	    }
+	    log = val;
+	    break;
+
+	case 2:
+	    p->pareven = 1;
+	    p->parodd = 0;
+	    break;
+
+	case 3:
+	    p->parodd = 1;
+	    p->pareven = 0;
+	    break;
+
+	case 4:
+	    p->seven_bits = 1;
+	    break;
+
+	case 5:
+	    p->strip_hi = 0;
+	    break;
+
+	case 6:
+	    p->strip_hi = 1;
+	    break;
+
+	case 7:
+	    p->flow |= FLOW_RTS;
+	    break;
+
+	case 8:
+	    p->flow |= FLOW_XON;
+	    break;
+
+	case 9:
+	    p->flow = 0;
+	    break;
+
+	case 10:
+	    p->lowlat = 1;
+	    break;
+
+	case 11:
+	    p->reconnect = 1;
+	    break;
+
+	case 12:
+	    if ((p->parmrk = parmrk_option(val)) < 0) {
+		fprintf(stderr, "Illegal parmrk: %s\n", val);
+		usage();
+	    }
+	    break;
+
+	case 13:
+	    if (!val || !*val || !fr_kind) {
+		fprintf(stderr, "frames= needs a file, and -F\n");
+		usage();
+	    }
+	    frlog = val;
+	    break;
+
+	default:
+	    fprintf(stderr, "Illegal port option: %s\n", val);
+	    usage();
+	}
+    }
+    if (p->strip_hi < 0) {
+	p->strip_hi = p->seven_bits;
+    }
+    if (fr_kind) {
+	p->fr = frame_new();
+    }
+    if (!log && (p->num == 1)) {
+	log = logname;
+    }
+    if (log) {
+	p->log = log_open(log);
+    }
+    if (!frlog && (p->num == 1)) {
+	frlog = fr_name;
+    }
+    if (frlog) {
+	p->frlog = log_open(frlog);
+	p->frlog->stamped = 1;
+    }
+}
+
+/*
+ * Live tap (-M)
+ *
+ * What the attached port says (and, with ",tx", what we send it)
+ * is published in a POSIX shared memory ring, for other processes
+ * to follow as it happens without going through a file.  We are
+ * the only writer and never wait on anyone: a reader which falls
+ * behind finds it has been overrun, and picks up again from the
+ * newest data.  The layout, which capdump -m also knows:
+ *
+ * struct taphdr, then "size" (a power of two) bytes of ring.  Byte
+ * positions count up forever; position p is at p % size in the
+ * ring.  Each record is a struct taprec and its data, padded to a
+ * multiple of 8, and never wraps: a record of type 0 (or fewer
+ * than TAP_REC bytes to the end) means go on at the ring's start.
+ *
+ * "head" is where the next record will go; it's only stored once
+ * the record is there.  Before writing over anything, "lo" is moved
+ * past it.  So a reader takes head (acquire), reads records below
+ * it in place, and then checks (acquire fence) that lo hasn't gone
+ * past the start of what it read; if it has, that was torn and it
+ * should go back to head.  Each record's "seq" counts up by one,
+ * to show how many were lost.
+ */
+#define TAP_MAGIC "TERMTAP1"
+#define TAP_SIZE (4*1024*1024)	/* Default ring */
+#define TAP_REC (24)		/* sizeof(struct taprec) */
+
+struct taphdr {
+    char magic[8];
+    unsigned int hdrsize;	/* Where the ring starts */
+    unsigned int live;		/* Cleared when we exit */
+    unsigned long long size;	/* Ring bytes */
+    unsigned long long head;	/* Next record goes here */
+    unsigned long long lo;	/* Oldest position still intact */
+    char pad[64 - 40];
+};
+struct taprec {
+    unsigned long long seq;
+    unsigned long long usec;	/* ev_now() clock */
+    unsigned int len;		/* Data bytes which follow */
+    unsigned int type;		/* CAP_RX, CAP_TX, CAP_FRAME..., or 0 */
+};
+
+static char *tap_name;		/* -M */
+static long long tap_size = TAP_SIZE;
+static int tap_tx;		/*  ...with what we send */
+static struct taphdr *tap;
+static char *tap_ring;
+static unsigned long long tap_seq;
+
+/*
+ * tap_options()
+ *	Parse -M <name>[,size=<size>][,tx]
+ */
+static void
+tap_options(char *opts)
+{
+    static char *tokens[] = {"size", "tx", NULL};
+    char *val;
+    long long size;
+
+    tap_name = opts;
+    if ((opts = strchr(opts, ',')) != NULL) {
+	*opts++ = '\0';
+    }
+    while (opts && *opts) {
+	switch (getsubopt(&opts, tokens, &val)) {
+	case 0:
+	    if (!val || ((size = getsize(val, NULL)) < (64 * 1024)) ||
+		    (size > (1LL << 32))) {
+		fprintf(stderr, "Illegal tap size\n");
+		usage();
+	    }
+	    for (tap_size = 64 * 1024; tap_size < size; tap_size *= 2)
+		;
+	    break;
+
+	case 1:
+	    tap_tx = 1;
+	    break;
+
+	default:
+	    fprintf(stderr, "Illegal tap option: %s\n", val);
+	    usage();
+	}
+    }
+    if (*tap_name != '/') {
+	if ((val = malloc(strlen(tap_name) + 2)) == NULL) {
+	    perror(tap_name);
+	    exit(1);
+	}
+	sprintf(val, "/%s", tap_name);
+	tap_name = val;
+    }
+}
+
+/*
+ * tap_open()
+ *	Create the shared memory and its ring
+ *
+ * Whatever a killed term left with our name goes first.
+ */
+static void
+tap_open(void)
+{
+    size_t len = sizeof(struct taphdr) + tap_size;
+    int fd;
+
+    (void)shm_unlink(tap_name);
+    if (((fd = shm_open(tap_name, O_RDWR|O_CREAT|O_EXCL, 0666)) < 0) ||
+	    (ftruncate(fd, len) < 0)) {
+	perror(tap_name);
+	exit(1);
+    }
+    if ((tap = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd,
+	    0)) == MAP_FAILED) {
+	perror(tap_name);
+	exit(1);
+    }
+    close(fd);
+    tap_ring = (char *)tap + sizeof(struct taphdr);
+    tap->hdrsize = sizeof(struct taphdr);
+    tap->size = tap_size;
+    tap->live = 1;
+    memcpy(tap->magic, TAP_MAGIC, 8);
+}
+
+/*
+ * tap_lo()
+ *	We're about to write the ring up to position "end"; tell the
+ *	readers that what was there is gone, before it is
+ */
+static void
+tap_lo(unsigned long long end)
+{
+    if ((end > tap->size) && ((end - tap->size) > tap->lo)) {
+	__atomic_store_n(&tap->lo, end - tap->size, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * tap_put()
+ *	Publish a chunk of the stream
+ */
+static void
+tap_put(int type, char *buf, int len)
+{
+    unsigned long long pos = tap->head, size = tap->size;
+    struct taprec *r;
+    size_t off, need;
+    int n;
+
+    while (len > 0) {
+	n = (len > (size / 4)) ? (size / 4) : len;
+	need = (TAP_REC + n + 7) & ~7;
+	off = pos % size;
+	if ((size - off) < need) {
+	    if ((size - off) >= TAP_REC) {
+		tap_lo(pos + TAP_REC);
+		((struct taprec *)(tap_ring + off))->type = 0;
+	    }
+	    pos += size - off;
+	    off = 0;
+	}
+	tap_lo(pos + need);
+	r = (struct taprec *)(tap_ring + off);
+	r->seq = tap_seq++;
+	r->usec = ev_now();
+	r->len = n;
+	r->type = type;
+	memcpy(r + 1, buf, n);
+	pos += need;
+	__atomic_store_n(&tap->head, pos, __ATOMIC_RELEASE);
+	buf += n;
+	len -= n;
+    }
+}
+
+/* We're going; readers can stop once they've caught up */
+static void
+tap_close(void)
+{
+    if (tap) {
+	__atomic_store_n(&tap->live, 0, __ATOMIC_RELEASE);
+	(void)shm_unlink(tap_name);
+	tap = NULL;
+    }
+}
+
+/*
+ * Counters
+ *
+ * Cheap enough to keep all the time.  ^Z i shows them; with -S a
+ * line of name=value pairs goes out every so many seconds, for a
+ * script to pick up.  Rates are over the time since the last time
+ * shown (or written).  The UART's own error counts come from
+ * TIOCGICOUNT, where the driver keeps them (Linux).
+ */
+struct stats {
+    unsigned long long rx, tx;	/* Bytes from, to the port */
+    unsigned long long reads;	/* Reads (or splices) which got data */
+    long long when;		/* usec, of a snapshot */
+};
+static struct stats stats;		/* Running totals */
+static struct stats shown, logged;	/* As of the last ^Z i, -S line */
+static int stats_every = 0;		/* -S interval, sec */
+static int stats_fd = 2;		/*  ...and where to */
+static struct evtimer stats_timer;
+
+/*
+ * stats_format()
+ *	Describe the counters, for a human or not; "since" is the
+ *	last snapshot, and is updated
+ */
+static int
+stats_format(char *buf, size_t len, struct stats *since, int human)
+{
+    long long now = ev_now(), dt;
+    unsigned long long rxrate, txrate, avg, high = 0, dropped = 0;
+    unsigned long long elided = disp_elided();
+    struct logring *logp = cur->log;
+    struct timeval tv;
+    int n;
+#ifdef TIOCGICOUNT
+    struct serial_icounter_struct ic, icount0 = cur->icount0;
+    int haveic = (ioctl(rs232, TIOCGICOUNT, &ic) == 0);
+#endif
+
+    if ((dt = now - since->when) <= 0) {
+	dt = 1;
+    }
+    rxrate = (stats.rx - since->rx) * 1000000ULL / dt;
+    txrate = (stats.tx - since->tx) * 1000000ULL / dt;
+    avg = stats.reads ? (stats.rx / stats.reads) : 0;
+    if (logp) {
+#ifdef HAVE_SPLICE
+	/* A piped log can only be looked at now and then */
+	if ((logp->pipe[1] >= 0) && (ioctl(logp->pipe[0], FIONREAD, &n) == 0) &&
+		(n > logp->high)) {
+	    logp->high = n;
+	}
+#endif
+	pthread_mutex_lock(&logp->lock);
+	high = logp->high;
+	dropped = logp->dropped;
+	pthread_mutex_unlock(&logp->lock);
+    }
+    *since = stats;
+    since->when = now;
+
+    if (human) {
+	n = 0;
+	if (nports > 1) {
+	    n = snprintf(buf, len, "all ports: ");
+	}
+	n += snprintf(buf + n, len - n,
+	    "rx %llu bytes (%llu/sec), tx %llu bytes (%llu/sec)\r\n"
+	    "%llu reads, %llu bytes/read\r\n",
+	    stats.rx, rxrate, stats.tx, txrate, stats.reads, avg);
+	if (elided) {
+	    n += snprintf(buf + n, len - n,
+		"%llu bytes not shown on the terminal\r\n", elided);
+	}
+	if (logp) {
+	    n += snprintf(buf + n, len - n,
+		"%s log ring: high water %llu of %llu, %llu bytes dropped\r\n",
+		cur->tty, (unsigned long long)high, (unsigned long long)logp->size,
+		dropped);
+	}
+	if (cur->rxerrs) {
+	    n += snprintf(buf + n, len - n,
+		"%s line errors: %llu bytes, the last at byte %llu\r\n",
+		cur->tty, cur->rxerrs, cur->rxerrlast);
+	}
+	n += frame_format(buf + n, len - n, 1);
+#ifdef TIOCGICOUNT
+	if (haveic) {
+	    n += snprintf(buf + n, len - n,
+		"%s UART: %d overrun, %d framing, %d parity, %d break,"
+		" %d buffer overrun\r\n", cur->tty,
+		ic.overrun - icount0.overrun, ic.frame - icount0.frame,
+		ic.parity - icount0.parity, ic.brk - icount0.brk,
+		ic.buf_overrun - icount0.buf_overrun);
+	}
+#endif
+	n += rt_format(buf + n, len - n, 1);
+	n += trig_format(buf + n, len - n, 1);
+	return(n);
+    }
+
+    gettimeofday(&tv, NULL);
+    n = snprintf(buf, len,
+	"time=%ld.%03d rx=%llu tx=%llu rx_rate=%llu tx_rate=%llu"
+	" reads=%llu read_avg=%llu",
+	(long)tv.tv_sec, (int)(tv.tv_usec / 1000), stats.rx, stats.tx,
+	rxrate, txrate, stats.reads, avg);
+    if (elided) {
+	n += snprintf(buf + n, len - n, " elided=%llu", elided);
+    }
+    if (logp) {
+	n += snprintf(buf + n, len - n,
+	    " log_high=%llu log_size=%llu log_dropped=%llu",
+	    (unsigned long long)high, (unsigned long long)logp->size, dropped);
+    }
+    if (cur->parmrk) {
+	n += snprintf(buf + n, len - n, " rx_errors=%llu rx_error_last=%llu",
+	    cur->rxerrs, cur->rxerrlast);
+    }
+    n += frame_format(buf + n, len - n, 0);
+#ifdef TIOCGICOUNT
+    if (haveic) {
+	n += snprintf(buf + n, len - n,
+	    " overrun=%d frame=%d parity=%d brk=%d buf_overrun=%d",
+	    ic.overrun - icount0.overrun, ic.frame - icount0.frame,
+	    ic.parity - icount0.parity, ic.brk - icount0.brk,
+	    ic.buf_overrun - icount0.buf_overrun);
+    }
+#endif
+    n += rt_format(buf + n, len - n, 0);
+    n += trig_format(buf + n, len - n - 2, 0);
+    n += snprintf(buf + n, len - n, isatty(stats_fd) ? "\r\n" : "\n");
+    return(n);
+}
+
+/* -S: time for another line */
+static void
+stats_tick(struct evtimer *t)
+{
+    char buf[2048];
+    int n = stats_format(buf, sizeof(buf), &logged, 0);
+
+    if (isatty(stats_fd)) {
+	disp_say(stats_fd, buf, n);
+    } else {
+	write(stats_fd, buf, n);
+    }
+    ev_timer(t, stats_every * 1000000LL);
+}
+
+/* Start counting */
+static void
+stats_start(void)
+{
+#ifdef TIOCGICOUNT
+    int x;
+
+    for (x = 0; x < nports; ++x) {
+	(void)ioctl(ports[x].src.fd, TIOCGICOUNT, &ports[x].icount0);
+    }
+#endif
+    shown.when = logged.when = ev_now();
+    if (stats_every) {
+	stats_timer.handler = stats_tick;
+	ev_timer(&stats_timer, stats_every * 1000000LL);
+    }
+}
+
+/* Finish off every port's capture, and undo serial_lowlat() */
+static void
+ports_close(void)
+{
+    int x;
+
+    tap_close();
+    for (x = 0; x < nports; ++x) {
+	if (ports[x].log) {
+	    log_close(ports[x].log);
+	    ports[x].log = NULL;
+	}
+	if (ports[x].frlog) {
+	    log_close(ports[x].frlog);
+	    ports[x].frlog = NULL;
+	}
+	serial_lowlat(&ports[x], 0);
+    }
+}
+
+/*
+ * done()
+ *	Clean up and exit
+ */
+static void
+done(void)
+{
+    disp_sync();
+    ports_close();
+    tcsetattr(ttyfd, TCSAFLUSH, &otty);
+    write(ttyfd, "Exiting\n", 8);
+    exit(exit_code);
+}
+
+/*
+ * fail()
+ *	Report a fatal error, put the user's terminal back, and exit
+ */
+static void
+fail(char *msg)
+{
+    int e = errno;
+
+    disp_sync();
+    ports_close();
+    tcsetattr(ttyfd, TCSAFLUSH, &otty);
+    errno = e;
+    perror(msg);
+    exit(1);
+}
+
+/*
+ * speed_code()
+ *	Map bits/sec to a B* constant, or return -1 if there isn't one
+ */
+static long
+speed_code(long rate)
+{
+    struct speed *sp;
+
+    for (sp = speeds; sp->rate; ++sp) {
+	if (sp->rate == rate) {
+	    return(sp->code);
+	}
+    }
+    return(-1);
+}
+
+/*
+ * set_custom_speed()
+ *	Set a rate which has no B* constant
+ *
+ * Has to happen after tcsetattr(), which would otherwise put the
+ * port right back to its B* speed.
+ */
+static int
+set_custom_speed(int rs232fd, long rate)
+{
+#if defined(HAVE_TERMIOS2)
+    struct termios2 t2;
+
+    if (ioctl(rs232fd, TCGETS2, &t2) < 0) {
+	return(-1);
+    }
+    t2.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+    t2.c_cflag |= BOTHER;	/* Input speed follows output */
+    t2.c_ispeed = t2.c_ospeed = rate;
+    return(ioctl(rs232fd, TCSETS2, &t2));
+#elif defined(IOSSIOSPEED)
+    speed_t sp = rate;
+
+    return(ioctl(rs232fd, IOSSIOSPEED, &sp));
+#else
+    errno = EINVAL;
+    return(-1);
+#endif
+}
+
+/*
+ * setup_serial()
+ *	Set serial port to our desired parameters
+ *
+ * We have this in a function so we can do it not only when we
+ * start up, but also after protocol transfers.  It turns out
+ * that the serial port might not be left in the same state it
+ * started in.
+ */
+static void
+setup_serial(p)
+	struct port *p;
+{
+    int fl, rs232fd = p->src.fd;
+    long speed = p->speed, code = speed_code(speed);
+
+    /*
+     * Set up serial port for local access.  Once we've
+     * set CLOCAL, turn off O_NDELAY.
+     */
+    tcgetattr(rs232fd, &ext);
+    ext.c_lflag &= ~(ECHO|ICANON|ISIG);
+    ext.c_cflag |= CLOCAL;	/* Ignore modem status */
+    ext.c_cflag &= ~(CSIZE);	/* Set # bits */
+    if (p->seven_bits) {
+	ext.c_cflag |= (CS7);
+    } else {
+	ext.c_cflag |= (CS8);
+    }
+    ext.c_cflag &= ~(CSTOPB);
+    if (!p->parodd && !p->pareven) {	/* Set parity */
+	ext.c_cflag &= ~(PARENB|PARODD);
+    } else if (p->parodd) {
+	ext.c_cflag |= (PARENB|PARODD);
+    } else {
+	ext.c_cflag |= (PARENB);
+	ext.c_cflag &= ~(PARODD);
+    }
+#ifdef CRTSCTS
+    if (p->flow & FLOW_RTS) {
+	ext.c_cflag |= CRTSCTS;
+    } else {
+	ext.c_cflag &= ~CRTSCTS;
+    }
+#endif
+    ext.c_oflag &= ~OPOST;
+    ext.c_iflag = (p->flow & FLOW_XON) ? (IXON|IXOFF) : 0;
+    if (p->parmrk) {
+	/* See parmrk_decode(); parity's checked if PARENB's on, above */
+	ext.c_iflag |= INPCK|PARMRK;
+    }
+    ext.c_cc[VSTART] = 021;
+    ext.c_cc[VSTOP] = 023;
+    ext.c_cc[VMIN] = 1;		/* Only matters to blocking readers */
+    ext.c_cc[VTIME] = 0;
+    if (code < 0) {
+	code = B38400;		/* Placeholder, see below */
+    }
+    cfsetispeed(&ext, code);
+    cfsetospeed(&ext, code);
+
+    /* One coming back may already have said something we want */
+    tcsetattr(rs232fd, p->lost ? TCSANOW : TCSAFLUSH, &ext);
+    if ((speed_code(speed) < 0) && (set_custom_speed(rs232fd, speed) < 0)) {
+	fail("can't set speed");
+    }
+
+    /*
+     * Now that we're ignoring modem control, the event loop wants
+     * the port non-blocking; a port which won't take any more
+     * output (flow control, or just a full queue) then shows up as
+     * EAGAIN rather than stalling everything.
+     */
+    fl = fcntl(rs232fd, F_GETFL, 0);
+    fl &= ~(O_NDELAY);
+    fl |= O_NONBLOCK;
+    (void)fcntl(rs232fd, F_SETFL, fl);
+}
+
+/*
+ * serial_xonxoff()
+ *	Turn XON/XOFF on or off for now, if the port uses it
+ *
+ * X/YMODEM blocks are raw binary, and the kernel would eat any
+ * XON or XOFF in them, so those transfers run without.  ZMODEM
+ * escapes them, and text is text, so they keep the port's flow.
+ */
+static void
+serial_xonxoff(struct port *p, int on)
+{
+    struct termios t;
+
+    if (!(p->flow & FLOW_XON) || (tcgetattr(p->src.fd, &t) < 0)) {
+	return;
+    }
+    if (on) {
+	t.c_iflag |= (IXON|IXOFF);
+    } else {
+	t.c_iflag &= ~(IXON|IXOFF);
+    }
+    (void)tcsetattr(p->src.fd, TCSANOW, &t);
+}
+
+/*
+ * serial_lowlat()
+ *	Ask the driver to hand data over as soon as it arrives
+ *
+ * That's ASYNC_LOW_LATENCY for ordinary UARTs; USB adapters mostly
+ * have their own timer, which FTDI's lets us set through sysfs
+ * (it defaults to 16 ms, which is what you see in the echo).  With
+ * "on" clear, whatever we changed is put back.
+ */
+static void
+serial_lowlat(struct port *p, int on)
+{
+#ifdef TIOCSSERIAL
+    struct serial_struct ss;
+    char path[256], *name, *real, buf[16];
+    int fd, n;
+
+    if (!p->lowlat || (!on && (p->oldflags < 0) && (p->oldtimer < 0))) {
+	return;
+    }
+    if (ioctl(p->src.fd, TIOCGSERIAL, &ss) == 0) {
+	if (on && !(ss.flags & ASYNC_LOW_LATENCY)) {
+	    p->oldflags = ss.flags;
+	    ss.flags |= ASYNC_LOW_LATENCY;
+	    (void)ioctl(p->src.fd, TIOCSSERIAL, &ss);
+	} else if (!on && (p->oldflags >= 0)) {
+	    ss.flags = p->oldflags;
+	    (void)ioctl(p->src.fd, TIOCSSERIAL, &ss);
+	    p->oldflags = -1;
+	}
+    }
+    if ((real = realpath(p->tty, NULL)) == NULL) {
+	return;
+    }
+    name = strrchr(real, '/') ? (strrchr(real, '/') + 1) : real;
+    snprintf(path, sizeof(path),
+	"/sys/class/tty/%s/device/latency_timer", name);
+    free(real);
+    if ((fd = open(path, O_RDWR)) < 0) {
+	return;
+    }
+    if (on && ((n = read(fd, buf, sizeof(buf)-1)) > 0)) {
+	buf[n] = '\0';
+	if ((n = atoi(buf)) > 1) {
+	    p->oldtimer = n;
+	    (void)write(fd, "1", 1);
+	}
+    } else if (!on && (p->oldtimer >= 0)) {
+	n = snprintf(buf, sizeof(buf), "%d", p->oldtimer);
+	(void)write(fd, buf, n);
+	p->oldtimer = -1;
+    }
+    close(fd);
+#endif
+}
+
+/*
+ * Real time (-X)
+ *
+ * On a busy machine the event loop can be off the CPU long enough
+ * for a UART's FIFO to overrun.  -X fifo puts the loop's thread
+ * alone under SCHED_FIFO, cpu= pins it, and mlock keeps the whole
+ * process in memory so a page fault can't hold it up either.  This
+ * is done last thing before the loop starts, once the display and
+ * capture threads are going, so they (and log compression) stay as
+ * they were; anything they start later is reset back to normal.
+ * The network clients are served by the loop itself, so they come
+ * along.  ^Z i shows how often the loop was preempted anyway.
+ */
+static int rt_prio;		/* SCHED_FIFO priority, 0 for none */
+static int rt_cpu = -1;		/* CPU to pin the loop to */
+static int rt_lock;		/* mlockall() */
+#define RT_PRIO (50)		/* -X fifo's priority */
+
+/*
+ * rt_options()
+ *	Parse -X fifo[=<prio>][,cpu=<n>][,mlock]
+ */
+static void
+rt_options(char *opts)
+{
+    static char *tokens[] = {"fifo", "cpu", "mlock", NULL};
+    char *val, *p;
+
+    while (*opts) {
+	switch (getsubopt(&opts, tokens, &val)) {
+	case 0:
+	    if (!val) {
+		rt_prio = RT_PRIO;
+	    } else if (((rt_prio = strtol(val, &p, 10)) <
+		    sched_get_priority_min(SCHED_FIFO)) ||
+		    (rt_prio > sched_get_priority_max(SCHED_FIFO)) || *p) {
+		fprintf(stderr, "Illegal priority: %s\n", val);
+		usage();
+	    }
+	    break;
+
+	case 1:
+	    if (!val || ((rt_cpu = strtol(val, &p, 10)) < 0) || *p) {
+		fprintf(stderr, "Illegal CPU: %s\n", val ? val : "");
+		usage();
+	    }
+	    break;
+
+	case 2:
+	    rt_lock = 1;
+	    break;
+
+	default:
+	    fprintf(stderr, "Illegal -X option: %s\n", val);
+	    usage();
+	}
+    }
+}
+
+/*
+ * rt_start()
+ *	Make the calling thread (the event loop) real time, as asked
+ *
+ * Each one which can't be had is said so, and we carry on without.
+ */
+static void
+rt_start(void)
+{
+    struct sched_param sp;
+    int policy = SCHED_FIFO;
+#ifdef __linux__
+    cpu_set_t set;
+
+    if (rt_cpu >= 0) {
+	CPU_ZERO(&set);
+	CPU_SET(rt_cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+	    fprintf(stderr, "cpu %d: %s; not pinned\r\n", rt_cpu,
+		strerror(errno));
+	    rt_cpu = -1;
+	}
+    }
+#endif
+    if (rt_prio) {
+#ifdef SCHED_RESET_ON_FORK
+	policy |= SCHED_RESET_ON_FORK;
+#endif
+	memset(&sp, 0, sizeof(sp));
+	sp.sched_priority = rt_prio;
+	if ((errno = pthread_setschedparam(pthread_self(), policy, &sp))) {
+	    fprintf(stderr, "SCHED_FIFO: %s; at normal priority\r\n",
+		strerror(errno));
+	    rt_prio = 0;
+	}
+    }
+    if (rt_lock && (mlockall(MCL_CURRENT|MCL_FUTURE) < 0)) {
+	fprintf(stderr, "mlockall: %s; not locked\r\n", strerror(errno));
+	rt_lock = 0;
+    }
+}
+
+/*
+ * rt_format()
+ *	Describe how the event loop's been getting on, for stats_format()
+ */
+static int
+rt_format(char *buf, size_t len, int human)
+{
+#ifdef RUSAGE_THREAD
+    struct rusage ru;
+    int n = 0;
+
+    if (getrusage(RUSAGE_THREAD, &ru) < 0) {
+	return(0);
+    }
+    if (!human) {
+	return(snprintf(buf, len, " preempted=%ld major_faults=%ld",
+	    ru.ru_nivcsw, ru.ru_majflt));
+    }
+    n = snprintf(buf, len, "event loop:");
+    if (rt_prio) {
+	n += snprintf(buf + n, len - n, " SCHED_FIFO %d,", rt_prio);
+    }
+    if (rt_cpu >= 0) {
+	n += snprintf(buf + n, len - n, " on cpu %d,", rt_cpu);
+    }
+    if (rt_lock) {
+	n += snprintf(buf + n, len - n, " locked,");
+    }
+    n += snprintf(buf + n, len - n,
+	" preempted %ld times, %ld major faults\r\n",
+	ru.ru_nivcsw, ru.ru_majflt);
+    return(n);
+#else
+    return(0);
+#endif
+}
+
+/*
+ * kbd_arm()
+ *	Decide whether we want to hear from the keyboard
+ *
+ * While typing we keep reading as long as there's room in the
+ * queue.  When pasting we take a big gulp, then don't read again
+ * until the serial port has accepted all of it, so the paste runs
+ * at whatever rate the line (and its flow control) allows.
+ */
+static void
+kbd_arm(void)
+{
+    int ok;
+
+    if (txoff == txlen) {
+	txoff = txlen = 0;
+    }
+    if (batch_name) {
+	return;			/* There's no keyboard */
+    }
+    if (xfer) {
+	ok = 1;			/* We always want to hear an abort */
+    } else if (paste_mode) {
+	ok = (txlen == 0);
+    } else {
+	ok = (TXSIZE - txlen) >= KBDSIZE;
+    }
+    ev_set(&kbd_src, ok ? EV_IN : 0);
+    net_arm();
+}
+
+/*
+ * serial_arm()
+ *	Ask for the serial port events we currently care about
+ *
+ * Only the attached port has anything queued to send.
+ */
+static void
+serial_arm(struct port *p)
+{
+    int in = !p->rxheld, room, out;
+
+    if (p->lost) {
+	return;			/* Nothing to ask of it */
+    }
+#ifdef HAVE_URING
+    if (ur.reads && uring_read(p, in && ((p != cur) || !rxpool))) {
+	in = 0;			/* The read has it */
+    }
+#endif
+    if (in && (p == cur) && rxpool) {
+	(void)rx_room(&room);
+	if (room == 0) {
+	    in = 0;		/* Until the terminal catches up */
+	    ev_timer(&rxpool_timer, 1000LL);
+	}
+    }
+    if (p == cur) {
+	out = (txoff < txlen);
+    } else {
+	out = p->job && batch_queued(p);
+    }
+    ev_set(&p->src, (in ? EV_IN : 0) | (out ? EV_OUT : 0));
+}
+
+/*
+ * rx_release()
+ *	rxhold has run out; go back to reading the port
+ */
+static void
+rx_release(struct evtimer *t)
+{
+    struct port *p = PORT_OF(t, rx_timer);
+
+    p->rxheld = 0;
+    serial_arm(p);
+}
+
+/*
+ * rx_pace()
+ *	After reading "n" bytes, decide how long to let the port fill
+ *
+ * From idle, two small reads less than a msec apart means traffic
+ * is arriving faster than we're waking up, so start holding.
+ * While holding, a read which came back well short of what the
+ * line could have delivered means it has gone quiet again, so drop
+ * straight back to immediate delivery; one which found the tty's
+ * own queue half full means we're holding too long.  Otherwise
+ * keep doubling the hold, up to RXHOLD_MAX or whatever would half
+ * fill that queue at this speed.
+ */
+static void
+rx_pace(struct port *p, int n)
+{
+    long long now = ev_now(), expect, speed = p->speed;
+    int most, full, rxhold = p->rxhold;
+
+    /* Transfers wait on acknowledgements; don't sit on them */
+    if (xfer && (p == cur)) {
+	rxhold = 0;
+    } else if (rxauto) {
+	full = (rxsize < TTYQ) ? rxsize : TTYQ;
+	most = (int)(((long long)full / 2) * 10 * 1000 / speed);
+	if (most > RXHOLD_MAX) {
+	    most = RXHOLD_MAX;
+	}
+	if (rxhold == 0) {
+	    if (((now - p->rxlast) < 1000) && (n < (full / 2)) && (most > 0)) {
+		rxhold = 1;
+	    }
+	} else {
+	    expect = (long long)speed / 10 * rxhold / 1000;
+	    if (n < (expect / 4)) {
+		rxhold = 0;
+	    } else if (n >= (full / 2)) {
+		rxhold /= 2;
+	    } else if (rxhold < most) {
+		rxhold *= 2;
+		if (rxhold > most) {
+		    rxhold = most;
+		}
+	    }
+	}
+    }
+    p->rxhold = rxhold;
+    p->rxlast = now;
+    if (rxhold > 0) {
+	p->rxheld = 1;
+	serial_arm(p);
+	ev_timer(&p->rx_timer, rxhold * 1000LL);
+    }
+}
+
+/* "n" bytes from the front of the queue went out */
+static void
+tx_sent(int n)
+{
+    if (cur->log) {
+	log_tx(cur->log, txbuf+txoff, n);
+    }
+    if (tap_tx && tap) {
+	tap_put(CAP_TX, txbuf+txoff, n);
+    }
+    txoff += n;
+    stats.tx += n;
+}
+
+/*
+ * tx_flush()
+ *	Push queued keyboard data at the serial port
+ */
+static void
+tx_flush(void)
+{
+    static int pumping;
+    int x, was, blocked;
+
+    for (;;) {
+	blocked = 0;
+	while (txoff < txlen) {
+	    if (cur->lost) {
+		txoff = txlen = 0;	/* Nowhere for it to go */
+		break;
+	    }
+	    if ((x = write(rs232, txbuf+txoff, txlen-txoff)) < 0) {
+		if (errno == EINTR) {
+		    continue;
+		}
+		if (errno != EAGAIN) {
+		    if (!cur->reconnect && !cur->job) {
+			fail("serial write");
+		    }
+		    port_lost(cur);
+		    continue;
+		}
+		blocked = 1;
+		break;
+	    }
+	    tx_sent(x);
+	}
+
+	/* Let a sending transfer top the queue back up */
+	if (xfer && xfer->pump && !pumping) {
+	    was = txlen;
+	    pumping = 1;
+	    (*xfer->pump)(xfer);
+	    pumping = 0;
+	    if ((txlen != was) && !blocked) {
+		continue;
+	    }
+	}
+	break;
+    }
+    serial_arm(cur);
+    kbd_arm();
+}
+
+/*
+ * tx_room()
+ *	Make what space we can at the end of the transmit queue
+ */
+static int
+tx_room(void)
+{
+    if (txoff == txlen) {
+	txoff = txlen = 0;
+    } else if (txoff > (TXSIZE / 2)) {
+	memmove(txbuf, txbuf+txoff, txlen-txoff);
+	txlen -= txoff;
+	txoff = 0;
+    }
+    return(TXSIZE - txlen);
+}
+
+/*
+ * tx_put()
+ *	Queue a few literal bytes for the serial port
+ */
+static void
+tx_put(char *buf, int len)
+{
+    if (len > tx_room()) {
+	len = TXSIZE - txlen;
+    }
+    memcpy(txbuf+txlen, buf, len);
+    txlen += len;
+    tx_flush();
+}
+
+/*
+ * kbd_getc()
+ *	Next keystroke, from what's already been read if we can
+ */
+static int
+kbd_getc(void)
+{
+    char c;
+
+    if (kbpos < kblen) {
+	c = kbuf[kbpos++];
+    } else {
+	while (read(ttyfd, &c, sizeof(c)) != 1) {
+	    if ((errno != EINTR) && (errno != EAGAIN)) {
+		fail("keyboard read");
+	    }
+	}
+    }
+    return(cur->strip_hi ? (c & 0x7F) : c);
+}
+
+#ifdef HAVE_X86_SIMD
+/* strip_high() for machines with AVX2; returns how much it did */
+__attribute__((target("avx2")))
+static size_t
+strip_avx2(unsigned char *buf, size_t len)
+{
+    const __m256i mask = _mm256_set1_epi8(0x7F);
+    size_t x;
+
+    for (x = 0; (x + 32) <= len; x += 32) {
+	__m256i v = _mm256_loadu_si256((__m256i *)(buf + x));
+
+	_mm256_storeu_si256((__m256i *)(buf + x), _mm256_and_si256(v, mask));
+    }
+    return(x);
+}
+#endif
+
+/*
+ * strip_high()
+ *	Clear the top bit of every byte, for 7-bit operation
+ *
+ * Receive buffers can be big, so this goes 32 (AVX2) or 16 (SSE2,
+ * NEON) bytes at a time where it can, and a word at a time after
+ * that.
+ */
+static void
+strip_high(char *buf, size_t len)
+{
+    unsigned char *p = (unsigned char *)buf;
+    size_t x = 0;
+    unsigned long long w;
+
+#ifdef HAVE_X86_SIMD
+    static int avx2 = -1;
+
+    if (avx2 < 0) {
+	__builtin_cpu_init();
+	avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    if (avx2) {
+	x = strip_avx2(p, len);
+    }
+#ifdef __SSE2__
+    {
+	const __m128i mask = _mm_set1_epi8(0x7F);
+
+	for (; (x + 16) <= len; x += 16) {
+	    __m128i v = _mm_loadu_si128((__m128i *)(p + x));
+
+	    _mm_storeu_si128((__m128i *)(p + x), _mm_and_si128(v, mask));
+	}
+    }
+#endif
+#elif defined(__ARM_NEON)
+    {
+	const uint8x16_t mask = vdupq_n_u8(0x7F);
+
+	for (; (x + 16) <= len; x += 16) {
+	    vst1q_u8(p + x, vandq_u8(vld1q_u8(p + x), mask));
+	}
+    }
+#endif
+    for (; (x + sizeof(w)) <= len; x += sizeof(w)) {
+	memcpy(&w, p + x, sizeof(w));
+	w &= 0x7F7F7F7F7F7F7F7FULL;
+	memcpy(p + x, &w, sizeof(w));
+    }
+    for (; x < len; ++x) {
+	p[x] &= 0x7F;
+    }
+}
+
+/*
+ * parmrk_err()
+ *	Port "p" got byte "c", its "at"'th, with a parity or framing
+ *	error; "pool" is where that is in the receive pool, if it is
+ */
+static void
+parmrk_err(struct port *p, unsigned long long at, int c,
+	unsigned long long pool)
+{
+    char what[64];
+
+    p->rxerrs += 1;
+    p->rxerrlast = at;
+    if (p->log && p->log->stamped) {
+	snprintf(what, sizeof(what), "line error at byte %llu (0x%02x)",
+	    at, c);
+	log_mark(p->log, what);
+    }
+    if ((p->parmrk > 1) && (pool != ~0ULL)) {
+	disp_mark(pool);
+    }
+}
+
+/*
+ * parmrk_decode()
+ *	Take PARMRK's marks out of "len" bytes just read from "p"
+ *
+ * With PARMRK (and INPCK) the tty hands us a byte which had a
+ * parity or framing error as \377 \0 <byte>, a break as \377 \0 \0,
+ * and a real \377 as \377 \377.  A read without any \377 in it,
+ * which is all of them on a clean line, costs one memchr(); the
+ * rest moves down over the marks in place.  A mark cut off by the
+ * end of one read is finished at the start of the next.  "pool"
+ * is where buf is in the receive pool (~0 if it isn't).  Returns
+ * the new length.
+ */
+static int
+parmrk_decode(struct port *p, char *buf, int len, unsigned long long pool)
+{
+    char *in = buf, *end = buf + len, *out = buf, *q;
+    unsigned long long at = p->rxpos;
+
+    /* What the last read stopped in the middle of */
+    while (p->pmstate && (in < end)) {
+	if (p->pmstate == 1) {
+	    if (*in != '\0') {
+		*out++ = *in;		/* \377 \377, or shouldn't happen */
+	    }
+	    p->pmstate = (*in++ == '\0') ? 2 : 0;
+	} else {
+	    parmrk_err(p, at + (out - buf), (unsigned char)*in,
+		(pool == ~0ULL) ? pool : (pool + (out - buf)));
+	    *out++ = *in++;
+	    p->pmstate = 0;
+	}
+    }
+
+    while (in < end) {
+	if ((q = memchr(in, '\377', end - in)) == NULL) {
+	    q = end;
+	}
+	if (out != in) {
+	    memmove(out, in, q - in);
+	}
+	out += q - in;
+	if ((in = q) == end) {
+	    break;
+	}
+	if ((end - in) < 2) {
+	    p->pmstate = 1;
+	    break;
+	}
+	if (in[1] != '\0') {
+	    *out++ = in[1];
+	    in += 2;
+	    continue;
+	}
+	if ((end - in) < 3) {
+	    p->pmstate = 2;
+	    break;
+	}
+	parmrk_err(p, at + (out - buf), (unsigned char)in[2],
+	    (pool == ~0ULL) ? pool : (pool + (out - buf)));
+	*out++ = in[2];
+	in += 3;
+    }
+    p->rxpos += out - buf;
+    return(out - buf);
+}
+
+/*
+ * Frames (-F)
+ *
+ * Some devices send binary frames in among their console text.
+ * With -F, rx_show() takes them out before anything else (the
+ * display, capture, triggers) sees what the port said.  A slip or
+ * cobs frame is whatever comes between two of its delimiters (0xC0,
+ * 0x00), so the device sends one before and one after each, and
+ * none in its text.  A len frame is the sync= bytes, then a size=
+ * byte count (little endian, or ",be") of the rest of it.  With
+ * crc=16 or 32, a frame ends in a CRC-16/XMODEM (high byte first)
+ * or CRC-32 (zlib's, low byte first) of what came before.
+ *
+ * Frames go to file= (or the port's ,frames=), a stamped capture
+ * of CAP_FRAME records, each stamped as its frame ended; one which
+ * fails its CRC is kept as it came as a CAP_BADFRAME, and so is the
+ * first max= of one which runs past it, after which we're back in
+ * the text.  The attached port's go out on the -M tap, too.
+ *
+ * It's all done where the read left it: the text moves down over
+ * the frames, and a frame is unescaped in place and handed on from
+ * there.  Only a frame cut off by the end of a read is copied
+ * aside, to be finished from the next.  Text between frames costs
+ * a memchr().  Something which looked like the start of a len
+ * sync at the end of one read, but wasn't, is lost from the text.
+ */
+#define FR_SLIP (1)
+#define FR_COBS (2)
+#define FR_LEN (3)
+#define FR_MAX (4096)		/* Longest frame, max= */
+#define FR_BIG (16 * 1024)	/* Most max= (and CRC): one record, even */
+				/*  in the smallest -M tap */
+#define FR_SYNC (8)		/* Most sync= bytes */
+
+#define FS_TEXT (0)		/* Between frames */
+#define FS_FRAME (1)		/* In a slip or cobs frame */
+#define FS_SYNC (2)		/* Part way through len's sync... */
+#define FS_HDR (3)		/*  ...or its count */
+#define FS_BODY (4)		/*  ...or the rest */
+
+#define SLIP_END (0300)
+#define SLIP_ESC (0333)
+#define SLIP_ESC_END (0334)
+#define SLIP_ESC_ESC (0335)
+
+static int fr_crc;		/* 0, 16 or 32 */
+static long fr_max = FR_MAX;
+static unsigned char fr_sync[FR_SYNC];
+static int fr_nsync, fr_size = 2, fr_be;	/* len's header */
+
+struct framer {
+    int state;			/* FS_* */
+    int esc;			/* slip: an ESC came last */
+    int left, zero;		/* cobs: bytes left in this block, and */
+				/*  whether a 0 goes before the next */
+    int broken;			/*  ...the frame ended inside one */
+    int got;			/* len: sync or count bytes seen */
+    unsigned char *syncat;	/*  ...where in this read the sync began */
+    unsigned long need;		/*  ...the count, then what's left */
+    unsigned char *base, *w;	/* The frame, and where it goes on */
+    size_t len, room;		/*  ...how long it is, and may be */
+    unsigned long long frames, bad;	/* Frames, and bad ones */
+    unsigned char stage[];	/* One cut off by the end of a read */
+};
+
+/*
+ * frame_options()
+ *	Parse -F slip|cobs|len[,sync=<hex>][,size=1|2|4][,be]
+ *	[,crc=16|32][,max=<size>][,file=<name>]
+ */
+static void
+frame_options(char *opts)
+{
+    static char *tokens[] = {"slip", "cobs", "len", "sync", "size", "be",
+	"crc", "max", "file", NULL};
+    char *val, *p, hex[3];
+    int x;
+
+    while (*opts) {
+	switch (x = getsubopt(&opts, tokens, &val)) {
+	case 0:
+	case 1:
+	case 2:
+	    fr_kind = FR_SLIP + x;
+	    break;
+
+	case 3:
+	    fr_nsync = 0;
+	    for (p = val; p && p[0] && p[1] && (fr_nsync < FR_SYNC); p += 2) {
+		if (!isxdigit((unsigned char)p[0]) ||
+			!isxdigit((unsigned char)p[1])) {
+		    break;
+		}
+		hex[0] = p[0];
+		hex[1] = p[1];
+		hex[2] = '\0';
+		fr_sync[fr_nsync++] = strtol(hex, NULL, 16);
+	    }
+	    if (!p || *p || !fr_nsync) {
+		fprintf(stderr, "Illegal frame sync: %s\n", val ? val : "");
+		usage();
+	    }
+	    break;
+
+	case 4:
+	    if (!val || (((fr_size = atoi(val)) != 1) && (fr_size != 2) &&
+		    (fr_size != 4))) {
+		fprintf(stderr, "Illegal frame count size\n");
+		usage();
+	    }
+	    break;
+
+	case 5:
+	    fr_be = 1;
+	    break;
+
+	case 6:
+	    if (!val || (((fr_crc = atoi(val)) != 16) && (fr_crc != 32))) {
+		fprintf(stderr, "Illegal frame CRC\n");
+		usage();
+	    }
+	    break;
+
+	case 7:
+	    if (!val || ((fr_max = getsize(val, NULL)) <= 0) ||
+		    (fr_max > (FR_BIG - 4))) {
+		fprintf(stderr, "Illegal frame size\n");
+		usage();
+	    }
+	    break;
+
+	case 8:
+	    if (!val || !*val) {
+		fprintf(stderr, "Missing frame file\n");
+		usage();
+	    }
+	    fr_name = val;
+	    break;
+
+	default:
+	    fprintf(stderr, "Illegal frame option: %s\n", val);
+	    usage();
+	}
+    }
+    if (!fr_kind) {
+	fprintf(stderr, "-F needs slip, cobs or len\n");
+	usage();
+    }
+    if ((fr_kind == FR_LEN) && !fr_nsync) {
+	fprintf(stderr, "len frames need a sync=\n");
+	usage();
+    }
+}
+
+/*
+ * frame_new()
+ *	A port's frame decoder, for port_add()
+ */
+static struct framer *
+frame_new(void)
+{
+    size_t room = fr_max + (fr_crc / 8);
+    struct framer *f;
+
+    if ((f = calloc(1, sizeof(struct framer) + room)) == NULL) {
+	perror("frames");
+	exit(1);
+    }
+    f->room = room;
+    if (fr_crc) {
+	crc_init();
+    }
+    return(f);
+}
+
+/*
+ * frame_format()
+ *	The attached port's frame counts, for stats_format()
+ */
+static int
+frame_format(char *buf, size_t len, int human)
+{
+    struct framer *f = cur->fr;
+
+    if (!f) {
+	return(0);
+    }
+    if (human) {
+	return(snprintf(buf, len, "%s frames: %llu, %llu bad\r\n",
+	    cur->tty, f->frames, f->bad));
+    }
+    return(snprintf(buf, len, " frames=%llu frames_bad=%llu",
+	f->frames, f->bad));
+}
+
+/*
+ * frame_done()
+ *	Port "p"'s frame is all here; check it and send it on
+ */
+static void
+frame_done(struct port *p)
+{
+    struct framer *f = p->fr;
+    size_t n = f->len, k = fr_crc / 8;
+    int type = CAP_FRAME;
+
+    f->state = FS_TEXT;
+    if ((n == 0) && !f->broken) {
+	return;			/* Just two delimiters */
+    }
+    if (f->broken || (n > f->room) || (n < k)) {
+	type = CAP_BADFRAME;
+	if (n > f->room) {
+	    n = f->room;
+	}
+    } else if (fr_crc == 16) {
+	if (crc16_upd(0, f->base, n - 2) !=
+		((f->base[n - 2] << 8) | f->base[n - 1])) {
+	    type = CAP_BADFRAME;
+	} else {
+	    n -= 2;
+	}
+    } else if (fr_crc == 32) {
+	if (~crc32_upd(~0U, f->base, n - 4) != cap_get(f->base + n - 4, 4)) {
+	    type = CAP_BADFRAME;
+	} else {
+	    n -= 4;
+	}
+    }
+    f->frames += 1;
+    if (type == CAP_BADFRAME) {
+	f->bad += 1;
+    }
+    if (p->frlog) {
+	log_stamp(p->frlog, type, (char *)f->base, n);
+    }
+    if ((p == cur) && tap) {
+	tap_put(type, (char *)f->base, n);
+    }
+}
+
+/*
+ * frame_put()
+ *	Add "c" to port "p"'s frame
+ *
+ * One which runs past max= is given up on as bad there and then,
+ * so a stray delimiter can't swallow the text after it.  Returns
+ * 0 if so.
+ */
+static int
+frame_put(struct port *p, int c)
+{
+    struct framer *f = p->fr;
+
+    if (f->len++ < f->room) {
+	*f->w++ = c;
+	return(1);
+    }
+    frame_done(p);
+    return(0);
+}
+
+/* More of a slip frame; returns where it stopped */
+static unsigned char *
+slip_more(struct port *p, unsigned char *in, unsigned char *end)
+{
+    struct framer *f = p->fr;
+    int c;
+
+    while (in < end) {
+	if ((c = *in++) == SLIP_END) {
+	    frame_done(p);
+	    break;
+	}
+	if (f->esc) {
+	    f->esc = 0;
+	    if (c == SLIP_ESC_END) {
+		c = SLIP_END;
+	    } else if (c == SLIP_ESC_ESC) {
+		c = SLIP_ESC;
+	    }
+	} else if (c == SLIP_ESC) {
+	    f->esc = 1;
+	    continue;
+	}
+	if (!frame_put(p, c)) {
+	    break;
+	}
+    }
+    return(in);
+}
+
+/*
+ * cobs_more()
+ *	...and of a cobs one
+ *
+ * Each block's code byte says how far it is to the next one, and
+ * (below 255) that a 0 goes there; the one the last would put at
+ * the end doesn't.  Decoded, a frame's never longer than it came.
+ */
+static unsigned char *
+cobs_more(struct port *p, unsigned char *in, unsigned char *end)
+{
+    struct framer *f = p->fr;
+    int c;
+
+    while (in < end) {
+	if ((c = *in++) == 0) {
+	    f->broken = (f->left != 0);
+	    frame_done(p);
+	    break;
+	}
+	if (f->left) {
+	    if (!frame_put(p, c)) {
+		break;
+	    }
+	    f->left -= 1;
+	    continue;
+	}
+	if (f->zero && !frame_put(p, 0)) {
+	    break;
+	}
+	f->left = c - 1;
+	f->zero = (c != 0xFF);
+    }
+    return(in);
+}
+
+/*
+ * frame_decode()
+ *	Take the frames out of "len" bytes "p" just said
+ *
+ * Returns how much text is left, at the front of "buf".
+ */
+static int
+frame_decode(struct port *p, char *buf, int len)
+{
+    struct framer *f = p->fr;
+    unsigned char *in = (unsigned char *)buf, *end = in + len, *out = in,
+	*q;
+    int delim = fr_sync[0];
+    unsigned long n;
+
+    if (fr_kind == FR_SLIP) {
+	delim = SLIP_END;
+    } else if (fr_kind == FR_COBS) {
+	delim = 0;
+    }
+    f->syncat = NULL;
+    while (in < end) {
+	switch (f->state) {
+	case FS_TEXT:
+	    if ((q = memchr(in, delim, end - in)) == NULL) {
+		q = end;
+	    }
+	    if (out != in) {
+		memmove(out, in, q - in);
+	    }
+	    out += q - in;
+	    if ((in = q) == end) {
+		break;
+	    }
+	    f->syncat = in++;
+	    f->base = f->w = in;
+	    f->len = 0;
+	    f->esc = f->left = f->zero = f->broken = 0;
+	    f->need = 0;
+	    if (fr_kind != FR_LEN) {
+		f->state = FS_FRAME;
+	    } else if (fr_nsync > 1) {
+		f->state = FS_SYNC;
+		f->got = 1;
+	    } else {
+		f->state = FS_HDR;
+		f->got = 0;
+	    }
+	    break;
+
+	case FS_FRAME:
+	    if (fr_kind == FR_SLIP) {
+		in = slip_more(p, in, end);
+	    } else {
+		in = cobs_more(p, in, end);
+	    }
+	    break;
+
+	/* Not a sync after all?  Then it was text */
+	case FS_SYNC:
+	    if (*in != fr_sync[f->got]) {
+		if (f->syncat) {
+		    *out++ = *f->syncat;
+		    in = f->syncat + 1;
+		}
+		f->state = FS_TEXT;
+		break;
+	    }
+	    in += 1;
+	    if (++f->got == fr_nsync) {
+		f->state = FS_HDR;
+		f->got = 0;
+	    }
+	    break;
+
+	/* A count too big for us means we've lost our place */
+	case FS_HDR:
+	    if (fr_be) {
+		f->need = (f->need << 8) | *in++;
+	    } else {
+		f->need |= (unsigned long)*in++ << (8 * f->got);
+	    }
+	    if (++f->got < fr_size) {
+		break;
+	    }
+	    f->state = FS_TEXT;
+	    if (f->need > f->room) {
+		f->frames += 1;
+		f->bad += 1;
+	    } else if (f->need) {
+		f->base = f->w = in;
+		f->state = FS_BODY;
+	    }
+	    break;
+
+	case FS_BODY:
+	    if ((n = end - in) > f->need) {
+		n = f->need;
+	    }
+	    if (f->w != in) {
+		memmove(f->w, in, n);
+	    }
+	    f->w += n;
+	    f->len += n;
+	    in += n;
+	    if ((f->need -= n) == 0) {
+		frame_done(p);
+	    }
+	    break;
+	}
+    }
+
+    /* One still going is finished from the next read */
+    if (((f->state == FS_FRAME) || (f->state == FS_BODY)) &&
+	    (f->base != f->stage)) {
+	memcpy(f->stage, f->base, f->w - f->base);
+	f->w = f->stage + (f->w - f->base);
+	f->base = f->stage;
+    }
+    return(out - (unsigned char *)buf);
+}
+
+/*
+ * relay_can_splice()
+ *	Could received data go straight through the kernel?
+ *
+ * Only if nothing needs to look at or change the bytes on their
+ * way by.
+ */
+static int
+relay_can_splice(struct port *p)
+{
+    if (p->strip_hi || p->parmrk || p->fr || relay_copy || net_addr || ntrigs ||
+	    tap_name || disp_skip) {
+	return(0);
+    }
+    if (p->log && ((log_policy == LOG_DROPOLD) || log_stamped)) {
+	return(0);		/* Can't take back what's in a pipe */
+    }
+    return(1);
+}
+
+#ifdef HAVE_SPLICE
+/*
+ * rx_unpipe()
+ *	Move "n" bytes from the front of rxpipe to the terminal
+ *
+ * Should the terminal turn out not to take splice(), the fast path
+ * is switched off and the bytes are copied over by hand.
+ */
+static void
+rx_unpipe(ssize_t n)
+{
+    ssize_t x;
+
+    while (n > 0) {
+	if (relay_fast) {
+	    x = splice(rxpipe[0], NULL, ttyfd, NULL, n, SPLICE_F_MOVE);
+	    if ((x < 0) && (errno == EINVAL)) {
+		relay_fast = 0;
+		continue;
+	    }
+	} else if ((x = read(rxpipe[0], rxbuf, (n < rxsize) ? n : rxsize)) > 0) {
+	    write(ttyfd, rxbuf, x);
+	}
+	if (x < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    fail("terminal write");
+	}
+	n -= x;
+    }
+}
+
+/*
+ * splice_input()
+ *	Receive through the kernel: port -> pipe -> terminal, plus log
+ *
+ * The log's copy is made with tee(), from the front of rxpipe,
+ * before the terminal consumes it.  If the log's pipe is full we
+ * either wait (full=block) or it loses the rest of this chunk.
+ *
+ * Returns -1 if the port won't splice; the fast path is then off
+ * for good and the caller reads it the ordinary way.
+ */
+static int
+splice_input(struct port *p)
+{
+    struct logring *logp = p->log;
+    ssize_t n, x, t;
+    struct pollfd pfd;
+
+    n = splice(p->src.fd, NULL, rxpipe[1], NULL, rxsize,
+	SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+    if (n < 0) {
+	if ((errno == EINTR) || (errno == EAGAIN)) {
+	    return(0);
+	}
+	if ((errno == EINVAL) || (errno == ENOSYS)) {
+	    relay_fast = 0;
+	    return(-1);
+	}
+	if (p->reconnect) {
+	    port_lost(p);
+	    return(0);
+	}
+	fail("serial read");
+    }
+    if (n == 0) {
+	if (p->reconnect) {
+	    port_lost(p);
+	    return(0);
+	}
+	errno = EIO;
+	fail("serial read");
+    }
+    stats.rx += n;
+    stats.reads += 1;
+    for (t = n; t > 0; t -= x) {
+	if (!logp) {
+	    x = t;
+	} else if ((x = tee(rxpipe[0], logp->pipe[1], t, SPLICE_F_NONBLOCK)) <= 0) {
+	    if ((x < 0) && (errno == EINTR)) {
+		x = 0;
+		continue;
+	    }
+	    logp->high = logp->size;
+	    if (logp->policy == LOG_BLOCK) {
+		pfd.fd = logp->pipe[1];
+		pfd.events = POLLOUT;
+		(void)poll(&pfd, 1, -1);
+		x = 0;
+		continue;
+	    }
+	    logp->dropped += t;
+	    x = t;
+	} else if ((x < t) && (logp->policy != LOG_BLOCK)) {
+	    logp->dropped += t - x;
+	    x = t;
+	}
+	rx_unpipe(x);
+    }
+    rx_pace(p, n);
+    return(0);
+}
+#endif
+
+/*
+ * Triggers (-T)
+ *
+ * A file of patterns to watch the attached port for, and what to
+ * do on seeing each: type something back, start a transfer, put a
+ * mark in the log, count it, or exit.  One line per trigger:
+ *
+ *	"Hit any key to stop autoboot"	send " "
+ *	"Kernel panic"			mark
+ *	/^ERROR/			count
+ *	"login: "			send "root\r" once
+ *	"U-Boot SPL"			exit 3
+ *	"**\030B00"			xfer receive
+ *
+ * A "quoted" pattern is literal (\r, \n, \t, \e, \xNN, \\ and \"
+ * as in C), and is found wherever it is, even across reads.  All
+ * of them are compiled into one Aho-Corasick automaton, a DFA over
+ * just the byte values the patterns use, so each byte received
+ * costs a table lookup however many patterns there are.  A /regex/
+ * (POSIX extended) is tried against each line as it's completed;
+ * lines are only kept if there are any.
+ */
+#define TRIG_LINE (1024)	/* Longest line a regex sees */
+
+#define TA_SEND (0)		/* Actions */
+#define TA_XFER_R (1)
+#define TA_XFER_S (2)
+#define TA_MARK (3)
+#define TA_COUNT (4)
+#define TA_EXIT (5)
+
+struct trigger {
+    char *pat;			/* As written, for messages */
+    regex_t re;			/* If a /regex/ */
+    int isre;
+    int action;			/* TA_* */
+    char *arg;			/* Send string, file, or mark text */
+    int arglen, code;
+    int once, done;
+    unsigned long long count;
+    struct trigger *same;	/* Next literal ending in the same state */
+};
+
+static char *trig_name;		/* -T */
+static struct trigger *trigs;
+static int trig_nre;		/* How many are regexes */
+
+/*
+ * The DFA.  An entry of trig_delta is the next state's row
+ * (state * trig_ncls), shifted left one, with the low bit set if
+ * some pattern ends there; trig_out[state] is the first of them,
+ * and trig_link[] the next state down the failure chain which has
+ * any.
+ */
+static int *trig_delta, trig_ncls, trig_state;
+static unsigned short trig_cls[256];
+static unsigned char trig_first[256];	/* Bytes which start a pattern */
+static struct trigger **trig_out;
+static int *trig_link;
+
+static char trig_line[TRIG_LINE];	/* Line so far, for regexes */
+static int trig_llen;
+
+/*
+ * trig_word()
+ *	Take the next word (or "quoted" string, or /regex/) off *pp
+ *
+ * Escapes in quotes are turned into what they stand for; a regex
+ * is left alone but for \/.  Returns the length, or -1 at the end
+ * of the line; "*kind" is the opening quote, or 0.
+ */
+static int
+trig_word(char **pp, char *out, int *kind)
+{
+    char *p = *pp, q;
+    int n = 0, c, x;
+
+    while ((*p == ' ') || (*p == '\t')) {
+	++p;
+    }
+    if (!*p || (*p == '\n') || (*p == '#')) {
+	return(-1);
+    }
+    *kind = 0;
+    if ((*p == '"') || (*p == '/')) {
+	*kind = q = *p++;
+	while (*p && (*p != q) && (*p != '\n')) {
+	    if ((*p != '\\') || !p[1]) {
+		out[n++] = *p++;
+		continue;
+	    }
+	    c = *++p;
+	    p += 1;
+	    if (q == '/') {
+		if (c != '/') {
+		    out[n++] = '\\';
+		}
+		out[n++] = c;
+		continue;
+	    }
+	    switch (c) {
+	    case 'r':
+		c = '\r';
+		break;
+	    case 'n':
+		c = '\n';
+		break;
+	    case 't':
+		c = '\t';
+		break;
+	    case 'e':
+		c = '\033';
+		break;
+	    case 'x':
+		for (c = x = 0; (x < 2) && isxdigit((unsigned char)*p); ++x) {
+		    c = (c << 4) + (isdigit((unsigned char)*p) ?
+			(*p - '0') : ((tolower((unsigned char)*p) - 'a') + 10));
+		    ++p;
+		}
+		break;
+	    }
+	    out[n++] = c;
+	}
+	if (*p++ != q) {
+	    return(-2);
+	}
+    } else {
+	while (*p && !isspace((unsigned char)*p)) {
+	    out[n++] = *p++;
+	}
+    }
+    out[n] = '\0';
+    *pp = p;
+    return(n);
+}
+
+/*
+ * trig_build()
+ *	Compile the literal patterns into the DFA
+ */
+static void
+trig_build(void)
+{
+    int nstates = 1, max = 1, s, t, c, x, *q, qh = 0, qt = 0;
+    int *goto_, *fail;
+    struct trigger *tr;
+    size_t k;
+
+    /* Byte classes: 0 is everything no pattern uses */
+    for (x = 0; x < ntrigs; ++x) {
+	if (!trigs[x].isre) {
+	    max += strlen(trigs[x].pat);
+	    for (k = 0; trigs[x].pat[k]; ++k) {
+		c = (unsigned char)trigs[x].pat[k];
+		if (!trig_cls[c]) {
+		    trig_cls[c] = ++trig_ncls;
+		}
+	    }
+	}
+    }
+    trig_ncls += 1;
+    if (((goto_ = malloc(sizeof(int) * max * trig_ncls)) == NULL) ||
+	    ((fail = calloc(max, sizeof(int))) == NULL) ||
+	    ((q = malloc(sizeof(int) * max)) == NULL) ||
+	    ((trig_out = calloc(max, sizeof(struct trigger *))) == NULL) ||
+	    ((trig_link = calloc(max, sizeof(int))) == NULL)) {
+	perror(trig_name);
+	exit(1);
+    }
+    memset(goto_, 0xFF, sizeof(int) * max * trig_ncls);
+
+    /* The trie */
+    for (x = 0; x < ntrigs; ++x) {
+	tr = &trigs[x];
+	if (tr->isre) {
+	    continue;
+	}
+	for (s = 0, k = 0; tr->pat[k]; ++k) {
+	    c = trig_cls[(unsigned char)tr->pat[k]];
+	    if (goto_[s * trig_ncls + c] < 0) {
+		goto_[s * trig_ncls + c] = nstates++;
+	    }
+	    s = goto_[s * trig_ncls + c];
+	}
+	tr->same = trig_out[s];
+	trig_out[s] = tr;
+    }
+
+    /*
+     * Breadth first, each state's missing moves become its failure
+     * state's, which (being shallower) is already done.
+     */
+    for (c = 0; c < trig_ncls; ++c) {
+	if ((t = goto_[c]) < 0) {
+	    goto_[c] = 0;
+	} else {
+	    q[qt++] = t;
+	}
+    }
+    while (qh < qt) {
+	s = q[qh++];
+	trig_link[s] = trig_out[fail[s]] ? fail[s] : trig_link[fail[s]];
+	for (c = 0; c < trig_ncls; ++c) {
+	    if ((t = goto_[s * trig_ncls + c]) < 0) {
+		goto_[s * trig_ncls + c] = goto_[fail[s] * trig_ncls + c];
+	    } else {
+		fail[t] = goto_[fail[s] * trig_ncls + c];
+		q[qt++] = t;
+	    }
+	}
+    }
+
+    /* Now in the form the receive loop wants */
+    for (k = 0; k < (size_t)(nstates * trig_ncls); ++k) {
+	t = goto_[k];
+	goto_[k] = ((t * trig_ncls) << 1) |
+	    ((trig_out[t] || trig_link[t]) ? 1 : 0);
+    }
+    trig_delta = goto_;
+    for (c = 0; c < 256; ++c) {
+	trig_first[c] = (trig_delta[trig_cls[c]] != 0);
+    }
+    free(fail);
+    free(q);
+}
+
+/*
+ * trig_load()
+ *	Read the -T file
+ */
+static void
+trig_load(void)
+{
+    static char *actions[] = {"send", "xfer", "mark", "count", "exit", NULL};
+    char line[2048], word[2048], *p;
+    int lineno = 0, n, kind, x;
+    struct trigger *tr;
+    FILE *fp;
+
+    if ((fp = fopen(trig_name, "r")) == NULL) {
+	perror(trig_name);
+	exit(1);
+    }
+    while (fgets(line, sizeof(line), fp)) {
+	lineno += 1;
+	p = line;
+	if ((n = trig_word(&p, word, &kind)) == -1) {
+	    continue;
+	}
+	if ((n <= 0) || !kind) {
+	    goto bad;
+	}
+	if ((trigs = realloc(trigs, (ntrigs + 1) * sizeof(*trigs))) == NULL) {
+	    perror(trig_name);
+	    exit(1);
+	}
+	tr = &trigs[ntrigs];
+	memset(tr, 0, sizeof(*tr));
+	tr->pat = strdup(word);
+	if (kind == '/') {
+	    if (regcomp(&tr->re, word, REG_EXTENDED|REG_NOSUB) != 0) {
+		goto bad;
+	    }
+	    tr->isre = 1;
+	    trig_nre += 1;
+	} else if (strlen(word) != n) {
+	    goto bad;		/* A \x00 can't be matched */
+	}
+
+	if (trig_word(&p, word, &kind) <= 0) {
+	    goto bad;
+	}
+	for (x = 0; actions[x] && strcmp(word, actions[x]); ++x)
+	    ;
+	switch (x) {
+	case 0:
+	    if ((n = trig_word(&p, word, &kind)) <= 0) {
+		goto bad;
+	    }
+	    tr->action = TA_SEND;
+	    if ((tr->arg = malloc(n)) == NULL) {
+		perror(trig_name);
+		exit(1);
+	    }
+	    memcpy(tr->arg, word, n);
+	    tr->arglen = n;
+	    break;
+
+	case 1:
+	    if (trig_word(&p, word, &kind) <= 0) {
+		goto bad;
+	    }
+	    if (!strcmp(word, "receive")) {
+		tr->action = TA_XFER_R;
+		if (trig_word(&p, word, &kind) > 0) {
+		    tr->arg = strdup(word);
+		} else if (proto == PROTO_RX) {
+		    fprintf(stderr, "%s:%d: XMODEM needs a file name to "
+			"receive into\n", trig_name, lineno);
+		    exit(1);
+		}
+	    } else if (!strcmp(word, "send") &&
+		    (trig_word(&p, word, &kind) > 0)) {
+		tr->action = TA_XFER_S;
+		tr->arg = strdup(word);
+	    } else {
+		goto bad;
+	    }
+	    break;
+
+	case 2:
+	    tr->action = TA_MARK;
+	    tr->arg = tr->pat;
+	    if (trig_word(&p, word, &kind) > 0) {
+		tr->arg = strdup(word);
+	    }
+	    break;
+
+	case 3:
+	    tr->action = TA_COUNT;
+	    break;
+
+	case 4:
+	    if (trig_word(&p, word, &kind) <= 0) {
+		goto bad;
+	    }
+	    tr->action = TA_EXIT;
+	    tr->code = atoi(word);
+	    break;
+
+	default:
+	    goto bad;
+	}
+	if ((n = trig_word(&p, word, &kind)) > 0) {
+	    if (strcmp(word, "once")) {
+		goto bad;
+	    }
+	    tr->once = 1;
+	    n = trig_word(&p, word, &kind);
+	}
+	if (n != -1) {
+	    goto bad;
+	}
+	ntrigs += 1;
+	continue;
+bad:
+	fprintf(stderr, "%s:%d: bad trigger\n", trig_name, lineno);
+	exit(1);
+    }
+    fclose(fp);
+    trig_build();
+}
+
+/*
+ * trig_fire()
+ *	Do what trigger "tr" says
+ */
+static void
+trig_fire(struct trigger *tr)
+{
+    char buf[TRIG_LINE + 64];
+    int n;
+
+    if (tr->done) {
+	return;
+    }
+    tr->count += 1;
+    tr->done = tr->once;
+
+    switch (tr->action) {
+    case TA_SEND:
+	tx_put(tr->arg, tr->arglen);
+	break;
+
+    case TA_XFER_R:
+    case TA_XFER_S:
+	if (xfer) {
+	    break;
+	}
+	n = snprintf(buf, sizeof(buf), "[trigger: %s]\r\n", tr->pat);
+	disp_say(ttyfd, buf, n);
+	xfer_start(tr->action == TA_XFER_S, tr->arg);
+	if (!xfer) {
+	    setup_serial(cur);
+	}
+	break;
+
+    case TA_MARK:
+	if (cur->log) {
+	    log_mark(cur->log, tr->arg);
+	}
+	break;
+
+    case TA_COUNT:
+	break;
+
+    case TA_EXIT:
+	n = snprintf(buf, sizeof(buf), "\r\n[trigger: %s; exit %d]\r\n",
+	    tr->pat, tr->code);
+	disp_sync();
+	write(ttyfd, buf, n);
+	exit_code = tr->code;
+	done();
+    }
+}
+
+/*
+ * trig_lines()
+ *	Pass "buf" on to "port"'s user and log, trying the regexes
+ *	against each line finished in it
+ *
+ * What's up to the end of a matching line goes out before its
+ * trigger does anything.  Returns how much went out; all of it,
+ * unless a trigger started a transfer, which the rest is for.
+ */
+static int
+trig_lines(struct port *port, char *buf, int len)
+{
+    char *p = buf, *end = buf + len, *out = buf, *e;
+    int n, x;
+
+    while (trig_nre && (p < end)) {
+	for (e = p; (e < end) && (*e != '\n') && (*e != '\r'); ++e)
+	    ;
+	if ((n = e - p) > (TRIG_LINE - 1 - trig_llen)) {
+	    n = TRIG_LINE - 1 - trig_llen;
+	}
+	memcpy(trig_line + trig_llen, p, n);
+	trig_llen += n;
+	if (e == end) {
+	    break;
+	}
+	p = e + 1;
+	if (!trig_llen) {
+	    continue;
+	}
+	trig_line[trig_llen] = '\0';
+	trig_llen = 0;
+	for (x = 0; x < ntrigs; ++x) {
+	    if (trigs[x].isre && !trigs[x].done &&
+		    (regexec(&trigs[x].re, trig_line, 0, NULL, 0) == 0)) {
+		if (out < p) {
+		    rx_out(port, out, p - out);
+		    out = p;
+		}
+		trig_fire(&trigs[x]);
+	    }
+	}
+	if (xfer) {
+	    return(p - buf);
+	}
+    }
+    if (out < end) {
+	rx_out(port, out, end - out);
+    }
+    return(len);
+}
+
+/*
+ * trig_scan()
+ *	Run what "port" said through the triggers, and on to its user
+ *	and log
+ *
+ * Back at the start state, we can skip along to the next byte
+ * which begins some pattern without going through the table.  As
+ * with trig_lines(), what's up to the end of a match goes out
+ * before its trigger fires, and if one starts a transfer, the rest
+ * is the transfer's; returns where that starts, else "len".
+ */
+static int
+trig_scan(struct port *port, char *buf, int len)
+{
+    unsigned char *p = (unsigned char *)buf, *end = p + len;
+    int s = trig_state, x, done = 0, n;
+    struct trigger *tr;
+
+    while (p < end) {
+	if (s == 0) {
+	    while ((p < end) && !trig_first[*p]) {
+		++p;
+	    }
+	    if (p == end) {
+		break;
+	    }
+	}
+	s = trig_delta[(s >> 1) + trig_cls[*p++]];
+	if (s & 1) {
+	    n = (char *)p - buf;
+	    if ((done += trig_lines(port, buf + done, n - done)) < n) {
+		trig_state = 0;
+		return(done);	/* A regex started a transfer */
+	    }
+	    for (x = (s >> 1) / trig_ncls; x; x = trig_link[x]) {
+		for (tr = trig_out[x]; tr; tr = tr->same) {
+		    trig_fire(tr);
+		}
+	    }
+	    if (xfer) {
+		trig_state = 0;
+		return(done);
+	    }
+	}
+    }
+    trig_state = s;
+    return(done + trig_lines(port, buf + done, len - done));
+}
+
+/*
+ * trig_format()
+ *	How often each counting trigger has gone off, for stats_format()
+ *
+ * A human is only told about the ones which have.
+ */
+static int
+trig_format(char *buf, size_t len, int human)
+{
+    int x, n = 0;
+
+    for (x = 0; (x < ntrigs) && (n < (int)len); ++x) {
+	if ((trigs[x].action != TA_COUNT) || (human && !trigs[x].count)) {
+	    continue;
+	}
+	if (human) {
+	    n += snprintf(buf + n, len - n, "%s: %llu matches\r\n",
+		trigs[x].pat, trigs[x].count);
+	} else {
+	    n += snprintf(buf + n, len - n, " trigger%d=%llu", x + 1,
+		trigs[x].count);
+	}
+    }
+    if (n >= (int)len) {
+	n = len ? (len - 1) : 0;
+    }
+    return(n);
+}
+
+/* Start over, as on moving to another port */
+static void
+trig_reset(void)
+{
+    trig_state = 0;
+    trig_llen = 0;
+}
+
+/*
+ * Display modes (-D mode=, ^Z m)
+ *
+ * What the terminal is shown can be the bytes as they come (raw),
+ * or rendered: control characters in caret notation (M- for the
+ * top bit, as cat -v does), a hex and ASCII dump, or each line
+ * stamped with the time.  Rendering is done by the display thread,
+ * a buffer at a time, through tables built once: a caret-notation
+ * entry, a hex pair or an ASCII column character for every byte
+ * value, so it costs a table lookup and a small copy per byte and
+ * keeps up with far more than a serial port can send.  Capture,
+ * clients and triggers always get the bytes as they are.
+ */
+#define DM_RAW (0)
+#define DM_CARET (1)
+#define DM_HEX (2)
+#define DM_TIME (3)
+static char *dm_names[] = {"raw", "caret", "hex", "time", NULL};
+/*
+ * Most output per byte of input: a hex line is 88 bytes for 16 once
+ * the offset needs all 16 digits (past 4G)
+ */
+static int dm_grow[] = {1, 4, 6, 16};
+
+static char dm_caret[256][8];	/* What to show for each byte, */
+static unsigned char dm_caretlen[256];	/*  ...and how long that is */
+static char dm_hex[256][4];	/* "xx " */
+static char dm_asc[256];	/* Hex dump's ASCII column */
+
+/* Display thread's place in the rendering */
+struct dmstate {
+    int mode;
+    int bol;			/* At the start of a line (DM_TIME) */
+    unsigned long long off;	/* Offset of the next byte (DM_HEX) */
+    time_t sec;			/* Time stamp, as of this second */
+    char stamp[16];
+};
+
+/* Build the tables */
+static void
+dm_tables(void)
+{
+    static char hexd[] = "0123456789abcdef";
+    char *p;
+    int c, x;
+
+    for (c = 0; c < 256; ++c) {
+	p = dm_caret[c];
+	x = c & 0x7F;
+	if (c & 0x80) {
+	    *p++ = 'M';
+	    *p++ = '-';
+	}
+	if ((x < 0x20) || (x == 0x7F)) {
+	    *p++ = '^';
+	    *p++ = x ^ 0x40;
+	} else {
+	    *p++ = x;
+	}
+	if (c == '\n') {
+	    *p++ = '\r';
+	    *p++ = '\n';
+	}
+	dm_caretlen[c] = p - dm_caret[c];
+	dm_hex[c][0] = hexd[c >> 4];
+	dm_hex[c][1] = hexd[c & 0xF];
+	dm_hex[c][2] = ' ';
+	dm_asc[c] = ((c >= 0x20) && (c < 0x7F)) ? c : '.';
+    }
+}
+
+/*
+ * dm_hexline()
+ *	One line of hex dump: "len" (up to 16) bytes at offset "off"
+ */
+static char *
+dm_hexline(char *o, unsigned long long off, unsigned char *in, int len)
+{
+    int x;
+
+    for (x = (off >> 32) ? 56 : 24; x >= 0; x -= 8) {
+	memcpy(o, dm_hex[(off >> x) & 0xFF], 2);
+	o += 2;
+    }
+    *o++ = ' ';
+    for (x = 0; x < 16; ++x) {
+	if ((x & 7) == 0) {
+	    *o++ = ' ';
+	}
+	memcpy(o, (x < len) ? dm_hex[in[x]] : "   ", 3);
+	o += 3;
+    }
+    *o++ = ' ';
+    *o++ = '|';
+    for (x = 0; x < len; ++x) {
+	*o++ = dm_asc[in[x]];
+    }
+    memcpy(o, "|\r\n", 3);
+    return(o + 3);
+}
+
+/*
+ * dm_format()
+ *	Render "n" bytes for the terminal, into "o"; how much room
+ *	that takes is at most dm_grow[] times "n", plus a line
+ *
+ * Returns the length of what's in "o".
+ */
+static size_t
+dm_format(struct dmstate *f, unsigned char *in, size_t n, char *o)
+{
+    char *start = o;
+    unsigned char *end = in + n, *nl;
+    struct timeval tv;
+    struct tm tm;
+    int len;
+
+    switch (f->mode) {
+    case DM_CARET:
+	while (in < end) {
+	    memcpy(o, dm_caret[*in], 8);
+	    o += dm_caretlen[*in++];
+	}
+	break;
+
+    /* A short last line stays short; the next byte starts a new one */
+    case DM_HEX:
+	while (in < end) {
+	    len = ((end - in) < 16) ? (end - in) : 16;
+	    o = dm_hexline(o, f->off, in, len);
+	    f->off += len;
+	    in += len;
+	}
+	break;
+
+    /* Each line's stamp is when we got to its first byte */
+    case DM_TIME:
+	gettimeofday(&tv, NULL);
+	if (tv.tv_sec != f->sec) {
+	    f->sec = tv.tv_sec;
+	    localtime_r(&f->sec, &tm);
+	    strftime(f->stamp, sizeof(f->stamp), "[%H:%M:%S.", &tm);
+	}
+	while (in < end) {
+	    if (f->bol) {
+		o += sprintf(o, "%s%03d] ", f->stamp, (int)(tv.tv_usec / 1000));
+		f->bol = 0;
+	    }
+	    if ((nl = memchr(in, '\n', end - in)) != NULL) {
+		f->bol = 1;
+		nl += 1;
+	    } else {
+		nl = end;
+	    }
+	    memcpy(o, in, nl - in);
+	    o += nl - in;
+	    in = nl;
+	}
+	break;
+    }
+    return(o - start);
+}
+
+/*
+ * Receive fan-out
+ *
+ * What the attached port says is read straight into rxpool, once,
+ * and everything downstream takes it from there at its own pace,
+ * each keeping its own place.  Places are positions which count up
+ * forever; position n is at rxpool[n % rxpool_size].
+ *
+ *	The display thread writes it to the user's terminal, so a
+ *	terminal which is slow to draw holds up only itself.
+ *	Each network client is written as much as its socket will
+ *	take, straight from the pool (see net_flush()).
+ *	The log, the tap and the triggers take theirs as it arrives,
+ *	into rings (or state) of their own.
+ *
+ * By default the terminal mustn't miss anything, so once it's a
+ * whole pool behind we stop reading the port until it catches up.
+ * With -D full=skip, or while the display's paused (^Z d), we read
+ * on regardless, and a terminal which falls too far behind skips
+ * ahead instead (the log still gets it all).  A network client
+ * more than its backlog behind is dropped.  The pool is cache
+ * line aligned, and the display thread's place has a line to
+ * itself, away from what the event loop writes.  On the splice()
+ * fast path none of this is needed, and none of it is used.
+ */
+#define RXPOOL (1024*1024)	/* Least pool size */
+#define DISP_SPIN (50)		/* usec the display thread waits awake */
+#define DISP_CHUNK (64*1024)	/* Most written to the terminal at once */
+#define DISP_KEEP (4096)	/* How far back to look for a line start */
+
+static struct {
+    unsigned long long pos;	/* Terminal has taken up to here */
+    unsigned long long done;	/*  ...and been written up to */
+    unsigned long long elided;	/* Bytes it was never shown */
+    int idle;			/* Thread is waiting for more */
+    int spin;			/* ...after this long (usec) awake */
+    int paused;			/* ^Z d */
+    int mode;			/* DM_*, -D mode= or ^Z m */
+} __attribute__((aligned(64))) disp;
+static pthread_t disp_thread;
+static pthread_mutex_t disp_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t disp_more = PTHREAD_COND_INITIALIZER,
+    disp_drained = PTHREAD_COND_INITIALIZER;
+static long long disp_queue = RXPOOL / 2;	/*  ...once this far behind */
+static unsigned long long rx_end;	/* Read in progress may fill to here */
+
+/*
+ * Where in the pool the line errors are, for -f parmrk=show.  Only
+ * the event loop adds, only the display thread takes; should it
+ * fall this far behind, the rest just aren't highlighted.
+ */
+#define DISP_ERRS (256)
+static unsigned long long disp_err[DISP_ERRS];
+static unsigned long long disp_errhead, disp_errtail;
+
+/*
+ * disp_mark()
+ *	Note a line error at this position in the receive pool
+ */
+static void
+disp_mark(unsigned long long at)
+{
+    unsigned long long head = disp_errhead;
+
+    if ((head - __atomic_load_n(&disp_errtail, __ATOMIC_ACQUIRE)) >=
+	    DISP_ERRS) {
+	return;
+    }
+    disp_err[head % DISP_ERRS] = at;
+    __atomic_store_n(&disp_errhead, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * What the event loop has to say on the terminal, with -D full=skip:
+ * rather than wait for the terminal to catch up (disp_sync()), each
+ * is queued to go out once the display gets to where the pool's
+ * head was when it was said.  Should too many pile up, the rest are
+ * dropped.
+ */
+#define DISP_NOTES (32)
+#define DISP_NOTE (2048)	/* Longest one; a -S line fits */
+static struct dnote {
+    unsigned long long pos;	/* Goes out before what's from here on */
+    int fd, len;
+    char text[DISP_NOTE];
+} disp_note[DISP_NOTES];
+static unsigned long long disp_nhead, disp_ntail;
+
+/* Write all of "buf", unless the terminal won't take it at all */
+static void
+disp_out(int fd, const char *buf, size_t n)
+{
+    ssize_t x;
+    size_t k;
+
+    for (k = 0; k < n; k += x) {
+	if ((x = write(fd, buf + k, n - k)) < 0) {
+	    if (errno == EINTR) {
+		x = 0;
+		continue;
+	    }
+	    break;
+	}
+    }
+}
+
+/*
+ * disp_notes()
+ *	Display thread: write the notes which go out before "pos"
+ *
+ * Returns where the next one goes, or ~0 if there isn't one yet.
+ */
+static unsigned long long
+disp_notes(unsigned long long pos)
+{
+    unsigned long long head = __atomic_load_n(&disp_nhead, __ATOMIC_ACQUIRE),
+	tail = disp_ntail;
+    struct dnote *d;
+
+    for (; tail != head; ++tail) {
+	d = &disp_note[tail % DISP_NOTES];
+	if (d->pos > pos) {
+	    break;
+	}
+	disp_out(d->fd, d->text, d->len);
+    }
+    __atomic_store_n(&disp_ntail, tail, __ATOMIC_RELEASE);
+    return((tail == head) ? ~0ULL : disp_note[tail % DISP_NOTES].pos);
+}
+
+/*
+ * disp_hilite()
+ *	Copy out what the pool had from "start", line errors in reverse
+ *
+ * Returns how much went into "fmt".  Errors from before "start" were
+ * skipped over or elided, and are just dropped.
+ */
+static size_t
+disp_hilite(unsigned long long start, const char *buf, size_t n, char *fmt)
+{
+    unsigned long long head, tail, at;
+    char *o = fmt;
+    size_t done = 0;
+
+    head = __atomic_load_n(&disp_errhead, __ATOMIC_ACQUIRE);
+    for (tail = disp_errtail; tail != head; ++tail) {
+	if ((at = disp_err[tail % DISP_ERRS]) < start) {
+	    continue;
+	}
+	if (at >= (start + n)) {
+	    break;
+	}
+	at -= start;
+	memcpy(o, buf + done, at - done);
+	o += at - done;
+	memcpy(o, "\033[7m", 4);
+	o[4] = buf[at];
+	memcpy(o + 5, "\033[27m", 5);
+	o += 10;
+	done = at + 1;
+    }
+    __atomic_store_n(&disp_errtail, tail, __ATOMIC_RELEASE);
+    memcpy(o, buf + done, n - done);
+    return((o - fmt) + (n - done));
+}
+
+/*
+ * disp_options()
+ *	Parse -D full=block|skip[,queue=<size>][,mode=<mode>]
+ */
+static void
+disp_options(char *opts)
+{
+    static char *tokens[] = {"full", "queue", "mode", NULL};
+    char *val;
+    long long size;
+    int x;
+
+    while (*opts) {
+	switch (getsubopt(&opts, tokens, &val)) {
+	case 0:
+	    if (val && !strcmp(val, "block")) {
+		disp_skip = 0;
+	    } else if (val && !strcmp(val, "skip")) {
+		disp_skip = 1;
+	    } else {
+		fprintf(stderr, "Illegal display policy\n");
+		usage();
+	    }
+	    break;
+
+	case 1:
+	    if (!val || ((size = getsize(val, NULL)) < 4096) ||
+		    (size > (1 << 30))) {
+		fprintf(stderr, "Illegal display queue size\n");
+		usage();
+	    }
+	    disp_queue = size;
+	    break;
+
+	case 2:
+	    for (x = 0; dm_names[x] && (!val || strcmp(val, dm_names[x])); ++x)
+		;
+	    if (!dm_names[x]) {
+		fprintf(stderr, "Illegal display mode\n");
+		usage();
+	    }
+	    disp.mode = x;
+	    break;
+
+	default:
+	    fprintf(stderr, "Illegal display option: %s\n", val);
+	    usage();
+	}
+    }
+}
+
+/*
+ * disp_resync()
+ *	Where to carry on from, having fallen behind at "pos": the
+ *	start of the line "head" is in, if that's recent, else "head"
+ *
+ * The bytes just behind the head are the last to be written over.
+ */
+static unsigned long long
+disp_resync(unsigned long long pos, unsigned long long head)
+{
+    unsigned long long p, lo = head - DISP_KEEP;
+
+    if ((head < DISP_KEEP) || (lo < pos)) {
+	lo = pos;
+    }
+    for (p = head; p > lo; --p) {
+	if (rxpool[(p - 1) & (rxpool_size - 1)] == '\n') {
+	    return(p);
+	}
+    }
+    return(head);
+}
+
+/*
+ * disp_writer()
+ *	Display thread: copy the pool to the user's terminal
+ *
+ * Each piece is copied out before it's written, so the event loop
+ * needn't wait on a write to the terminal to use the pool again.
+ * With -D full=skip (or while the display's paused) it doesn't wait
+ * for the terminal at all, and may lap it; a piece which was being
+ * written over as we copied it is caught by looking at rx_end
+ * afterwards.  The terminal then skips ahead, and is told how much
+ * it missed.  Unless the display's raw, each piece is rendered
+ * (dm_format()) on its way.  If the terminal won't take something
+ * at all, it's thrown away; the event loop will find out for itself
+ * soon enough.
+ */
+static void *
+disp_writer(void *arg)
+{
+    static char out[DISP_CHUNK], fmt[DISP_CHUNK * 2];
+    unsigned long long pos = 0, head, to, next;
+    struct dmstate dm;
+    long long until;
+    size_t off, n;
+    int paused = 0, mode, hilite;
+    char *src = out;
+
+    memset(&dm, 0, sizeof(dm));
+
+    for (;;) {
+	/* Whatever the event loop said before we got here */
+	next = disp_notes(pos);
+
+	/* More is usually on its way; look again for a bit first */
+	if ((head = __atomic_load_n(&rx_head, __ATOMIC_ACQUIRE)) == pos) {
+	    for (until = ev_now() + disp.spin; (head == pos) &&
+		    (ev_now() < until); ) {
+		head = __atomic_load_n(&rx_head, __ATOMIC_ACQUIRE);
+	    }
+	}
+	if ((head == pos) || __atomic_load_n(&disp.paused, __ATOMIC_ACQUIRE)) {
+	    pthread_mutex_lock(&disp_lock);
+	    __atomic_store_n(&disp.idle, 1, __ATOMIC_SEQ_CST);
+	    pthread_cond_broadcast(&disp_drained);
+	    while (disp.paused ||
+		    ((__atomic_load_n(&rx_head, __ATOMIC_SEQ_CST) == pos) &&
+		    (__atomic_load_n(&disp_nhead, __ATOMIC_SEQ_CST) ==
+		    disp_ntail))) {
+		paused |= disp.paused;
+		pthread_cond_wait(&disp_more, &disp_lock);
+	    }
+	    __atomic_store_n(&disp.idle, 0, __ATOMIC_RELAXED);
+	    pthread_mutex_unlock(&disp_lock);
+	    if (!paused) {
+		continue;
+	    }
+	    head = __atomic_load_n(&rx_head, __ATOMIC_ACQUIRE);
+	}
+
+	/* Back from a pause, lapped, or just too far behind? */
+	if (paused || (__atomic_load_n(&rx_end, __ATOMIC_SEQ_CST) >
+		(pos + rxpool_size)) || (disp_skip && ((head - pos) >
+		(unsigned long long)disp_queue))) {
+	    to = disp_resync(pos, head);
+	    n = snprintf(out, sizeof(out), paused ?
+		"\r\n[display resumed; %llu bytes not shown]\r\n" :
+		"\r\n[%llu bytes elided]\r\n", to - pos);
+	    __atomic_fetch_add(&disp.elided, to - pos, __ATOMIC_RELAXED);
+	    dm.off += to - pos;
+	    dm.bol = 1;
+	    pos = to;
+	    __atomic_store_n(&disp.pos, pos, __ATOMIC_RELEASE);
+	    paused = 0;
+	    src = out;
+	} else {
+	    /* A new mode starts on a new line, and a dump at 0 */
+	    if ((mode = __atomic_load_n(&disp.mode, __ATOMIC_ACQUIRE)) !=
+		    dm.mode) {
+		dm.mode = mode;
+		dm.bol = 1;
+		dm.off = 0;
+	    }
+	    off = pos & (rxpool_size - 1);
+	    n = rxpool_size - off;
+	    if (n > (head - pos)) {
+		n = head - pos;
+	    }
+	    if (n > sizeof(out)) {
+		n = sizeof(out);
+	    }
+	    if (n > (next - pos)) {
+		n = next - pos;		/* A note goes out there */
+	    }
+	    if (n > ((sizeof(fmt) - 128) / dm_grow[mode])) {
+		n = (sizeof(fmt) - 128) / dm_grow[mode];
+	    }
+	    hilite = (mode == DM_RAW) && (disp_errtail !=
+		__atomic_load_n(&disp_errhead, __ATOMIC_ACQUIRE));
+	    if (hilite && (n > (sizeof(fmt) / 10))) {
+		n = sizeof(fmt) / 10;	/* Each could be 10 bytes out */
+	    }
+	    memcpy(out, rxpool + off, n);
+	    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+	    if (__atomic_load_n(&rx_end, __ATOMIC_SEQ_CST) >
+		    (pos + rxpool_size)) {
+		continue;		/* Lapped as we copied */
+	    }
+	    pos += n;
+	    __atomic_store_n(&disp.pos, pos, __ATOMIC_RELEASE);
+	    src = out;
+	    if (mode != DM_RAW) {
+		n = dm_format(&dm, (unsigned char *)out, n, fmt);
+		src = fmt;
+	    } else if (hilite) {
+		n = disp_hilite(pos - n, out, n, fmt);
+		src = fmt;
+	    }
+	}
+	disp_out(ttyfd, src, n);
+	__atomic_store_n(&disp.done, pos, __ATOMIC_RELEASE);
+    }
+    /*NOTREACHED*/
+    return(NULL);
+}
+
+/*
+ * disp_sync()
+ *	Wait for the terminal to catch up
+ *
+ * Anything else we write to the terminal has to come after what
+ * the port said before it.  While the display's paused, there's
+ * nothing to wait for.
+ */
+static void
+disp_sync(void)
+{
+    if (!rxpool || disp.paused) {
+	return;
+    }
+    disp_kick();
+    pthread_mutex_lock(&disp_lock);
+    while ((__atomic_load_n(&disp.done, __ATOMIC_ACQUIRE) != rx_head) ||
+	    (__atomic_load_n(&disp_ntail, __ATOMIC_ACQUIRE) != disp_nhead)) {
+	pthread_cond_wait(&disp_drained, &disp_lock);
+    }
+    pthread_mutex_unlock(&disp_lock);
+}
+
+/*
+ * disp_say()
+ *	Write "buf" to "fd" (the terminal) after what the port's said
+ *
+ * With -D full=skip it's a note for the display thread, so a slow
+ * terminal still doesn't hold up the event loop; otherwise we wait
+ * for the terminal to catch up, and write it ourselves.
+ */
+static void
+disp_say(int fd, char *buf, int len)
+{
+    unsigned long long head = disp_nhead;
+    struct dnote *d;
+
+    if (!rxpool || !disp_skip || disp.paused) {
+	disp_sync();
+	write(fd, buf, len);
+	return;
+    }
+    if ((head - __atomic_load_n(&disp_ntail, __ATOMIC_ACQUIRE)) >=
+	    DISP_NOTES) {
+	return;
+    }
+    d = &disp_note[head % DISP_NOTES];
+    d->pos = rx_head;
+    d->fd = fd;
+    d->len = (len > DISP_NOTE) ? DISP_NOTE : len;
+    memcpy(d->text, buf, d->len);
+    __atomic_store_n(&disp_nhead, head + 1, __ATOMIC_SEQ_CST);
+    disp_kick();
+}
+
+/*
+ * disp_pause()
+ *	Stop showing what the port says ("on"), or start again
+ *
+ * Capture and everything else carry on as usual.
+ */
+static void
+disp_pause(int on)
+{
+    disp_sync();
+    pthread_mutex_lock(&disp_lock);
+    __atomic_store_n(&disp.paused, on, __ATOMIC_RELEASE);
+    pthread_cond_signal(&disp_more);
+    pthread_mutex_unlock(&disp_lock);
+}
+
+/*
+ * disp_mode()
+ *	Show the port from now on in "mode" (DM_*)
+ */
+static void
+disp_mode(int mode)
+{
+    char buf[64];
+
+    disp_sync();
+    __atomic_store_n(&disp.mode, mode, __ATOMIC_RELEASE);
+    snprintf(buf, sizeof(buf), "\r\n[display: %s]\r\n", dm_names[mode]);
+    write(ttyfd, buf, strlen(buf));
+}
+
+/* How much the terminal hasn't been shown */
+static unsigned long long
+disp_elided(void)
+{
+    return(__atomic_load_n(&disp.elided, __ATOMIC_RELAXED));
+}
+
+/*
+ * rx_room()
+ *	Where the next read from the attached port goes, and how much
+ *	of it there's room for (which may be none)
+ *
+ * Unless the terminal may be lapped, what it hasn't taken yet is
+ * left alone.
+ */
+static char *
+rx_room(int *room)
+{
+    size_t off = rx_head & (rxpool_size - 1), n = rxpool_size - off;
+    unsigned long long behind;
+
+    if (!disp_skip && !disp.paused) {
+	behind = rx_head - __atomic_load_n(&disp.pos, __ATOMIC_ACQUIRE);
+	if (behind >= rxpool_size) {
+	    n = 0;
+	} else if (n > (rxpool_size - behind)) {
+	    n = rxpool_size - behind;
+	}
+    }
+    *room = (n > rxsize) ? rxsize : n;
+    __atomic_store_n(&rx_end, rx_head + *room, __ATOMIC_SEQ_CST);
+    return(rxpool + off);
+}
+
+/* "len" more bytes at the pool's head are ready for everyone */
+static void
+rx_publish(int len)
+{
+    __atomic_store_n(&rx_head, rx_head + len, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * disp_kick()
+ *	Wake the display thread, if it's gone to sleep
+ *
+ * Once per batch of reads, not per read.
+ */
+static void
+disp_kick(void)
+{
+    if (rxpool && !disp.paused &&
+	    __atomic_load_n(&disp.idle, __ATOMIC_SEQ_CST)) {
+	pthread_mutex_lock(&disp_lock);
+	pthread_cond_signal(&disp_more);
+	pthread_mutex_unlock(&disp_lock);
+    }
+}
+
+/* The pool was full; see if the terminal has made room */
+static void
+rxpool_retry(struct evtimer *t)
+{
+    serial_arm(cur);
+}
+
+/*
+ * rx_start()
+ *	Set up the pool and start the display thread
+ *
+ * The pool is at least twice anything which gets written into it
+ * at once, or a client's "backlog", or how far behind the terminal
+ * may get, so nobody's place in it is written over while they still
+ * might use it.
+ */
+static void
+rx_start(int backlog)
+{
+    size_t want = RXPOOL / 2;
+    sigset_t all, old;
+
+    if (want < (size_t)rxsize) {
+	want = rxsize;
+    }
+    if (want < (size_t)backlog) {
+	want = backlog;
+    }
+    if (want < (size_t)(disp_queue + rxsize)) {
+	want = disp_queue + rxsize;
+    }
+    for (rxpool_size = RXPOOL; rxpool_size < (want * 2); rxpool_size *= 2)
+	;
+    if (posix_memalign((void **)&rxpool, 64, rxpool_size) != 0) {
+	fail("receive pool");
+    }
+    rxpool_timer.handler = rxpool_retry;
+    dm_tables();
+
+    /* Waiting awake only pays if it isn't keeping the reader off the CPU */
+    if (sysconf(_SC_NPROCESSORS_ONLN) > 1) {
+	disp.spin = DISP_SPIN;
+    }
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    if ((errno = pthread_create(&disp_thread, NULL, disp_writer, NULL))) {
+	fail("display thread");
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * rx_out()
+ *	Received data from "p", for the user, the network and the log
+ *
+ * The attached port's is in the pool, where serial_input() read it;
+ * a port the keyboard isn't attached to is only logged.
+ */
+static void
+rx_out(struct port *p, char *buf, int len)
+{
+    if ((p == cur) && rxpool) {
+	rx_publish(len);
+	net_put();
+	if (tap) {
+	    tap_put(CAP_RX, buf, len);
+	}
+    }
+    if (p->log) {
+	log_put(p->log, buf, len);
+    }
+}
+
+/*
+ * rx_pass()
+ *	rx_out(), by way of the triggers
+ *
+ * Should one start a transfer, what came after what it matched is
+ * the transfer's, as in serial_input(); anything it leaves over,
+ * having finished, is shown after all (moved up to where the pool
+ * got to).
+ */
+static void
+rx_pass(struct port *p, char *buf, int len)
+{
+    int pos, x;
+
+    if (!ntrigs || (p != cur)) {
+	rx_out(p, buf, len);
+	return;
+    }
+    if (((pos = trig_scan(p, buf, len)) < len) && xfer &&
+	    ((x = xfer_input((unsigned char *)buf + pos, len - pos)) > 0)) {
+	memmove(buf + pos, buf + (len - x), x);
+	rx_pass(p, buf + pos, x);
+    }
+}
+
+/*
+ * rx_show()
+ *	Received data from "p", once out of any frames it's in
+ */
+static void
+rx_show(struct port *p, char *buf, int len)
+{
+    if (p->fr && ((len = frame_decode(p, buf, len)) == 0)) {
+	return;
+    }
+    if (p->strip_hi) {
+	strip_high(buf, len);
+    }
+    rx_pass(p, buf, len);
+    if (p->job) {
+	batch_input(p, buf, len);
+    }
+}
+
+/*
+ * serial_input()
+ *	Data from a serial port; on to the user (and log, if -l)
+ */
+static void
+serial_input(struct evsrc *src, int revents)
+{
+    struct port *p = (struct port *)src;
+    int x, n, tries = 0;
+    char *buf;
+
+#ifdef HAVE_SPLICE
+    if (relay_fast && p->fast && (p == cur) && !xfer && !disp.paused &&
+	    (disp.mode == DM_RAW) && (splice_input(p) == 0)) {
+	return;
+    }
+#endif
+
+    /*
+     * A big read means there's probably more waiting; go around
+     * again (a few times) before pacing ourselves.
+     */
+    do {
+	buf = rxbuf;
+	n = rxsize;
+	if ((p == cur) && rxpool) {
+	    buf = rx_room(&n);
+	    if (n == 0) {
+		serial_arm(p);	/* The pool's full */
+		return;
+	    }
+	}
+	if ((x = read(src->fd, buf, n)) < 0) {
+	    if ((errno == EINTR) || (errno == EAGAIN)) {
+		return;
+	    }
+	    if (p->reconnect || p->job) {
+		port_lost(p);
+		return;
+	    }
+	    fail("serial read");
+	}
+	if (x == 0) {
+	    if (p->reconnect || p->job) {
+		port_lost(p);
+		return;
+	    }
+	    errno = EIO;
+	    fail("serial read");
+	}
+	if (p->parmrk && ((x = parmrk_decode(p, buf, x,
+		((p == cur) && rxpool && !xfer && !p->fr) ? rx_head : ~0ULL)) ==
+		0)) {
+	    continue;		/* It was all of a mark */
+	}
+	stats.rx += x;
+	stats.reads += 1;
+
+	/* A transfer in progress gets it all, 8 bits, no log */
+	if (xfer && (p == cur)) {
+	    if ((n = xfer_input((unsigned char *)buf, x)) > 0) {
+		memmove(buf, buf + (x - n), n);
+		rx_show(p, buf, n);
+	    }
+	    continue;
+	}
+	rx_show(p, buf, x);
+    } while ((x >= (TTYQ / 2)) && (++tries < 8));
+    disp_kick();
+    rx_pace(p, x);
+}
+
+#ifdef HAVE_URING
+/*
+ * io_uring reads (-E uring)
+ *
+ * A port the keyboard isn't attached to is only captured, so
+ * rather than ask whether it's readable and then read it, we leave
+ * a read of it in the ring; when it comes back, rx_pace() decides
+ * as usual how soon the next one goes in.  The attached port is
+ * read into the receive pool, or spliced, so it's polled as ever;
+ * attaching one stops its read, and it isn't polled until that
+ * read (and whatever it had) comes back.
+ */
+
+/* Hand read buffer "bid" (back) to the kernel */
+static void
+uring_give(int bid)
+{
+    struct io_uring_buf *b = &ur.br->bufs[ur.btail & (ur.nbuf - 1)];
+
+    b->addr = (unsigned long long)(uintptr_t)(ur.buf + bid * ur.bsize);
+    b->len = ur.bsize;
+    b->bid = bid;
+    __atomic_store_n(&ur.br->tail, ++ur.btail, __ATOMIC_RELEASE);
+}
+
+/*
+ * uring_read()
+ *	Make sure port "p" has a read out ("on"), or stop it
+ *
+ * Returns 1 while it does, so the port mustn't be polled for input
+ * too.
+ */
+static int
+uring_read(struct port *p, int on)
+{
+    struct io_uring_sqe *sqe;
+
+    if (!on) {
+	if (p->ureading && !p->ustop) {
+	    sqe = ur_sqe();
+	    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	    sqe->addr = (unsigned long long)(uintptr_t)p | UR_READ;
+	    sqe->user_data = UR_IGNORE;
+	    p->ustop = 1;
+	}
+    } else if (!p->ureading) {
+	sqe = ur_sqe();
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = p->src.fd;
+	sqe->off = -1;
+	sqe->len = ur.bsize;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = UR_BGID;
+	sqe->user_data = (unsigned long long)(uintptr_t)p | UR_READ;
+	p->ureading = 1;
+    }
+    return(p->ureading);
+}
+
+/*
+ * uring_input()
+ *	Port "p"'s read is back: "res" bytes, or an error
+ */
+static void
+uring_input(struct port *p, int res, unsigned flags)
+{
+    char *buf, *b;
+    int bid, n, len;
+
+    if (batch_name) {
+	port_switch(p);
+    }
+    p->ureading = p->ustop = 0;
+    if ((res > 0) && (flags & IORING_CQE_F_BUFFER)) {
+	bid = flags >> IORING_CQE_BUFFER_SHIFT;
+	buf = ur.buf + bid * ur.bsize;
+	if (p->parmrk) {
+	    res = parmrk_decode(p, buf, res, ~0ULL);
+	}
+	stats.rx += res;
+	stats.reads += 1;
+
+	/*
+	 * Should the port have been attached since, it goes into the
+	 * pool like any other read of the attached port.
+	 */
+	for (b = buf, len = res; len > 0; b += n, len -= n) {
+	    if (p != cur) {
+		rx_show(p, b, n = len);
+	    } else if (xfer) {
+		n = len - xfer_input((unsigned char *)b, len);
+	    } else if (!rxpool) {
+		rx_show(p, b, n = len);
+	    } else {
+		buf = rx_room(&n);
+		if (n == 0) {
+		    disp_sync();
+		    continue;
+		}
+		if (n > len) {
+		    n = len;
+		}
+		memcpy(buf, b, n);
+		rx_show(p, buf, n);
+		disp_kick();
+	    }
+	}
+	uring_give(bid);
+	if ((p != cur) || !rxpool) {
+	    rx_pace(p, res);
+	}
+    } else if ((res == 0) || ((res != -ENOBUFS) && (res != -ECANCELED) &&
+	    (res != -EINTR) && (res != -EAGAIN))) {
+	if (p->reconnect || p->job) {
+	    port_lost(p);	/* Or it already was */
+	    return;
+	}
+	errno = res ? -res : EIO;
+	fail("serial read");
+    }
+    serial_arm(p);
+}
+#endif
+
+/*
+ * serial_event()
+ *	Serial port is readable, writable, or both
+ */
+static void
+serial_event(struct evsrc *src, int revents)
+{
+    if (batch_name) {
+	port_switch((struct port *)src);
+    }
+    if (revents & EV_OUT) {
+	tx_flush();
+    }
+    if ((revents & (EV_IN|EV_ERR)) && !((struct port *)src)->lost) {
+	serial_input(src, revents);
+    }
+}
+
+/*
+ * Batch mode (-B)
+ *
+ * For a farm of boards with nobody watching: every port runs the
+ * same script, all at once, and we exit once they've all finished,
+ * with the worst (highest) of their statuses.  There's no terminal;
+ * what each board says goes to its capture (,l=), and how it's
+ * getting on is reported a line at a time on stdout, as "<tty>:
+ * <what>".  One command to a line, with words and "quoted" strings
+ * as in a -T file:
+ *
+ *	timeout 30		Waits from here on give up after 30 sec
+ *	fail "Kernel panic" 3	From here on, seeing it ends with 3
+ *	wait "Hit any key"	Until the board says it
+ *	send " "
+ *	wait "=> " 10
+ *	send "loady\r"
+ *	xfer y send u-boot.img	Transfer (x, y, z or txt; else -p's)
+ *	sleep 1
+ *	mark "flashed"		Note in the capture
+ *	wait "Starting kernel"
+ *	exit 0			As is running off the end
+ *
+ * A wait which times out, a transfer which fails and a port which
+ * goes away (without -a) all end that board's run with status 1.
+ * Transfers are those of ^Z r and ^Z s, which work on "the" port:
+ * its transmit queue and its xfer.  So whatever we're about to do
+ * for a port, port_switch() first makes it cur, swapping in what
+ * it had going; its events and timers (evtimer.port) see to that.
+ */
+#define BATCH_TAIL (256)	/* Longest pattern */
+#define BATCH_WAIT (60)		/* Default timeout, sec */
+
+#define BS_WAIT (0)		/* Commands */
+#define BS_SEND (1)
+#define BS_XFER (2)
+#define BS_SLEEP (3)
+#define BS_MARK (4)
+#define BS_EXIT (5)
+#define BS_FAIL (6)
+#define BS_TIMEOUT (7)
+
+struct bstep {
+    int op;			/* BS_* */
+    char *arg;			/* Pattern, text, file (or NULL) */
+    int arglen;
+    int num;			/* Seconds, status; xfer: 1 to send */
+    int proto;			/* xfer: PROTO_*, or -1 for -p's */
+    int line;			/* In the script, for messages */
+};
+static struct bstep *bsteps;
+static int nbsteps;
+
+struct job {
+    struct evtimer timer;	/* Must be first; the step's */
+    struct port *port;
+    int pc;			/* Step it's on */
+    int limit;			/* timeout, sec (0 for none) */
+    int status;			/* Once done, else -1 */
+    int go;			/* timer means carry on */
+    long long started;
+    struct xfer *xfer;		/* What it has going, while it */
+    char *txbuf;		/*  ...isn't cur */
+    int txoff, txlen;
+    char tail[BATCH_TAIL];	/* What it said last, for a pattern */
+    int taillen;		/*  ...across reads */
+};
+static int batch_left;		/* Runs not done yet */
+static void batch_run(struct job *);
+
+/* A line of the report */
+static void
+batch_say(struct port *p, char *what)
+{
+    char buf[512];
+    int n;
+
+    n = snprintf(buf, sizeof(buf), "%s: %s\n", p->tty, what);
+    if (n >= (int)sizeof(buf)) {
+	n = sizeof(buf) - 1;
+	buf[n - 1] = '\n';
+    }
+    write(1, buf, n);
+}
+
+/* A step's pattern, text or file name */
+static void
+batch_arg(struct bstep *s, char *word, int n)
+{
+    if ((s->arg = malloc(n + 1)) == NULL) {
+	perror(batch_name);
+	exit(1);
+    }
+    memcpy(s->arg, word, n);
+    s->arg[n] = '\0';
+    s->arglen = n;
+}
+
+/*
+ * batch_load()
+ *	Read the -B script ("-" for stdin)
+ */
+static void
+batch_load(void)
+{
+    static char *cmds[] = {"wait", "send", "xfer", "sleep", "mark",
+	"exit", "fail", "timeout", NULL};
+    static char *protos[] = {"x", "y", "z", "txt", NULL};
+    static int pcodes[] = {PROTO_RX, PROTO_RY, PROTO_RZ, PROTO_TXT};
+    char line[2048], word[2048], *p;
+    int lineno = 0, n, kind, x;
+    struct bstep *s;
+    FILE *fp;
+
+    if (!strcmp(batch_name, "-")) {
+	fp = stdin;
+    } else if ((fp = fopen(batch_name, "r")) == NULL) {
+	perror(batch_name);
+	exit(1);
+    }
+    while (fgets(line, sizeof(line), fp)) {
+	lineno += 1;
+	p = line;
+	if (trig_word(&p, word, &kind) == -1) {
+	    continue;
+	}
+	for (x = 0; cmds[x] && (kind || strcmp(word, cmds[x])); ++x)
+	    ;
+	if ((bsteps = realloc(bsteps, (nbsteps + 1) * sizeof(*bsteps))) ==
+		NULL) {
+	    perror(batch_name);
+	    exit(1);
+	}
+	s = &bsteps[nbsteps];
+	memset(s, 0, sizeof(*s));
+	s->op = x;
+	s->proto = -1;
+	s->line = lineno;
+	switch (x) {
+	case BS_WAIT:
+	case BS_FAIL:
+	    if (((n = trig_word(&p, word, &kind)) <= 0) || (kind != '"') ||
+		    (n > BATCH_TAIL)) {
+		goto bad;
+	    }
+	    batch_arg(s, word, n);
+	    s->num = (x == BS_FAIL) ? 1 : -1;
+	    if (trig_word(&p, word, &kind) > 0) {
+		s->num = atoi(word);
+	    }
+	    break;
+
+	case BS_SEND:
+	case BS_MARK:
+	    if ((n = trig_word(&p, word, &kind)) <= 0) {
+		goto bad;
+	    }
+	    batch_arg(s, word, n);
+	    break;
+
+	case BS_XFER:
+	    if (trig_word(&p, word, &kind) <= 0) {
+		goto bad;
+	    }
+	    for (n = 0; protos[n] && strcmp(word, protos[n]); ++n)
+		;
+	    if (protos[n]) {
+		s->proto = pcodes[n];
+		if (trig_word(&p, word, &kind) <= 0) {
+		    goto bad;
+		}
+	    }
+	    if (!strcmp(word, "send")) {
+		s->num = 1;
+	    } else if (strcmp(word, "receive")) {
+		goto bad;
+	    }
+	    if ((n = trig_word(&p, word, &kind)) > 0) {
+		batch_arg(s, word, n);
+	    } else if (s->num) {
+		goto bad;		/* Send what? */
+	    }
+	    break;
+
+	case BS_SLEEP:
+	case BS_EXIT:
+	case BS_TIMEOUT:
+	    if (trig_word(&p, word, &kind) <= 0) {
+		goto bad;
+	    }
+	    s->num = atoi(word);
+	    break;
+
+	default:
+	    goto bad;
+	}
+	if (trig_word(&p, word, &kind) != -1) {
+	    goto bad;
+	}
+	nbsteps += 1;
+	continue;
+bad:
+	fprintf(stderr, "%s:%d: bad command\n", batch_name, lineno);
+	exit(1);
+    }
+    if (fp != stdin) {
+	fclose(fp);
+    }
+}
+
+/*
+ * port_switch()
+ *	Make "p" the current port, for batch mode
+ */
+static void
+port_switch(struct port *p)
+{
+    struct job *j;
+
+    if ((p == cur) || !p->job) {
+	return;
+    }
+    j = cur->job;
+    j->xfer = xfer;
+    j->txbuf = txbuf;
+    j->txoff = txoff;
+    j->txlen = txlen;
+    j = p->job;
+    xfer = j->xfer;
+    txbuf = j->txbuf;
+    txoff = j->txoff;
+    txlen = j->txlen;
+    cur = p;
+    rs232 = p->src.fd;
+}
+
+/* Has port "p" (not cur) anything waiting to go out? */
+static int
+batch_queued(struct port *p)
+{
+    return(p->job->txoff < p->job->txlen);
+}
+
+/*
+ * batch_end()
+ *	Run "j" is over, with "status"
+ */
+static void
+batch_end(struct job *j, int status)
+{
+    char buf[80];
+    long long t;
+    int x;
+
+    if (!j || (j->status >= 0)) {
+	return;
+    }
+    t = ev_now() - j->started;
+    j->status = status;
+    ev_untimer(&j->timer);
+    snprintf(buf, sizeof(buf), "finished, status %d (%lld.%03d sec)",
+	status, t / 1000000, (int)((t / 1000) % 1000));
+    batch_say(j->port, buf);
+    if (--batch_left > 0) {
+	return;
+    }
+
+    /* That was the last; the worst of them is ours */
+    for (x = 0; x < nports; ++x) {
+	if (ports[x].job->status > exit_code) {
+	    exit_code = ports[x].job->status;
+	}
+    }
+    quitsig = SIGTERM;
+}
+
+/* Step "s" didn't work out */
+static void
+batch_fail(struct job *j, struct bstep *s, char *why, int status)
+{
+    char buf[512];
+
+    snprintf(buf, sizeof(buf), "line %d: %s%s%s%s", s->line, why,
+	s->arg ? " \"" : "", s->arg ? s->arg : "", s->arg ? "\"" : "");
+    batch_say(j->port, buf);
+    batch_end(j, status);
+}
+
+/*
+ * batch_find()
+ *	Is "pat" in what's been said (the tail, then buf[0..n))?  If
+ *	so, returns how far into buf it ends; else -1
+ *
+ * The tail is what came since the last wait was satisfied, so a
+ * match found wholly within it counts just the same, ending at 0;
+ * a wait is met by what the board said while we were busy sending.
+ */
+static int
+batch_find(struct job *j, char *pat, int plen, char *buf, int n)
+{
+    char both[BATCH_TAIL * 2], *hit;
+    int k = (n < (plen - 1)) ? n : (plen - 1), end;
+
+    if (j->taillen) {
+	memcpy(both, j->tail, j->taillen);
+	memcpy(both + j->taillen, buf, k);
+	if ((hit = memmem(both, j->taillen + k, pat, plen)) != NULL) {
+	    end = (hit - both) + plen - j->taillen;
+	    return((end > 0) ? end : 0);
+	}
+    }
+    if ((hit = memmem(buf, n, pat, plen)) != NULL) {
+	return((hit - buf) + plen);
+    }
+    return(-1);
+}
+
+/*
+ * batch_input()
+ *	Port "p" said "buf"; is it what its run is waiting for?
+ */
+static void
+batch_input(struct port *p, char *buf, int len)
+{
+    struct job *j = p->job;
+    struct bstep *s;
+    int pos = 0, x, end;
+
+    while ((j->status < 0) && (pos < len)) {
+	for (x = 0; x < j->pc; ++x) {
+	    s = &bsteps[x];
+	    if ((s->op == BS_FAIL) &&
+		    (batch_find(j, s->arg, s->arglen, buf + pos, len - pos) >= 0)) {
+		batch_fail(j, s, "saw", s->num);
+		return;
+	    }
+	}
+	s = &bsteps[j->pc];
+	if ((j->pc == nbsteps) || (s->op != BS_WAIT) || xfer ||
+		((end = batch_find(j, s->arg, s->arglen, buf + pos,
+		len - pos)) < 0)) {
+	    break;
+	}
+
+	/* Found; what comes after it is for what comes next */
+	pos += end;
+	j->taillen = 0;
+	j->pc += 1;
+	batch_run(j);
+	if (xfer) {
+	    if ((x = xfer_input((unsigned char *)buf + pos, len - pos)) > 0) {
+		batch_input(p, buf + (len - x), x);
+	    }
+	    return;
+	}
+    }
+
+    /* Keep the end of it, for a pattern which goes on in the next */
+    if ((len - pos) >= (BATCH_TAIL - 1)) {
+	j->taillen = BATCH_TAIL - 1;
+	memcpy(j->tail, buf + len - j->taillen, j->taillen);
+    } else if (len > pos) {
+	if ((j->taillen + (len - pos)) > (BATCH_TAIL - 1)) {
+	    x = j->taillen + (len - pos) - (BATCH_TAIL - 1);
+	    memmove(j->tail, j->tail + x, j->taillen - x);
+	    j->taillen -= x;
+	}
+	memcpy(j->tail + j->taillen, buf + pos, len - pos);
+	j->taillen += len - pos;
+    }
+}
+
+/*
+ * batch_run()
+ *	Carry on with "j"'s script, as far as the next thing to wait for
+ */
+static void
+batch_run(struct job *j)
+{
+    struct bstep *s;
+    int limit;
+
+    port_switch(j->port);
+    while (j->status < 0) {
+	if (j->pc == nbsteps) {
+	    batch_end(j, 0);
+	    return;
+	}
+	s = &bsteps[j->pc];
+	switch (s->op) {
+	case BS_WAIT:
+	    if (batch_find(j, s->arg, s->arglen, "", 0) >= 0) {
+		j->taillen = 0;		/* Said already */
+		break;
+	    }
+	    limit = (s->num >= 0) ? s->num : j->limit;
+	    if (limit > 0) {
+		ev_timer(&j->timer, limit * 1000000LL);
+	    }
+	    return;
+
+	case BS_SLEEP:
+	    ev_timer(&j->timer, s->num * 1000000LL);
+	    return;
+
+	case BS_SEND:
+	    if (j->port->lost) {
+		break;		/* Much as if typed */
+	    }
+	    tx_put(s->arg, s->arglen);
+	    break;
+
+	case BS_XFER:
+	    if (s->proto >= 0) {
+		proto = s->proto;
+	    }
+	    if (!s->arg && (proto == PROTO_RX)) {
+		batch_fail(j, s, "XMODEM needs a file name to receive into", 1);
+		return;
+	    }
+	    xfer_start(s->num, s->arg);
+	    if (!xfer) {
+		setup_serial(j->port);
+		batch_fail(j, s, "couldn't start the transfer", 1);
+	    }
+	    return;		/* batch_xfer() will carry on */
+
+	case BS_MARK:
+	    if (j->port->log) {
+		log_mark(j->port->log, s->arg);
+	    }
+	    break;
+
+	case BS_EXIT:
+	    batch_end(j, s->num);
+	    return;
+
+	case BS_TIMEOUT:
+	    j->limit = s->num;
+	    break;
+	}
+	j->pc += 1;
+    }
+}
+
+/* A wait has run out, a sleep is over, or it's time to carry on */
+static void
+batch_tick(struct evtimer *t)
+{
+    struct job *j = (struct job *)t;
+    struct bstep *s = &bsteps[j->pc];
+
+    if (j->go) {
+	j->go = 0;
+    } else if (s->op == BS_WAIT) {
+	batch_fail(j, s, "timed out waiting for", 1);
+	return;
+    } else {
+	j->pc += 1;
+    }
+    batch_run(j);
+}
+
+/*
+ * batch_xfer()
+ *	The current port's transfer is over; "ok", or "msg" says why not
+ *
+ * The next step isn't taken from in here, but once we're back in
+ * the event loop; the protocol may not be quite done with its
+ * stack yet.
+ */
+static void
+batch_xfer(int ok, char *msg)
+{
+    struct job *j = cur->job;
+    struct bstep *s = &bsteps[j->pc];
+    char buf[256];
+
+    snprintf(buf, sizeof(buf), "%s%s%s: %s", s->num ? "sent" : "received",
+	s->arg ? " " : "", s->arg ? s->arg : "", msg);
+    batch_say(j->port, buf);
+    if (!ok) {
+	batch_end(j, 1);
+	return;
+    }
+    j->pc += 1;
+    j->go = 1;
+    ev_timer(&j->timer, 0);
+}
+
+/*
+ * batch_start()
+ *	Start every port on the script
+ */
+static void
+batch_start(void)
+{
+    struct job *j;
+    int x;
+
+    for (x = 0; x < nports; ++x) {
+	if ((j = calloc(1, sizeof(struct job))) == NULL) {
+	    fail("batch");
+	}
+	j->port = &ports[x];
+	j->status = -1;
+	j->limit = BATCH_WAIT;
+	j->started = ev_now();
+	j->timer.handler = batch_tick;
+	j->timer.port = j->port;
+	if (x == 0) {
+	    j->txbuf = txbuf0;
+	} else if ((j->txbuf = malloc(TXSIZE)) == NULL) {
+	    fail("batch");
+	}
+	ports[x].job = j;
+    }
+    batch_left = nports;
+    for (x = 0; x < nports; ++x) {
+	batch_run(ports[x].job);
+    }
+}
+
+/*
+ * Reconnecting (-a, ,reconnect)
+ *
+ * A USB serial adapter goes away when the board it's on resets,
+ * and its tty with it.  Rather than give up, a port marked to
+ * reconnect is closed ("lost") and we wait for its device node to
+ * come back.  inotify on the directory it's in (and the one the
+ * real node is in, for a /dev/serial/by-id link) says when
+ * something appears there, and we open it again right away, so
+ * as little as possible of what a board says as it comes up is
+ * missed.  A slow timer is only a backstop, for what inotify can't
+ * see (a directory which went away too, say).  Capture, counters,
+ * display and network clients carry on as the same session, with
+ * a marker each way.  What's typed while it's gone is dropped.
+ */
+#define LOST_RETRY (1000000LL)	/* Backstop, usec */
+
+static int lost_fd = -1;	/* inotify */
+static struct evsrc lost_src;
+static struct evtimer lost_timer;
+static int nlost;
+
+/* Point stdin and stdout (for external programs) at the port */
+static void
+port_stdio(struct port *p)
+{
+    int fd;
+
+    if (batch_name) {
+	return;			/* Those are the report, and nothing */
+    } else if (p->src.fd >= 0) {
+	dup2(p->src.fd, 0);
+	dup2(p->src.fd, 1);
+    } else if ((fd = open("/dev/null", O_RDWR)) >= 0) {
+	dup2(fd, 0);		/* Don't hold on to the old device */
+	dup2(fd, 1);
+	close(fd);
+    }
+}
+
+/* Tell the screen (if it's showing "p"), capture and tap */
+static void
+port_note(struct port *p, char *what)
+{
+    char buf[160], line[168];
+
+    snprintf(buf, sizeof(buf), "port %d (%s) %s", p->num, p->tty, what);
+    if (p->log) {
+	log_mark(p->log, buf);
+    }
+    if (batch_name) {
+	batch_say(p, what);
+    } else if (p == cur) {
+	if (tap) {
+	    tap_put(CAP_MARK, buf, strlen(buf));
+	}
+	snprintf(line, sizeof(line), "\r\n[%s]\r\n", buf);
+	disp_say(ttyfd, line, strlen(line));
+    }
+}
+
+/* Watch where port "p"'s node will show up again */
+static void
+lost_watch(struct port *p, int all)
+{
+#ifdef __linux__
+    char *path, *real;
+
+    if (lost_fd < 0) {
+	return;
+    }
+    if ((path = strdup(p->tty)) != NULL) {
+	(void)inotify_add_watch(lost_fd, dirname(path),
+	    IN_CREATE|IN_ATTRIB|IN_MOVED_TO);
+	free(path);
+    }
+    if (all && ((real = realpath(p->tty, NULL)) != NULL)) {
+	(void)inotify_add_watch(lost_fd, dirname(real),
+	    IN_CREATE|IN_ATTRIB|IN_MOVED_TO);
+	free(real);
+    }
+#endif
+}
+
+/*
+ * port_lost()
+ *	Port "p" has gone away; close it, and wait for it to come back
+ */
+static void
+port_lost(struct port *p)
+{
+    if (p->lost) {
+	return;
+    }
+    p->lost = ev_now();
+    if (batch_name) {
+	port_switch(p);
+    }
+    if (xfer && (p == cur)) {
+	xfer_finish("port lost");
+    }
+    ev_untimer(&p->rx_timer);
+    p->rxheld = 0;
+    ev_del(&p->src);
+    close(p->src.fd);
+    p->src.fd = -1;
+    p->oldflags = p->oldtimer = -1;	/* Those went with it */
+    if (p == cur) {
+	rs232 = -1;
+	port_stdio(p);
+    }
+    port_note(p, "lost");
+    if (!p->reconnect) {
+	batch_end(p->job, 1);	/* Only -B gets here */
+	return;
+    }
+    nlost += 1;
+    ev_timer(&lost_timer, LOST_RETRY);
+}
+
+/*
+ * port_reopen()
+ *	Try to get lost port "p" back; returns 1 if it is
+ */
+static int
+port_reopen(struct port *p)
+{
+    char what[64];
+    long long gone = ev_now() - p->lost;
+
+    if ((p->src.fd = open(p->tty, O_RDWR|O_EXCL|O_NDELAY|O_NOCTTY)) < 0) {
+	return(0);
+    }
+    setup_serial(p);
+    p->lost = 0;
+    if (p->fr) {
+	p->fr->state = FS_TEXT;	/* Whatever it was in the middle of */
+    }
+    serial_lowlat(p, 1);
+#ifdef TIOCGICOUNT
+    (void)ioctl(p->src.fd, TIOCGICOUNT, &p->icount0);
+#endif
+    ev_add(&p->src);
+    serial_arm(p);
+    if (p == cur) {
+	rs232 = p->src.fd;
+	port_stdio(p);
+	kbd_arm();
+    }
+    nlost -= 1;
+    snprintf(what, sizeof(what), "back after %lld.%03d sec",
+	gone / 1000000, (int)((gone / 1000) % 1000));
+    port_note(p, what);
+    return(1);
+}
+
+/* Something may have come back; try every lost port */
+static void
+lost_retry(void)
+{
+    int x;
+
+    for (x = 0; x < nports; ++x) {
+	if (ports[x].lost) {
+	    lost_watch(&ports[x], 0);	/* Its directory may be new */
+	    (void)port_reopen(&ports[x]);
+	}
+    }
+    if (nlost) {
+	ev_timer(&lost_timer, LOST_RETRY);
+    } else {
+	ev_untimer(&lost_timer);
+    }
+}
+
+static void
+lost_tick(struct evtimer *t)
+{
+    lost_retry();
+}
+
+/* inotify says something changed where a port lives */
+static void
+lost_event(struct evsrc *src, int revents)
+{
+    char buf[4096];
+
+    while (read(src->fd, buf, sizeof(buf)) > 0) {
+	;
+    }
+    if (nlost) {
+	lost_retry();
+    }
+}
+
+/* Get ready to wait out any port with -a or ,reconnect */
+static void
+lost_start(void)
+{
+    int x;
+
+    lost_timer.handler = lost_tick;
+    for (x = 0; x < nports; ++x) {
+	if (!ports[x].reconnect) {
+	    continue;
+	}
+#ifdef __linux__
+	if ((lost_fd < 0) &&
+		((lost_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC)) >= 0)) {
+	    lost_src.fd = lost_fd;
+	    lost_src.events = EV_IN;
+	    lost_src.handler = lost_event;
+	    ev_add(&lost_src);
+	}
+#endif
+	lost_watch(&ports[x], 1);
+    }
+}
+
+/*
+ * kbd_input()
+ *	Keystrokes from the user; on to the serial port
+ *
+ * A whole block is translated into the transmit queue in one pass
+ * and handed to the port with a single write.
+ */
+static void
+kbd_input(struct evsrc *src, int revents)
+{
+    int x, room;
+    char c, *d, kmask = cur->strip_hi ? 0x7F : 0xFF;
+
+    room = paste_mode ? PASTESIZE : KBDSIZE;
+    if (room > (TXSIZE - txlen)) {
+	room = TXSIZE - txlen;
+    }
+    if ((x = read(src->fd, kbuf, room)) < 0) {
+	if ((errno == EINTR) || (errno == EAGAIN)) {
+	    return;
+	}
+	fail("keyboard read");
+    }
+    if (x == 0) {
+	done();
+    }
+    kbpos = 0;
+    kblen = x;
+    while (xfer && (kbpos < kblen)) {
+	xfer_key(kbuf[kbpos++] & 0xFF);
+    }
+    while (kbpos < kblen) {
+	d = txbuf + txlen;
+	while (kbpos < kblen) {
+	    c = kbuf[kbpos] & kmask;
+
+	    /*
+	     * PROTO_CHAR (usually Control-Z) starts file transfers.
+	     * What came before it goes out first; anything the
+	     * far end sends while a transfer starts up is left in
+	     * the port for the transfer to see.
+	     */
+	    if (c == PROTO_CHAR) {
+		break;
+	    }
+	    if (!raw_kbd && (c == '\n')) {
+		c = '\r';
+	    }
+	    *d++ = c;
+	    kbpos += 1;
+	}
+	txlen = d - txbuf;
+	if (kbpos < kblen) {
+	    kbpos += 1;
+	    tx_flush();
+	    proto_xfer(ttyfd, rs232);
+	}
+
+	/* That may have started a transfer, which takes the rest */
+	while (xfer && (kbpos < kblen)) {
+	    xfer_key(kbuf[kbpos++] & 0xFF);
+	}
+    }
+    tx_flush();
+}
+
+/*
+ * Network server (-N)
+ *
+ * The attached port is offered over TCP, raw or as Telnet with the
+ * COM-PORT-OPTION (RFC 2217) so the remote end can set its speed
+ * and format.  The first client in may type at the port; anyone
+ * after that just watches.  What the port says is written to every
+ * client without blocking, straight from the receive pool; each
+ * client has its own place there, and one which gets more than its
+ * backlog behind is dropped, so a slow client never holds up the
+ * serial port.  Only our Telnet replies are queued per client.
+ */
+#define NETQ (256*1024)		/* Default per-client backlog */
+#define NETREAD (4096)		/* Most we take from a client at once */
+#define NETCTL (4096)		/* Room for Telnet replies, per client */
+
+#define TN_SE (240)		/* Telnet commands... */
+#define TN_SB (250)
+#define TN_WILL (251)
+#define TN_WONT (252)
+#define TN_DO (253)
+#define TN_DONT (254)
+#define TN_IAC (255)
+#define TN_BINARY (0)		/*  ...and the options we'll do */
+#define TN_ECHO (1)
+#define TN_SGA (3)
+#define TN_COMPORT (44)
+
+#define CPO_SIGNATURE (0)	/* COM-PORT-OPTION client requests */
+#define CPO_BAUDRATE (1)
+#define CPO_DATASIZE (2)
+#define CPO_PARITY (3)
+#define CPO_STOPSIZE (4)
+#define CPO_CONTROL (5)
+#define CPO_LINEMASK (10)
+#define CPO_MODEMMASK (11)
+#define CPO_PURGE (12)
+#define CPO_REPLY (100)		/* Added to the request, in answers */
+
+struct client {
+    struct evsrc src;		/* Must be first */
+    struct client *next;
+    int writer;			/* May send to the port */
+    unsigned long long pos;	/* Sent up to here in the pool */
+    int iac;			/*  ...but for doubling the IAC there */
+    char *q;			/* Our replies, q[qoff..qlen) */
+    int qoff, qlen;
+    int tn;			/* Telnet parser state, or 0 for data */
+    unsigned char cmd;		/*  ...the WILL/DO/... being parsed */
+    unsigned char sb[64];	/*  ...subnegotiation so far */
+    int sblen;
+    unsigned char him[256], us[256];	/* Option states, TN_Q* */
+};
+#define TN_QNO (0)		/* Option off */
+#define TN_QYES (1)		/*  ...on */
+#define TN_QWANT (2)		/*  ...we've asked for it */
+
+#define TS_IAC (1)		/* Telnet parser: just had IAC */
+#define TS_OPT (2)		/*  ...WILL/WONT/DO/DONT, want option */
+#define TS_SB (3)		/*  ...in a subnegotiation */
+#define TS_SBIAC (4)		/*  ...IAC in one */
+#define TS_CR (5)		/*  ...CR, which may be followed by NUL */
+
+static int net_telnet;		/* Speak RFC 2217 */
+static int net_qsize = NETQ;
+static struct evsrc net_src;	/* Listening socket */
+static struct client *clients, *net_dead;
+
+static void net_reap(struct evtimer *);
+static struct evtimer net_reap_timer = {0, net_reap};
+
+/*
+ * net_options()
+ *	Parse -N [<host>:]<port>[,rfc2217][,queue=<size>]
+ */
+static void
+net_options(char *opts)
+{
+    static char *tokens[] = {"rfc2217", "telnet", "queue", NULL};
+    char *val;
+    long long size;
+
+    net_addr = opts;
+    if ((opts = strchr(opts, ',')) == NULL) {
+	return;
+    }
+    *opts++ = '\0';
+    while (*opts) {
+	switch (getsubopt(&opts, tokens, &val)) {
+	case 0:
+	case 1:
+	    net_telnet = 1;
+	    break;
+
+	case 2:
+	    if (!val || ((size = getsize(val, NULL)) < NETREAD) ||
+		    (size > (1 << 30))) {
+		fprintf(stderr, "Illegal client queue size\n");
+		usage();
+	    }
+	    net_qsize = size;
+	    break;
+
+	default:
+	    fprintf(stderr, "Illegal network option: %s\n", val);
+	    usage();
+	}
+    }
+}
+
+/*
+ * net_msg()
+ *	Tell the local user what the network side is up to
+ */
+static void
+net_msg(char *msg)
+{
+    char buf[160];
+
+    snprintf(buf, sizeof(buf), "[net: %s]\r\n", msg);
+    disp_say(ttyfd, buf, strlen(buf));
+}
+
+/*
+ * net_drop()
+ *	Hang up on a client
+ *
+ * It can't be freed yet, as the event loop may still have an event
+ * for it in hand; net_reap() does that once ev_poll() is done.
+ */
+static void
+net_drop(struct client *c, char *why)
+{
+    struct client **cp;
+
+    for (cp = &clients; *cp != c; cp = &(*cp)->next) {
+	;
+    }
+    *cp = c->next;
+    ev_del(&c->src);
+    close(c->src.fd);
+    net_msg(why);
+    if (c->writer && clients) {
+	clients->writer = 1;	/* Longest watching gets the keyboard */
+	net_arm();
+    }
+    c->next = net_dead;
+    net_dead = c;
+    ev_timer(&net_reap_timer, 0);
+}
+
+/* Free the clients net_drop() has finished with */
+static void
+net_reap(struct evtimer *t)
+{
+    struct client *c;
+
+    while ((c = net_dead) != NULL) {
+	net_dead = c->next;
+	free(c->q);
+	free(c);
+    }
+}
+
+/*
+ * net_flush()
+ *	Write a client what it's owed, as far as it'll go without
+ *	blocking: our replies first, then the pool from c->pos on
+ *
+ * Telnet wants IAC doubled, so there each write from the pool stops
+ * just after an IAC, and c->iac says the second one is still owed.
+ * Returns -1 (after dropping it) if the client has gone.
+ */
+static int
+net_flush(struct client *c)
+{
+    static char iac = (char)TN_IAC;
+    char *p, *e;
+    size_t off, n;
+    ssize_t x;
+
+    for (;;) {
+	if (c->iac) {
+	    p = &iac;
+	    n = 1;
+	} else if (c->qoff < c->qlen) {
+	    p = c->q + c->qoff;
+	    n = c->qlen - c->qoff;
+	} else if (c->pos < rx_head) {
+	    off = c->pos & (rxpool_size - 1);
+	    p = rxpool + off;
+	    n = rxpool_size - off;
+	    if (n > (rx_head - c->pos)) {
+		n = rx_head - c->pos;
+	    }
+	    if (net_telnet && ((e = memchr(p, TN_IAC, n)) != NULL)) {
+		n = (e - p) + 1;
+	    }
+	} else {
+	    ev_set(&c->src, c->src.events & ~EV_OUT);
+	    return(0);
+	}
+	if ((x = write(c->src.fd, p, n)) < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    if (errno != EAGAIN) {
+		net_drop(c, "client gone");
+		return(-1);
+	    }
+	    break;
+	}
+	if (c->iac) {
+	    c->iac = 0;
+	} else if (c->qoff < c->qlen) {
+	    if ((c->qoff += x) == c->qlen) {
+		c->qoff = c->qlen = 0;
+	    }
+	} else {
+	    c->pos += x;
+	    c->iac = net_telnet && (x == n) && (p[n - 1] == (char)TN_IAC);
+	}
+	if (x < n) {
+	    break;
+	}
+    }
+    ev_set(&c->src, c->src.events | EV_OUT);
+    return(0);
+}
+
+/*
+ * net_send()
+ *	Queue a Telnet reply for a client, and send what we can
+ *
+ * Returns -1 (after dropping it) if the client is too far behind.
+ */
+static int
+net_send(struct client *c, char *buf, int len)
+{
+    if (!c->q && ((c->q = malloc(NETCTL)) == NULL)) {
+	net_drop(c, "client dropped, out of memory");
+	return(-1);
+    }
+    if ((c->qlen + len) > NETCTL) {
+	if ((c->qlen - c->qoff + len) > NETCTL) {
+	    net_drop(c, "client dropped, too far behind");
+	    return(-1);
+	}
+	memmove(c->q, c->q + c->qoff, c->qlen - c->qoff);
+	c->qlen -= c->qoff;
+	c->qoff = 0;
+    }
+    memcpy(c->q + c->qlen, buf, len);
+    c->qlen += len;
+    return(net_flush(c));
+}
+
+/*
+ * net_put()
+ *	There's more in the pool, for every client
+ */
+static void
+net_put(void)
+{
+    struct client *c, *next;
+
+    for (c = clients; c; c = next) {
+	next = c->next;
+	if ((rx_head - c->pos) > net_qsize) {
+	    net_drop(c, "client dropped, too far behind");
+	} else {
+	    (void)net_flush(c);
+	}
+    }
+}
+
+/*
+ * net_arm()
+ *	Only listen to the writer while there's room to queue its data
+ *
+ * Watchers are always heard, if only to see them hang up.
+ */
+static void
+net_arm(void)
+{
+    struct client *c;
+    int in;
+
+    for (c = clients; c; c = c->next) {
+	in = !c->writer || (!xfer && ((TXSIZE - txlen) >= NETREAD));
+	ev_set(&c->src, (in ? EV_IN : 0) | ((c->iac ||
+	    (c->qoff < c->qlen) || (c->pos < rx_head)) ? EV_OUT : 0));
+    }
+}
+
+/* Send a Telnet command, and maybe an option, to a client */
+static void
+tn_cmd(struct client *c, int cmd, int opt)
+{
+    char buf[3];
+
+    buf[0] = TN_IAC;
+    buf[1] = cmd;
+    buf[2] = opt;
+    (void)net_send(c, buf, (cmd >= TN_WILL) ? 3 : 2);
+}
+
+/*
+ * tn_option()
+ *	Handle WILL/WONT/DO/DONT "opt" from the client
+ *
+ * BINARY, SGA and COM-PORT-OPTION we'll do in either direction,
+ * ECHO only ourselves (the far end does the echoing); everything
+ * else is refused.  Answers to our own requests aren't answered,
+ * which is all it takes to keep the two ends from looping.
+ */
+static void
+tn_option(struct client *c, int cmd, int opt)
+{
+    int ok, mine = ((cmd == TN_DO) || (cmd == TN_DONT));
+    unsigned char *st = mine ? &c->us[opt] : &c->him[opt];
+
+    ok = (opt == TN_BINARY) || (opt == TN_SGA) ||
+	((opt == TN_COMPORT) && net_telnet) || (mine && (opt == TN_ECHO));
+    if ((cmd == TN_WILL) || (cmd == TN_DO)) {
+	if (*st == TN_QWANT) {
+	    *st = TN_QYES;
+	} else if (*st == TN_QNO) {
+	    if (ok) {
+		*st = TN_QYES;
+	    }
+	    tn_cmd(c, mine ? (ok ? TN_WILL : TN_WONT) :
+		(ok ? TN_DO : TN_DONT), opt);
+	}
+    } else if (*st != TN_QNO) {
+	if (*st == TN_QYES) {
+	    tn_cmd(c, mine ? TN_WONT : TN_DONT, opt);
+	}
+	*st = TN_QNO;
+    }
+}
+
+/* Answer a COM-PORT-OPTION request with "len" bytes of "val" */
+static void
+cpo_reply(struct client *c, int cmd, unsigned char *val, int len)
+{
+    unsigned char buf[2 * 64 + 8];
+    int x, n = 0;
+
+    buf[n++] = TN_IAC;
+    buf[n++] = TN_SB;
+    buf[n++] = TN_COMPORT;
+    buf[n++] = cmd + CPO_REPLY;
+    for (x = 0; x < len; ++x) {
+	if ((buf[n++] = val[x]) == TN_IAC) {
+	    buf[n++] = TN_IAC;
+	}
+    }
+    buf[n++] = TN_IAC;
+    buf[n++] = TN_SE;
+    (void)net_send(c, (char *)buf, n);
+}
+
+/*
+ * cpo_request()
+ *	A COM-PORT-OPTION subnegotiation from the client
+ *
+ * Settings go into the attached port and through setup_serial(),
+ * as if they'd been on the command line; the answer is always what
+ * the port ended up with.  Requests from watchers are only queries.
+ * setup_serial() can only do one stop bit, the same flow control
+ * both ways and no mark or space parity, and a speed it can't set
+ * would be fatal, so only those in the speeds table are taken.
+ */
+static void
+cpo_request(struct client *c, unsigned char *sb, int len)
+{
+    struct port *p = cur;
+    unsigned char val[4];
+    unsigned long rate;
+    int cmd = sb[0], arg = (len > 1) ? sb[1] : 0, change = 0, bits;
+    static char sig[] = "term";
+    struct termios t;
+
+    if (len < 1) {
+	return;
+    }
+    switch (cmd) {
+    case CPO_SIGNATURE:
+	cpo_reply(c, cmd, (unsigned char *)sig, sizeof(sig)-1);
+	return;
+
+    case CPO_BAUDRATE:
+	if (len < 5) {
+	    return;
+	}
+	rate = ((unsigned long)sb[1] << 24) | (sb[2] << 16) |
+	    (sb[3] << 8) | sb[4];
+	if (c->writer && rate && (speed_code((long)rate) >= 0) &&
+		(rate != p->speed)) {
+	    p->speed = rate;
+	    change = 1;
+	}
+	rate = p->speed;
+	val[0] = rate >> 24;
+	val[1] = rate >> 16;
+	val[2] = rate >> 8;
+	val[3] = rate;
+	break;
+
+    case CPO_DATASIZE:
+	if (c->writer && ((arg == 7) || (arg == 8)) &&
+		(p->seven_bits != (arg == 7))) {
+	    p->seven_bits = (arg == 7);
+	    change = 1;
+	}
+	val[0] = p->seven_bits ? 7 : 8;
+	break;
+
+    case CPO_PARITY:
+	if (c->writer && (arg >= 1) && (arg <= 3) &&
+		((p->parodd != (arg == 2)) || (p->pareven != (arg == 3)))) {
+	    p->parodd = (arg == 2);
+	    p->pareven = (arg == 3);
+	    setup_serial(p);
+
+	    /* Answer with what the line took, not what was asked */
+	    if (tcgetattr(p->src.fd, &t) == 0) {
+		p->parodd = (t.c_cflag & PARENB) && (t.c_cflag & PARODD);
+		p->pareven = (t.c_cflag & PARENB) && !(t.c_cflag & PARODD);
+	    }
+	}
+	val[0] = p->parodd ? 2 : (p->pareven ? 3 : 1);
+	break;
+
+    case CPO_STOPSIZE:
+	val[0] = 1;
+	break;
+
+    case CPO_CONTROL:
+	val[0] = arg;
+	if ((arg >= 4) && (arg <= 6)) {		/* BREAK */
+	    if (c->writer && (arg > 4)) {
+		(void)ioctl(p->src.fd, (arg == 5) ? TIOCSBRK : TIOCCBRK);
+	    }
+	    val[0] = (arg == 4) ? 6 : arg;
+	} else if ((arg >= 7) && (arg <= 12)) {	/* DTR, RTS */
+	    bits = (arg <= 9) ? TIOCM_DTR : TIOCM_RTS;
+	    if (c->writer && ((arg % 3) != 1)) {
+		(void)ioctl(p->src.fd,
+		    ((arg % 3) == 2) ? TIOCMBIS : TIOCMBIC, &bits);
+	    }
+	    if ((arg % 3) == 1) {
+		(void)ioctl(p->src.fd, TIOCMGET, &bits);
+		bits &= (arg == 7) ? TIOCM_DTR : TIOCM_RTS;
+		val[0] = bits ? (arg + 1) : (arg + 2);
+	    }
+	} else if (arg < 4) {		/* Flow control, both ways */
+	    if (c->writer && (arg > 0)) {
+		bits = (arg == 3) ? FLOW_RTS : ((arg == 2) ? FLOW_XON : 0);
+		change = (bits != p->flow);
+		p->flow = bits;
+	    }
+	    val[0] = (p->flow & FLOW_RTS) ? 3 : ((p->flow & FLOW_XON) ? 2 : 1);
+	} else {			/* Inbound only; goes with outbound */
+	    val[0] = (p->flow & FLOW_RTS) ? 16 : ((p->flow & FLOW_XON) ? 15 : 14);
+	}
+	break;
+
+    case CPO_LINEMASK:
+    case CPO_MODEMMASK:
+	val[0] = arg;		/* We don't send notifications */
+	break;
+
+    case CPO_PURGE:
+	if (c->writer && (arg >= 1) && (arg <= 3)) {
+	    (void)tcflush(p->src.fd, (arg == 1) ? TCIFLUSH :
+		((arg == 2) ? TCOFLUSH : TCIOFLUSH));
+	    if (arg != 1) {
+		txoff = txlen = 0;
+	    }
+	}
+	val[0] = arg;
+	break;
+
+    default:
+	return;			/* Flow suspend/resume, notifications */
+    }
+    if (change) {
+	setup_serial(p);
+    }
+    cpo_reply(c, cmd, val, (cmd == CPO_BAUDRATE) ? 4 : 1);
+}
+
+/*
+ * tn_input()
+ *	Strip Telnet commands out of what a client sent, in place
+ *
+ * Returns how much data is left.
+ */
+static int
+tn_input(struct client *c, unsigned char *buf, int len)
+{
+    int x, n = 0, ch;
+
+    for (x = 0; x < len; ++x) {
+	ch = buf[x];
+	switch (c->tn) {
+	case 0:
+	    if (ch == TN_IAC) {
+		c->tn = TS_IAC;
+	    } else {
+		buf[n++] = ch;
+		if ((ch == '\r') && (c->him[TN_BINARY] != TN_QYES)) {
+		    c->tn = TS_CR;
+		}
+	    }
+	    break;
+
+	case TS_CR:		/* NVT CR NUL is just CR */
+	    c->tn = 0;
+	    if (ch != '\0') {
+		--x;
+	    }
+	    break;
+
+	case TS_IAC:
+	    c->tn = 0;
+	    if (ch == TN_IAC) {
+		buf[n++] = ch;
+	    } else if ((ch >= TN_WILL) && (ch <= TN_DONT)) {
+		c->cmd = ch;
+		c->tn = TS_OPT;
+	    } else if (ch == TN_SB) {
+		c->sblen = 0;
+		c->tn = TS_SB;
+	    }
+	    break;
+
+	case TS_OPT:
+	    tn_option(c, c->cmd, ch);
+	    c->tn = 0;
+	    break;
+
+	case TS_SB:
+	case TS_SBIAC:
+	    if ((c->tn == TS_SB) && (ch == TN_IAC)) {
+		c->tn = TS_SBIAC;
+		break;
+	    }
+	    if ((c->tn == TS_SBIAC) && (ch != TN_IAC)) {
+		c->tn = 0;
+		if ((ch == TN_SE) && (c->sblen > 0) &&
+			(c->sb[0] == TN_COMPORT) && net_telnet) {
+		    cpo_request(c, c->sb + 1, c->sblen - 1);
+		}
+		break;
+	    }
+	    c->tn = TS_SB;
+	    if (c->sblen < sizeof(c->sb)) {
+		c->sb[c->sblen++] = ch;
+	    }
+	    break;
+	}
+    }
+    return(n);
+}
+
+/*
+ * net_event()
+ *	A client is readable, writable, or has gone away
+ */
+static void
+net_event(struct evsrc *src, int revents)
+{
+    struct client *c = (struct client *)src;
+    char buf[NETREAD];
+    int x, room;
+
+    if ((revents & EV_OUT) && (net_flush(c) < 0)) {
+	return;
+    }
+    if (!(revents & (EV_IN|EV_ERR)) || !(src->events & EV_IN)) {
+	return;
+    }
+    room = c->writer ? (TXSIZE - txlen) : sizeof(buf);
+    if (room > sizeof(buf)) {
+	room = sizeof(buf);
+    }
+    if ((x = read(src->fd, buf, room)) <= 0) {
+	if ((x < 0) && ((errno == EAGAIN) || (errno == EINTR))) {
+	    return;
+	}
+	net_drop(c, "client gone");
+	return;
+    }
+    if (net_telnet) {
+	x = tn_input(c, (unsigned char *)buf, x);
+    }
+    if (c->writer && (x > 0) && !xfer) {
+	tx_put(buf, x);
+    }
+}
+
+/*
+ * net_accept()
+ *	Take a new client on the listening socket
+ */
+static void
+net_accept(struct evsrc *src, int revents)
+{
+    struct client *c, **cp;
+    char msg[64];
+    int fd, writer = 1;
+
+    if ((fd = accept(src->fd, NULL, NULL)) < 0) {
+	return;
+    }
+    (void)fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    (void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if ((c = calloc(1, sizeof(struct client))) == NULL) {
+	close(fd);
+	return;
+    }
+    for (cp = &clients; *cp; cp = &(*cp)->next) {
+	if ((*cp)->writer) {
+	    writer = 0;
+	}
+    }
+    *cp = c;
+    c->writer = writer;
+    c->pos = rx_head;
+    c->src.fd = fd;
+    c->src.handler = net_event;
+    ev_add(&c->src);
+    snprintf(msg, sizeof(msg), "client connected%s",
+	writer ? "" : ", watching");
+    net_msg(msg);
+    if (net_telnet) {
+	c->us[TN_ECHO] = c->us[TN_SGA] = c->us[TN_BINARY] = TN_QWANT;
+	c->him[TN_SGA] = c->him[TN_BINARY] = c->him[TN_COMPORT] = TN_QWANT;
+	tn_cmd(c, TN_WILL, TN_ECHO);
+	tn_cmd(c, TN_WILL, TN_SGA);
+	tn_cmd(c, TN_WILL, TN_BINARY);
+	tn_cmd(c, TN_DO, TN_SGA);
+	tn_cmd(c, TN_DO, TN_BINARY);
+	tn_cmd(c, TN_DO, TN_COMPORT);
+    }
+    net_arm();
+}
+
+/*
+ * net_start()
+ *	Open the listening socket for -N
+ */
+static void
+net_start(void)
+{
+    struct addrinfo hints, *res, *ai;
+    char *host = NULL, *port = net_addr, *colon;
+    int fd = -1, on = 1, err;
+
+    if ((colon = strrchr(net_addr, ':')) != NULL) {
+	*colon = '\0';
+	host = net_addr;
+	port = colon + 1;
+	if (*host == '[') {		/* [v6 address]:port */
+	    host += 1;
+	    host[strcspn(host, "]")] = '\0';
+	}
+	if (!*host) {
+	    host = NULL;
+	}
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if ((err = getaddrinfo(host, port, &hints, &res)) != 0) {
+	fprintf(stderr, "%s: %s\n", net_addr, gai_strerror(err));
+	exit(1);
+    }
+    for (ai = res; ai; ai = ai->ai_next) {
+	if ((fd = socket(ai->ai_family, ai->ai_socktype,
+		ai->ai_protocol)) < 0) {
+	    continue;
+	}
+	(void)setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if ((bind(fd, ai->ai_addr, ai->ai_addrlen) == 0) &&
+		(listen(fd, 8) == 0)) {
+	    break;
+	}
+	close(fd);
+	fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) {
+	perror(port);
+	exit(1);
+    }
+    (void)fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    (void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+    net_src.fd = fd;
+    net_src.events = EV_IN;
+    net_src.handler = net_accept;
+}
+
+/*
+ * Replay (-R)
+ *
+ * A stamped capture (-L format=stamped) is played back into a port
+ * as the device sent it: with its original timing, sped up (x=),
+ * or as fast as the port will take it (max).  With no <tty> we
+ * make a pty and say where it is, so a parser can be pointed at a
+ * "device" with no hardware at all.  The capture is mapped, and
+ * everything due at once goes out in one writev() straight from
+ * the map.  What we sent, in the capture, is skipped.
+ */
+#define REPLAY_IOV (256)	/* Most records in one write... */
+#define REPLAY_BATCH (1024*1024)	/*  ...and most bytes */
+#define REPLAY_SLACK (1000)	/* How early a record may go, usec */
+
+static char *replay_name;	/* Capture to play, -R */
+static double replay_x = 1.0;	/* Speedup, or 0 to go flat out */
+static int replay_loop;		/* Start over at the end */
+
+/*
+ * replay_options()
+ *	Parse -R <capture>[,x=<factor>][,max][,loop]
+ */
+static void
+replay_options(char *opts)
+{
+    static char *tokens[] = {"x", "max", "loop", NULL};
+    char *val, *p;
+
+    replay_name = opts;
+    if ((opts = strchr(opts, ',')) == NULL) {
+	return;
+    }
+    *opts++ = '\0';
+    while (*opts) {
+	switch (getsubopt(&opts, tokens, &val)) {
+	case 0:
+	    if (!val || ((replay_x = strtod(val, &p)) <= 0) || *p ||
+		    (p == val)) {
+		fprintf(stderr, "Illegal replay speed\n");
+		usage();
+	    }
+	    break;
+
+	case 1:
+	    replay_x = 0;
+	    break;
+
+	case 2:
+	    replay_loop = 1;
+	    break;
+
+	default:
+	    fprintf(stderr, "Illegal replay option: %s\n", val);
+	    usage();
+	}
+    }
+}
+
+/*
+ * replay_pty()
+ *	Open a pty to replay into, and wait for someone to listen
+ *
+ * Until the other end is opened, the master polls as hung up.
+ */
+static int
+replay_pty(void)
+{
+    struct termios t;
+    struct pollfd pfd;
+    int fd;
+
+    if (((fd = posix_openpt(O_RDWR|O_NOCTTY)) < 0) || grantpt(fd) ||
+	    unlockpt(fd)) {
+	perror("pty");
+	exit(1);
+    }
+    if (tcgetattr(fd, &t) == 0) {
+	cfmakeraw(&t);
+	(void)tcsetattr(fd, TCSANOW, &t);
+    }
+    (void)fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    printf("[replaying on %s]\n", ptsname(fd));
+    fflush(stdout);
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (!quitsig && (poll(&pfd, 1, 0) > 0) && (pfd.revents & POLLHUP)) {
+	usleep(20000);
+    }
+    return(fd);
+}
+
+/*
+ * replay_write()
+ *	Get "n" pieces out to "fd", waiting on it when it's full
+ */
+static int
+replay_write(int fd, struct iovec *iov, int n)
+{
+    struct pollfd pfd;
+    ssize_t x;
+
+    while (n && !quitsig) {
+	if ((x = writev(fd, iov, n)) < 0) {
+	    if (errno == EAGAIN) {
+		pfd.fd = fd;
+		pfd.events = POLLOUT;
+		(void)poll(&pfd, 1, 1000);
+	    } else if (errno != EINTR) {
+		return(-1);
+	    }
+	    continue;
+	}
+	while (n && (x >= (ssize_t)iov->iov_len)) {
+	    x -= iov->iov_len;
+	    iov += 1;
+	    n -= 1;
+	}
+	if (n) {
+	    iov->iov_base = (char *)iov->iov_base + x;
+	    iov->iov_len -= x;
+	}
+    }
+    return(0);
+}
+
+/*
+ * replay()
+ *	Play the capture into port "p" (or, if NULL, into a pty)
+ */
+static int
+replay(struct port *p)
+{
+    struct iovec iov[REPLAY_IOV];
+    unsigned char *cap, *r;
+    size_t caplen, off, left, n, batch;
+    long long t0, t, start, due, began, bytes = 0, recs = 0;
+    struct timespec ts;
+    struct pollfd pfd;
+    struct stat sb;
+    int fd, type, niov;
+
+    if (((fd = open(replay_name, O_RDONLY)) < 0) || (fstat(fd, &sb) < 0)) {
+	perror(replay_name);
+	exit(1);
+    }
+    caplen = sb.st_size;
+    if ((caplen < (CAP_HDR + CAP_INDEX)) || ((cap = mmap(NULL, caplen,
+	    PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)) {
+	cap = NULL;
+    }
+    close(fd);
+    if (!cap || (cap_get(cap + 12, 4) != CAP_I) ||
+	    memcmp(cap + CAP_HDR, CAP_MAGIC, 8)) {
+	fprintf(stderr, "%s: not a stamped capture\n", replay_name);
+	exit(1);
+    }
+    (void)madvise(cap, caplen, MADV_SEQUENTIAL);
+
+    signal(SIGINT, sigquit);
+    signal(SIGTERM, sigquit);
+    signal(SIGHUP, sigquit);
+    if (p) {
+	if ((p->src.fd = open(p->tty, O_RDWR|O_NOCTTY|O_NDELAY)) < 0) {
+	    perror(p->tty);
+	    exit(1);
+	}
+	setup_serial(p);
+	fd = p->src.fd;
+	printf("[replaying on %s]\n", p->tty);
+    } else {
+	fd = replay_pty();
+    }
+
+    t0 = cap_get(cap, 8);
+    began = ev_now();
+    do {
+	start = ev_now();
+	niov = 0;
+	batch = 0;
+	for (off = 0; ((off + CAP_HDR) <= caplen) && !quitsig; ) {
+	    left = CAP_SPAN - (off % CAP_SPAN);
+	    r = cap + off;
+	    type = cap_get(r + 12, 4);
+	    if ((left <= CAP_HDR) || (type == 0)) {
+		off += left;		/* Filler, to the next span */
+		continue;
+	    }
+	    t = cap_get(r, 8);
+	    n = cap_get(r + 8, 4);
+	    if ((n > (left - CAP_HDR)) || ((off + CAP_HDR + n) > caplen)) {
+		break;			/* Cut short */
+	    }
+	    off += CAP_HDR + n;
+	    if ((type != CAP_RX) || (n == 0)) {
+		continue;
+	    }
+
+	    /*
+	     * Whatever's already due goes together; when this one
+	     * isn't yet, that lot goes out and we wait for it.
+	     */
+	    due = replay_x ? (start + (long long)((t - t0) / replay_x)) : 0;
+	    if ((niov == REPLAY_IOV) || (batch >= REPLAY_BATCH) ||
+		    (due > (ev_now() + REPLAY_SLACK))) {
+		if (replay_write(fd, iov, niov) < 0) {
+		    fail("replay write");
+		}
+		niov = 0;
+		batch = 0;
+		if (due > (ev_now() + REPLAY_SLACK)) {
+		    ts.tv_sec = due / 1000000;
+		    ts.tv_nsec = (due % 1000000) * 1000;
+		    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+			    &ts, NULL) == EINTR) {
+			if (quitsig) {
+			    break;
+			}
+		    }
+		}
+	    }
+	    iov[niov].iov_base = r + CAP_HDR;
+	    iov[niov].iov_len = n;
+	    niov += 1;
+	    batch += n;
+	    bytes += n;
+	    recs += 1;
+	}
+	if (replay_write(fd, iov, niov) < 0) {
+	    fail("replay write");
+	}
+    } while (replay_loop && !quitsig);
+
+    t = ev_now() - began;
+    printf("[replayed %lld bytes in %lld records, %lld.%02lld sec]\n",
+	bytes, recs, t / 1000000, (t / 10000) % 100);
+    fflush(stdout);
+
+    /*
+     * A port gets to finish sending; a pty's reader gets to finish
+     * reading, as the master going away would throw out what's
+     * still queued for it.
+     */
+    if (p) {
+	(void)tcdrain(fd);
+    } else {
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (!quitsig && (poll(&pfd, 1, 0) >= 0) &&
+		!(pfd.revents & POLLHUP)) {
+	    usleep(20000);
+	}
+    }
+    close(fd);
+    return(0);
+}
+
+int
+main(int argc, char **argv)
+{
+    int x;
+    long long size;
+    char *p;
+    static char boot_msg[] = "Term ready.\r\n";
+    extern char *optarg;
+    mode_t mask;
+
+    /*
+     * Rotated segments come from mkstemp(), at 0600, and are given
+     * what open() would have; umask() can only be read by setting
+     * it, so that's done (and undone) now, before any threads.
+     */
+    mask = umask(022);
+    (void)umask(mask);
+    log_mode = 0666 & ~mask;
+
+    while ((x = getopt(argc, argv, "s:p:l:L:S:N:R:T:M:E:D:B:X:F:f:eo78mrPb:ca")) != -1) {
+	switch (x) {
+
+	/*
+	 * Selection of baud rate
+	 */
+	case 's':
+	    speed = strtol(optarg, &p, 10);
+	    if ((p == optarg) || *p || (speed <= 0)) {
+		fprintf(stderr, "Illegal speed: %s\n", optarg);
+		usage();
+	    }
+	    break;
+
+	/*
+	 * Selection of transfer protocol
+	 */
+	case 'p':
+	    if ((p = strchr(optarg, ',')) != NULL) {
+		*p++ = '\0';
+		proto_options(p);
+	    }
+	    if (!strcmp(optarg, "x")) {
+		proto = PROTO_RX;
+	    } else if (!strcmp(optarg, "y")) {
+		proto = PROTO_RY;
+	    } else if (!strcmp(optarg, "z")) {
+		proto = PROTO_RZ;
+	    } else if (!strcmp(optarg, "txt")) {
+		proto = PROTO_TXT;
+	    } else {
+		printf("Illegal protocol: %s\n", optarg);
+		usage();
+	    }
+	    break;
+
+	/* Choose a log file */
+	case 'l':
+	    logname = optarg;
+	    break;
+
+	/* Session capture options */
+	case 'L':
+	    log_options(optarg);
+	    break;
+
+	/* Write out the counters every so often; stderr, or a file */
+	case 'S':
+	    stats_every = strtol(optarg, &p, 10);
+	    if ((p == optarg) || (stats_every <= 0) || (*p && (*p != ','))) {
+		fprintf(stderr, "Illegal stats interval: %s\n", optarg);
+		usage();
+	    }
+	    if (*p && ((stats_fd = open(p+1,
+		    O_WRONLY|O_CREAT|O_APPEND, 0666)) < 0)) {
+		perror(p+1);
+		exit(1);
+	    }
+	    break;
+
+	/* Take binary frames out of what the ports say */
+	case 'F':
+	    frame_options(optarg);
+	    break;
+
+	/* Keep the receive side on the CPU, and in memory */
+	case 'X':
+	    rt_options(optarg);
+	    break;
+
+	/* Flow control, low latency */
+	case 'f':
+	    flow_options(optarg);
+	    break;
+
+	/* Serve the port over the network */
+	case 'N':
+	    net_options(optarg);
+	    break;
+
+	/* Publish the stream in shared memory */
+	case 'M':
+	    tap_options(optarg);
+	    break;
+
+	/* Watch for patterns, and act on them */
+	case 'T':
+	    trig_name = optarg;
+	    break;
+
+	/* Play a capture into the port */
+	case 'R':
+	    replay_options(optarg);
+	    break;
+
+	/* What to do about a terminal which can't keep up */
+	case 'D':
+	    disp_options(optarg);
+	    break;
+
+	/* How the event loop waits: poll (epoll, on Linux), or io_uring */
+	case 'E':
+	    if (!strcmp(optarg, "uring")) {
+		ev_uring = 1;
+	    } else if (!strcmp(optarg, "poll")) {
+		ev_uring = 0;
+	    } else {
+		fprintf(stderr, "Illegal event loop: %s\n", optarg);
+		usage();
+	    }
+	    break;
+
+	/* Set odd parity */
+	case 'o':
+	    if (pareven) {
+		bad_parity();
+	    }
+	    parodd = 1;
+	    break;
+
+	/* Set even parity */
+	case 'e':
+	    if (parodd) {
+		bad_parity();
+	    }
+	    pareven = 1;
+	    break;
+
+	/* Set seven bit format (else 8) */
+	case '7':
+	    seven_bits = 1;
+	    break;
+
+	/*
+	 * Pass data through with all 8 bits, or strip it to 7.  By
+	 * default we only strip in 7 bit format.
+	 */
+	case '8':
+	    strip_hi = 0;
+	    break;
+	case 'm':
+	    strip_hi = 1;
+	    break;
+
+	/* Always copy received data, never splice() it */
+	case 'c':
+	    relay_copy = 1;
+	    break;
+
+	/* Raw keyboard */
+	case 'r':
+	    raw_kbd = 1;
+	    break;
+
+	/*
+	 * Receive buffer size, and how long to let a busy port fill
+	 * between reads ("auto" lets us figure that out ourselves).
+	 */
+	case 'b':
+	    if (!strcmp(optarg, "auto")) {
+		rxsize = RXSIZE;
+		rxauto = 1;
+		break;
+	    }
+	    if ((size = getsize(optarg, &p)) < 64 || (size > (1 << 30))) {
+		fprintf(stderr, "Illegal buffer size: %s\n", optarg);
+		usage();
+	    }
+	    rxsize = size;
+	    if (*p == ',') {
+		rxauto = 0;
+		rxhold = strtol(p+1, &p, 10);
+	    }
+	    if (*p || (rxhold < 0)) {
+		fprintf(stderr, "Illegal buffer size: %s\n", optarg);
+		usage();
+	    }
+	    break;
+
+	/* Start out in paste mode */
+	case 'P':
+	    paste_mode = 1;
+	    break;
+
+	/* A port which goes away (USB, unplugged or reset) will be back */
+	case 'a':
+	    reconnect = 1;
+	    break;
+
+	/* No one at the keyboard; run a script on every port */
+	case 'B':
+	    batch_name = optarg;
+	    batch_load();
+	    break;
+
+	default:
+	    printf("Illegal option: %c\n", x);
+	    usage();
+	}
+    }
+
+    /* Once -p is known, so a receive can be checked for a name */
+    if (trig_name) {
+	trig_load();
+    }
+
+    /* A replay is all we'll do; into one port, or a pty of our own */
+    if (replay_name) {
+	if (optind < argc) {
+	    port_add(argv[optind++]);
+	}
+	if (optind < argc) {
+	    usage();
+	}
+	exit(replay(nports ? &ports[0] : NULL));
+    }
+
+    /* Trailing arguments; terminal devices */
+    if (optind == argc) {
+	port_add(DEFAULT_TTY);
+    }
+    while (optind < argc) {
+	port_add(argv[optind++]);
+    }
+    cur = &ports[0];
+
+    /*
+     * Batch mode has nothing to show, nor anyone to show it to;
+     * the terminal is /dev/null, and stdout is for the report.
+     */
+    if (batch_name) {
+	if (net_addr || ntrigs || tap_name) {
+	    fprintf(stderr, "-B doesn't go with -N, -T or -M\n");
+	    usage();
+	}
+	if ((ttyfd = open("/dev/null", O_RDWR)) < 0) {
+	    perror("/dev/null");
+	    exit(1);
+	}
+	relay_copy = 1;
+    } else {
+	printf("Terminal starting up...\n");
+	printf("Use ^Z-q (control-Z, followed by q) to quit.\n");
+
+	/*
+	 * The goal is to make the terminal device be our standard
+	 * input & output; port_attach() keeps it that way as the
+	 * keyboard moves from port to port.
+	 */
+	ttyfd = dup(1);
+    }
+    for (x = 0; x < nports; ++x) {
+	p = ports[x].tty;
+
+	/* Not as our controlling tty; its hanging up isn't a SIGHUP */
+	if ((ports[x].src.fd = open(p, O_RDWR|O_EXCL|O_NDELAY|O_NOCTTY)) < 0) {
+	    perror(p);
+	    exit(1);
+	}
+    }
+    rs232 = cur->src.fd;
+    port_stdio(cur);
+    if (net_addr) {
+	net_start();
+    }
+    if (tap_name) {
+	tap_open();
+    }
+
+    /*
+     * Set up for raw TTY I/O
+     */
+    tcgetattr(ttyfd, &otty);
+    ntty = otty;
+    ntty.c_lflag &= ~(ECHO|ICANON|ISIG);
+    ntty.c_oflag &= ~OPOST;
+    ntty.c_iflag = 0;
+    ntty.c_cc[VMIN] = 1;
+    ntty.c_cc[VTIME] = 0;
+    tcsetattr(ttyfd, TCSAFLUSH, &ntty);
+
+    for (x = 0; x < nports; ++x) {
+	setup_serial(&ports[x]);
+	serial_lowlat(&ports[x], 1);
+    }
+    if ((rxbuf = malloc(rxsize)) == NULL) {
+	fail("receive buffer");
+    }
+    if (!batch_name) {
+	rx_start(net_addr ? net_qsize : 0);
+    }
+
+    /*
+     * One pipe will do for splice(), as only the attached port
+     * ever goes through it.
+     */
+    for (x = 0; x < nports; ++x) {
+#ifdef HAVE_SPLICE
+	if (relay_can_splice(&ports[x])) {
+	    if (!relay_fast && (pipe2(rxpipe, O_CLOEXEC) == 0)) {
+		(void)fcntl(rxpipe[1], F_SETPIPE_SZ, rxsize);
+		relay_fast = 1;
+	    }
+	    ports[x].fast = relay_fast;
+	}
+#endif
+	if (ports[x].log) {
+	    log_start(ports[x].log, ports[x].fast);
+	}
+	if (ports[x].frlog) {
+	    log_start(ports[x].frlog, 0);
+	}
+    }
+
+    /*
+     * One loop services both directions: serial ports to the user
+     * (and, if -l was used, to the log file too), and keyboard to
+     * the attached serial port.
+     */
+    signal(SIGTERM, sigquit);
+    signal(SIGHUP, sigquit);
+    ev_init();
+    for (x = 0; x < nports; ++x) {
+	ports[x].src.handler = serial_event;
+	ev_add(&ports[x].src);
+	serial_arm(&ports[x]);
+    }
+    if (!batch_name) {
+	kbd_src.fd = ttyfd;
+	kbd_src.events = EV_IN;
+	kbd_src.handler = kbd_input;
+	ev_add(&kbd_src);
+    }
+    lost_start();
+    if (net_addr) {
+	signal(SIGPIPE, SIG_IGN);
+	ev_add(&net_src);
+    }
+    stats_start();
+    if (batch_name) {
+	batch_start();
+    }
+    rt_start();
+    write(ttyfd, boot_msg, sizeof(boot_msg)-1);
+    while (!quitsig) {
+	ev_wait(-1);
+    }
+    done();
+    /*NOTREACHED*/
+    return(0);
+}
+
+/*
+ * Ask for and receive a line in raw mode
+ */
+static void
+prompt_read(int ttyfd, char *prompt, char *buf, int len)
+{
+    char c;
+
+    /* Leave room for null terminator */
+    len -= 1;
+
+    /* Prompt */
+    write(ttyfd, prompt, strlen(prompt));
+
+    /* Read chars until newline */
+    do {
+	c = kbd_getc();
+	write(ttyfd, &c, sizeof(c));
+	if (len) {
+	    *buf++ = c;
+	    --len;
+	}
+    } while ((c != '\n') && (c != '\r'));
+
+    /* Overwrite newline with terminator */
+    buf -= 1;
+    *buf = '\0';
+}
+
+/*
+ * xfer_start()
+ *	Start receiving (into "fname", for XMODEM), or sending "fname"
+ */
+static void
+xfer_start(int send, char *fname)
+{
+    if (!send) {
+	switch (proto) {
+
+	case PROTO_RX:
+	    xm_recv(fname, 0);
+	    break;
+
+	case PROTO_RY:
+	    xm_recv(NULL, 1);
+	    break;
+
+	case PROTO_RZ:
+	    zm_recv();
+	    break;
+
+	default:
+	    fprintf(stderr, "Receive not supported with this protocol.\r\n");
+	}
+	return;
+    }
+
+    switch (proto) {
+
+    case PROTO_RX:
+	xm_send(fname, 0);
+	return;
+
+    case PROTO_RY:
+	xm_send(fname, 1);
+	return;
+
+    case PROTO_RZ:
+	zm_send(fname);
+	return;
+
+    case PROTO_TXT:
+	ts_send(fname);
+	return;
+
+    default:
+	fprintf(stderr, "Transmit not supported with this protocol.\r\n");
+	return;
+    }
+}
+
+/*
+ * Execute a protocol receive
+ */
+static void
+rx_xfer(int ttyfd)
+{
+    char fname[60];
+
+    /*
+     * Xmodem doesn't send names, so we have to ask.  Bleh.
+     */
+    if (proto == PROTO_RX) {
+	prompt_read(ttyfd, "Receive file: ", fname, sizeof(fname));
+    }
+    xfer_start(0, fname);
+}
+
+/*
+ * Execute a protocol transmit
+ */
+static void
+tx_xfer(int ttyfd)
+{
+    char fname[60];
+
+    prompt_read(ttyfd, "Send file: ", fname, sizeof(fname));
+    xfer_start(1, fname);
+}
+
+/*
+ * port_attach()
+ *	Move the keyboard and screen over to port "p"
+ *
+ * Whatever's still queued was typed at the old port, so it gets a
+ * second to go there; after that it's dropped rather than sent to
+ * the wrong place.
+ */
+static void
+port_attach(struct port *p)
+{
+    struct port *was = cur;
+    long long until = ev_now() + 1000000LL;
+    struct pollfd pfd;
+    char buf[128];
+    int x;
+
+    if (xfer) {
+	disp_say(ttyfd, "[transfer in progress]\r\n", 24);
+	return;
+    }
+    while ((txoff < txlen) && (ev_now() < until)) {
+	pfd.fd = rs232;
+	pfd.events = POLLOUT;
+	(void)poll(&pfd, 1, (int)((until - ev_now()) / 1000) + 1);
+	if ((x = write(rs232, txbuf+txoff, txlen-txoff)) > 0) {
+	    tx_sent(x);
+	} else if ((x < 0) && (errno != EAGAIN) && (errno != EINTR)) {
+	    break;
+	}
+    }
+    txoff = txlen = 0;
+    cur = p;
+    rs232 = p->src.fd;
+    trig_reset();
+    port_stdio(p);
+    serial_arm(was);
+    serial_arm(cur);
+    kbd_arm();
+    snprintf(buf, sizeof(buf), "[port %d: %s%s]\r\n", p->num, p->tty,
+	p->lost ? ", gone for now" : "");
+    disp_say(ttyfd, buf, strlen(buf));
+}
+
+/*
+ * Figure out what they want to do, drive a protcol transfer
+ */
+static void
+proto_xfer(int ttyfd, int rs232)
+{
+    char c;
+    register char c2;
+    int x;
+    static char helpmsg[] =
+	"Options are: <r>eceive, <s>end, <p>aste mode, <i>nfo,\r\n"
+	"\t<d>isplay pause, display <m>ode (raw, caret, hex, time),\r\n"
+	"\t<n>ext port, <g>o to port, <q>uit\r\n";
+    char buf[2048];
+
+    /* Get next char to see what they want to do */
+    c = kbd_getc();
+
+    /* Send char through literally */
+    if (c == PROTO_CHAR) {
+	tx_put(&c, sizeof(c));
+	return;
+    }
+
+    /* 'q' or 'Q' means quit */
+    if ((c == 'q') || (c == 'Q')) {
+	done();
+    }
+
+    /* Receive? */
+    c2 = c;
+    if (cur->lost && strchr("rRsStT", c2)) {
+	disp_say(ttyfd, "[port is gone for now]\r\n", 24);
+    } else if ((c2 == 'r') || (c2 == 'R')) {
+	rx_xfer(ttyfd);
+	if (!xfer) {
+	    setup_serial(cur);
+	}
+
+    /* Send? */
+    } else if ((c2 == 's') || (c2 == 'S') || (c2 == 't') ||
+	    (c2 == 'T')) {
+	tx_xfer(ttyfd);
+	if (!xfer) {
+	    setup_serial(cur);
+	}
+
+    /* Paste mode toggle */
+    } else if ((c2 == 'p') || (c2 == 'P')) {
+	paste_mode = !paste_mode;
+	if (paste_mode) {
+	    disp_say(ttyfd, "[paste mode on]\r\n", 17);
+	} else {
+	    disp_say(ttyfd, "[paste mode off]\r\n", 18);
+	}
+	kbd_arm();
+
+    /* Stop (or start) showing the port; capture carries on */
+    } else if ((c2 == 'd') || (c2 == 'D')) {
+	if (!disp.paused) {
+	    disp_pause(1);
+	    disp_say(ttyfd, "[display paused]\r\n", 18);
+	} else {
+	    disp_pause(0);
+	}
+
+    /* Next way of showing it */
+    } else if ((c2 == 'm') || (c2 == 'M')) {
+	disp_mode((disp.mode + 1) % (sizeof(dm_grow) / sizeof(dm_grow[0])));
+
+    /* Counters */
+    } else if ((c2 == 'i') || (c2 == 'I')) {
+	disp_say(ttyfd, buf, stats_format(buf, sizeof(buf), &shown, 1));
+
+    /* Move the keyboard to the next port, or a chosen one */
+    } else if ((c2 == 'n') || (c2 == 'N')) {
+	port_attach(&ports[(cur->num) % nports]);
+    } else if ((c2 == 'g') || (c2 == 'G')) {
+	prompt_read(ttyfd, "Port (number or tty): ", buf, sizeof(buf));
+	buf[strcspn(buf, "\r\n")] = '\0';
+	for (x = 0; x < nports; ++x) {
+	    if ((atoi(buf) == ports[x].num) || !strcmp(buf, ports[x].tty)) {
+		break;
+	    }
+	}
+	if (x < nports) {
+	    port_attach(&ports[x]);
+	} else {
+	    disp_say(ttyfd, "[no such port]\r\n", 16);
+	}
+
+    /* Dunno */
+    } else {
+	disp_say(ttyfd, helpmsg, sizeof(helpmsg)-1);
+    }
+}
+
+/*
+ * Protocol transfers
+ *
+ * xfer_begin() makes a transfer the active one; from then on the
+ * event loop feeds it (see struct xfer) until xfer_finish().
+ */
+static void
+xfer_begin(struct xfer *x)
+{
+    if (!disp_skip) {
+	disp_sync();
+    }
+    xfer = x;
+    x->started = x->shown = ev_now();
+    x->timer.port = batch_name ? cur : NULL;
+    if (x->raw) {
+	serial_xonxoff(cur, 0);
+    }
+    kbd_arm();
+    tx_flush();
+}
+
+/*
+ * xfer_finish()
+ *	Say how it went and tear down the active transfer
+ */
+static void
+xfer_finish(char *msg)
+{
+    struct xfer *x = xfer;
+    int ok = x->ok;
+    char buf[160];
+
+    ev_untimer(&x->timer);
+    snprintf(buf, sizeof(buf), "\r\n%s: %s\r\n", x->proto, msg);
+    disp_say(ttyfd, buf, strlen(buf));
+    xfer = NULL;
+    if (x->raw) {
+	serial_xonxoff(cur, 1);
+    }
+    (*x->end)(x);
+    kbd_arm();
+    serial_arm(cur);
+    if (batch_name) {
+	batch_xfer(ok, msg);
+    }
+}
+
+/* The transfer's over, and it went as it should */
+static void
+xfer_done(char *msg)
+{
+    xfer->ok = 1;
+    xfer_finish(msg);
+}
+
+/*
+ * xfer_input()
+ *	Received data, for the transfer
+ *
+ * Should that be the end of it, returns how much of the end of
+ * "buf" it didn't get to; what the other end says afterwards is
+ * anyone's.
+ */
+static int
+xfer_input(unsigned char *buf, int len)
+{
+    xfer_rest = 0;
+    (*xfer->input)(xfer, buf, len);
+    return(xfer ? 0 : xfer_rest);
+}
+
+/* A keystroke, for the transfer (mostly to see if it's an abort) */
+static void
+xfer_key(int c)
+{
+    (*xfer->key)(xfer, c);
+}
+
+/*
+ * xfer_progress()
+ *	Keep the user posted, a few times a second
+ */
+static void
+xfer_progress(struct xfer *x, char *what, long long pos, long long size)
+{
+    long long now = ev_now(), rate;
+    char buf[160];
+
+    if ((((now - x->shown) < 250000) && (pos != size)) || batch_name) {
+	return;
+    }
+    x->shown = now;
+    rate = (now > x->started) ? (pos * 1000000LL / (now - x->started)) : 0;
+    if (size >= 0) {
+	snprintf(buf, sizeof(buf), "\r%s: %s %lld/%lld bytes, %lld bytes/sec   ",
+	    x->proto, what, pos, size, rate);
+    } else {
+	snprintf(buf, sizeof(buf), "\r%s: %s %lld bytes, %lld bytes/sec   ",
+	    x->proto, what, pos, rate);
+    }
+    disp_say(ttyfd, buf, strlen(buf));
+}
+
+/*
+ * xfer_cancel()
+ *	Give up, and tell the other end to give up too
+ *
+ * CANs mean "stop" to all of X, Y and ZMODEM.  Whatever was queued
+ * is thrown away first so they get there promptly.  A partly
+ * received file is kept.
+ */
+static void
+xfer_cancel(char *why)
+{
+    static char canit[] =
+	"\030\030\030\030\030\030\030\030\030\030\b\b\b\b\b\b\b\b\b\b";
+
+    txoff = txlen = 0;
+    (void)tcflush(rs232, TCOFLUSH);
+    tx_put(canit, sizeof(canit)-1);
+    xfer_finish(why);
+}
+
+/* Key routine for a transfer; ^X or ^C stops it */
+static void
+xfer_stopkey(struct xfer *x, int c)
+{
+    if ((c == 030) || (c == 003)) {
+	xfer_cancel("cancelled");
+    }
+}
+
+/*
+ * tx_reserve()
+ *	Make sure there's "n" bytes' room in the transmit queue
+ *
+ * Only a transfer which is already streaming should ever find the
+ * queue full; we just wait for the port to drain some.
+ */
+static void
+tx_reserve(int n)
+{
+    struct pollfd pfd;
+    int x;
+
+    while (tx_room() < n) {
+	pfd.fd = rs232;
+	pfd.events = POLLOUT;
+	(void)poll(&pfd, 1, 1000);
+	if ((x = write(rs232, txbuf+txoff, txlen-txoff)) > 0) {
+	    tx_sent(x);
+	} else if ((x < 0) && (errno != EAGAIN) && (errno != EINTR)) {
+	    fail("serial write");
+	}
+    }
+}
+
+/*
+ * CRCs: CRC-16/CCITT (XMODEM's) and CRC-32 (the IEEE/zlib one),
+ * both table driven.  CRC-32 goes 8 bytes a loop (slice-by-8), or
+ * uses the CRC32 instructions ARMv8 has for exactly this
+ * polynomial.  crc32_upd() works on the raw register; callers do
+ * the usual ~0 start and final inversion.
+ */
+static unsigned short crc16tab[256];
+static unsigned int crc32tab[8][256];
+
+static void
+crc_init(void)
+{
+    unsigned int c, x, y;
+
+    if (crc32tab[0][1]) {
+	return;
+    }
+    for (x = 0; x < 256; ++x) {
+	c = x << 8;
+	for (y = 0; y < 8; ++y) {
+	    c = (c & 0x8000) ? ((c << 1) ^ 0x1021) : (c << 1);
+	}
+	crc16tab[x] = c & 0xFFFF;
+	c = x;
+	for (y = 0; y < 8; ++y) {
+	    c = (c & 1) ? ((c >> 1) ^ 0xEDB88320) : (c >> 1);
+	}
+	crc32tab[0][x] = c;
+    }
+    for (x = 0; x < 256; ++x) {
+	for (y = 1; y < 8; ++y) {
+	    c = crc32tab[y-1][x];
+	    crc32tab[y][x] = (c >> 8) ^ crc32tab[0][c & 0xFF];
+	}
+    }
+}
+
+static unsigned short
+crc16_upd(unsigned short crc, unsigned char *p, size_t len)
+{
+    while (len--) {
+	crc = (crc << 8) ^ crc16tab[((crc >> 8) ^ *p++) & 0xFF];
+    }
+    return(crc);
+}
+
+static unsigned int
+crc32_upd(unsigned int crc, unsigned char *p, size_t len)
+{
+#if defined(__ARM_FEATURE_CRC32)
+    unsigned long long w;
+
+    for (; len >= 8; p += 8, len -= 8) {
+	memcpy(&w, p, 8);
+	crc = __crc32d(crc, w);
+    }
+    while (len--) {
+	crc = __crc32b(crc, *p++);
+    }
+#else
+    unsigned int a, b;
+
+    for (; len >= 8; p += 8, len -= 8) {
+	a = (p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24)) ^ crc;
+	b = p[4] | (p[5] << 8) | (p[6] << 16) | ((unsigned int)p[7] << 24);
+	crc = crc32tab[7][a & 0xFF] ^ crc32tab[6][(a >> 8) & 0xFF] ^
+	    crc32tab[5][(a >> 16) & 0xFF] ^ crc32tab[4][a >> 24] ^
+	    crc32tab[3][b & 0xFF] ^ crc32tab[2][(b >> 8) & 0xFF] ^
+	    crc32tab[1][(b >> 16) & 0xFF] ^ crc32tab[0][b >> 24];
+    }
+    while (len--) {
+	crc = (crc >> 8) ^ crc32tab[0][(crc ^ *p++) & 0xFF];
+    }
+#endif
+    return(crc);
+}
+
+/*
+ * ZMODEM
+ *
+ * zm_input() digs headers and data subpackets out of whatever the
+ * port delivers, however it happens to be split up, and passes
+ * them to the sending or receiving side.  A sender streams data
+ * from zm_pump() whenever the transmit queue has room: ZCRCG
+ * subpackets, which the receiver doesn't acknowledge, so the link
+ * never sits idle waiting on a round trip.  Errors come back as a
+ * ZRPOS and we just pick up again from there.  With ZCRESUM (-p
+ * z,resume) an interrupted file carries on from however much of it
+ * the receiver already has.
+ */
+#define ZPAD '*'
+#define ZDLE (030)
+#define ZBIN 'A'
+#define ZHEX 'B'
+#define ZBIN32 'C'
+
+#define ZRQINIT (0)		/* Frame types */
+#define ZRINIT (1)
+#define ZSINIT (2)
+#define ZACK (3)
+#define ZFILE (4)
+#define ZSKIP (5)
+#define ZNAK (6)
+#define ZABORT (7)
+#define ZFIN (8)
+#define ZRPOS (9)
+#define ZDATA (10)
+#define ZEOF (11)
+#define ZFERR (12)
+#define ZCRC (13)
+#define ZCHALLENGE (14)
+#define ZCOMPL (15)
+#define ZCAN (16)
+#define ZFREECNT (17)
+#define ZCOMMAND (18)
+
+#define ZCRCE 'h'		/* Subpacket ends; end of frame */
+#define ZCRCG 'i'		/*  ...more follows, no ack */
+#define ZCRCQ 'j'		/*  ...more follows, ack it */
+#define ZCRCW 'k'		/*  ...ack it, end of frame */
+#define ZRUB0 'l'		/* Escaped 0177 */
+#define ZRUB1 'm'		/* Escaped 0377 */
+
+#define CANFDX (01)		/* ZRINIT flags: full duplex */
+#define CANOVIO (02)		/*  ...can receive during disk I/O */
+#define CANFC32 (040)		/*  ...can do CRC-32 */
+#define ESCCTL (0100)		/*  ...wants all control chars escaped */
+
+#define ZCBIN (1)		/* ZFILE conversion: binary */
+#define ZCRESUM (3)		/*  ...resume interrupted file */
+
+#define ZMAXBLK (8192)		/* Biggest subpacket */
+#define ZTIMEOUT (10)		/* Seconds before we try again */
+#define ZRETRIES (10)		/*  ...and how many times */
+#define ZERRORS (30)		/* Garbled subpackets before giving up */
+
+#define ZP_HUNT (0)		/* Parser: looking for ZPAD */
+#define ZP_PAD (1)		/*  ...seen ZPAD */
+#define ZP_KIND (2)		/*  ...and ZDLE, header format next */
+#define ZP_BHDR (3)		/*  ...in a binary header */
+#define ZP_HHDR (4)		/*  ...in a hex header */
+#define ZP_DATA (5)		/*  ...in a data subpacket */
+#define ZP_DCRC (6)		/*  ...in its CRC */
+#define ZP_OO (7)		/*  ...waiting for "OO" after ZFIN */
+
+#define ZS_INIT (0)		/* Sender: sent ZRQINIT */
+#define ZS_FILE (1)		/*  ...sent ZFILE */
+#define ZS_DATA (2)		/*  ...streaming */
+#define ZS_WAIT (3)		/*  ...filled receiver's buffer, want ZACK */
+#define ZS_EOF (4)		/*  ...sent ZEOF */
+#define ZS_FIN (5)		/*  ...sent ZFIN */
+#define ZR_INIT (0)		/* Receiver: sent ZRINIT */
+#define ZR_DATA (1)		/*  ...sent ZRPOS, taking data */
+#define ZR_FIN (2)		/*  ...got ZFIN */
+
+struct zm {
+    struct xfer x;		/* Must be first */
+    int sending;
+    int phase;			/* ZS_* or ZR_* */
+    int retries, errors;
+
+    /* Parser */
+    int pstate;			/* ZP_* */
+    int esc;			/* Last byte was ZDLE */
+    int cans;			/* Run of CANs (ZDLEs) seen */
+    int kind;			/* ZBIN, ZHEX, ZBIN32 */
+    unsigned char hdr[8];	/* Header, or subpacket CRC */
+    int hlen, hneed;
+    int data32;			/* Subpackets have CRC-32 */
+    int dfor;			/* Frame type subpacket belongs to */
+    int fend;			/* How the subpacket ended */
+    int oos;			/* 'O's seen, at the end */
+    int plen;
+    unsigned char pkt[ZMAXBLK + 8];
+
+    /* Our side of the link */
+    int use32;			/* Send CRC-32 binary headers, data */
+    int escctl;			/* Escape all control characters */
+    int rxlimit;		/* Receiver's buffer; 0 streams freely */
+    int blk;			/* Subpacket size */
+    int zconv;			/* ZFILE conversion option */
+    unsigned char lastc;	/* Last byte sent, for the @-CR rule */
+    unsigned char esctab[256];	/* 1 escape, 2 escape after '@' */
+    char attn[33];		/* Sender's attention string */
+
+    /* The file */
+    int fd;
+    char name[256];
+    long long size;		/* -1 if we weren't told */
+    long long pos;		/* Bytes written, or next to send */
+    long long acked;		/* Sender: receiver has this much */
+    long long mtime;
+    unsigned char buf[ZMAXBLK];
+};
+
+static void zs_pump(struct xfer *);
+
+/*
+ * zm_setesc()
+ *	Work out which bytes we have to escape on the way out
+ */
+static void
+zm_setesc(struct zm *z)
+{
+    int c;
+
+    for (c = 0; c < 256; ++c) {
+	if (z->escctl && !(c & 0140)) {
+	    z->esctab[c] = 1;
+	} else switch (c & 0177) {
+	case ZDLE:
+	case 020:		/* DLE, XON, XOFF */
+	case 021:
+	case 023:
+	    z->esctab[c] = 1;
+	    break;
+	case '\r':		/* Telenet's "@\r" escape */
+	    z->esctab[c] = 2;
+	    break;
+	default:
+	    z->esctab[c] = 0;
+	}
+    }
+}
+
+/* One byte, escaped as need be, into "d"; returns the new "d" */
+static unsigned char *
+zm_put(struct zm *z, unsigned char *d, int c)
+{
+    c &= 0xFF;
+    if (z->esctab[c] &&
+	    ((z->esctab[c] == 1) || ((z->lastc & 0177) == '@'))) {
+	*d++ = ZDLE;
+	c ^= 0100;
+    }
+    *d++ = z->lastc = c;
+    return(d);
+}
+
+static long long
+zm_getpos(unsigned char *h)
+{
+    return(h[0] | (h[1] << 8) | (h[2] << 16) | ((long long)h[3] << 24));
+}
+
+static void
+zm_setpos(unsigned char *h, long long pos)
+{
+    h[0] = pos & 0xFF;
+    h[1] = (pos >> 8) & 0xFF;
+    h[2] = (pos >> 16) & 0xFF;
+    h[3] = (pos >> 24) & 0xFF;
+}
+
+/*
+ * zm_hexhdr()
+ *	Queue a hex header; these are what the receiver sends
+ */
+static void
+zm_hexhdr(struct zm *z, int type, long long pos)
+{
+    static char hex[] = "0123456789abcdef";
+    unsigned char b[7], *d;
+    unsigned short crc;
+    int x;
+
+    tx_reserve(32);
+    b[0] = type;
+    zm_setpos(b+1, pos);
+    crc = crc16_upd(0, b, 5);
+    b[5] = crc >> 8;
+    b[6] = crc & 0xFF;
+    d = (unsigned char *)txbuf + txlen;
+    *d++ = ZPAD;
+    *d++ = ZPAD;
+    *d++ = ZDLE;
+    *d++ = ZHEX;
+    for (x = 0; x < 7; ++x) {
+	*d++ = hex[b[x] >> 4];
+	*d++ = hex[b[x] & 0xF];
+    }
+    *d++ = '\r';
+    *d++ = '\n' | 0200;
+    if ((type != ZFIN) && (type != ZACK)) {
+	*d++ = 021;		/* XON, in case they got stopped */
+    }
+    txlen = d - (unsigned char *)txbuf;
+}
+
+/*
+ * zm_binhdr()
+ *	Queue a binary header, with CRC-32 if the receiver can take it
+ *
+ * "pos" is the four header bytes, ZP0 (low) to ZP3.
+ */
+static void
+zm_binhdr(struct zm *z, int type, long long pos)
+{
+    unsigned char b[5], *d;
+    unsigned int crc;
+    int x;
+
+    tx_reserve(32);
+    b[0] = type;
+    zm_setpos(b+1, pos);
+    d = (unsigned char *)txbuf + txlen;
+    *d++ = ZPAD;
+    *d++ = ZDLE;
+    *d++ = z->use32 ? ZBIN32 : ZBIN;
+    for (x = 0; x < 5; ++x) {
+	d = zm_put(z, d, b[x]);
+    }
+    if (z->use32) {
+	crc = ~crc32_upd(~0U, b, 5);
+	for (x = 0; x < 4; ++x, crc >>= 8) {
+	    d = zm_put(z, d, crc);
+	}
+    } else {
+	crc = crc16_upd(0, b, 5);
+	d = zm_put(z, d, crc >> 8);
+	d = zm_put(z, d, crc);
+    }
+    txlen = d - (unsigned char *)txbuf;
+}
+
+/*
+ * zm_sdata()
+ *	Queue a data subpacket
+ */
+static void
+zm_sdata(struct zm *z, unsigned char *buf, int len, int fend)
+{
+    unsigned char *d, *end, f = fend;
+    unsigned int crc;
+    int x;
+
+    tx_reserve(2 * len + 16);
+    d = (unsigned char *)txbuf + txlen;
+    for (end = buf + len; buf < end; ++buf) {
+	if (z->esctab[*buf]) {
+	    d = zm_put(z, d, *buf);
+	} else {
+	    *d++ = z->lastc = *buf;
+	}
+    }
+    *d++ = ZDLE;
+    *d++ = fend;
+    if (z->use32) {
+	crc = ~crc32_upd(crc32_upd(~0U, end - len, len), &f, 1);
+	for (x = 0; x < 4; ++x, crc >>= 8) {
+	    d = zm_put(z, d, crc);
+	}
+    } else {
+	crc = crc16_upd(crc16_upd(0, end - len, len), &f, 1);
+	d = zm_put(z, d, crc >> 8);
+	d = zm_put(z, d, crc);
+    }
+    if (fend == ZCRCW) {
+	*d++ = 021;
+    }
+    txlen = d - (unsigned char *)txbuf;
+}
+
+/* Expect a data subpacket for frame "type" next */
+static void
+zm_wantdata(struct zm *z, int type)
+{
+    z->pstate = ZP_DATA;
+    z->dfor = type;
+    z->data32 = (z->kind == ZBIN32);
+    z->plen = 0;
+    z->esc = 0;
+}
+
+/* (Re)start the timeout; the other end said something sensible */
+static void
+zm_heard(struct zm *z)
+{
+    z->retries = 0;
+    ev_timer(&z->x.timer, ZTIMEOUT * 1000000LL);
+}
+
+/*
+ * zm_end()
+ *	Free up a ZMODEM transfer (xfer_finish() calls this)
+ */
+static void
+zm_end(struct xfer *x)
+{
+    struct zm *z = (struct zm *)x;
+
+    if (z->fd >= 0) {
+	close(z->fd);
+    }
+    free(z);
+}
+
+/*
+ * Receiving
+ */
+
+/* Tell the sender what we can do */
+static void
+zr_rinit(struct zm *z)
+{
+    zm_hexhdr(z, ZRINIT, (long long)(CANFDX|CANOVIO|CANFC32) << 24);
+}
+
+/*
+ * zr_rpos()
+ *	Something went wrong; ask for the data again from z->pos
+ *
+ * We ignore everything up to the next header, which should be the
+ * ZDATA restarting at that position.
+ */
+static void
+zr_rpos(struct zm *z)
+{
+    if (++z->errors > ZERRORS) {
+	xfer_cancel("too many errors");
+	return;
+    }
+    if (z->attn[0]) {
+	tx_put(z->attn, strlen(z->attn));
+    }
+    zm_hexhdr(z, ZRPOS, z->pos);
+    z->pstate = ZP_HUNT;
+}
+
+/*
+ * zr_file()
+ *	ZFILE's subpacket: name, then "size mtime mode ..."
+ *
+ * We only ever write into the current directory.  A file we
+ * already have is skipped, unless we're resuming (the sender asked
+ * for ZCRESUM, or we were told to resume) and it's shorter than the
+ * one on offer, in which case we ask for the rest of it.
+ */
+static void
+zr_file(struct zm *z)
+{
+    char *name, *base, *info;
+    long long size = -1, mtime = 0;
+    unsigned int mode = 0;
+    struct stat st;
+    int flags = O_WRONLY|O_CREAT|O_TRUNC;
+    char buf[300];
+
+    z->pkt[z->plen] = '\0';
+    name = (char *)z->pkt;
+    info = name + strlen(name) + 1;
+    if ((info - name) < z->plen) {
+	(void)sscanf(info, "%lld %llo %o", &size, &mtime, &mode);
+    }
+    base = strrchr(name, '/') ? (strrchr(name, '/') + 1) : name;
+    if (!*base || !strcmp(base, ".") || !strcmp(base, "..")) {
+	zm_hexhdr(z, ZSKIP, 0);
+	return;
+    }
+    snprintf(z->name, sizeof(z->name), "%s", base);
+    z->size = size;
+    z->mtime = mtime;
+    z->pos = 0;
+    if (stat(z->name, &st) == 0) {
+	if (!(xfer_resume || (z->zconv == ZCRESUM)) ||
+		!S_ISREG(st.st_mode) || ((size >= 0) && (st.st_size >= size))) {
+	    snprintf(buf, sizeof(buf), "\r\n%s: exists, skipped\r\n", z->name);
+	    write(ttyfd, buf, strlen(buf));
+	    zm_hexhdr(z, ZSKIP, 0);
+	    return;
+	}
+	z->pos = st.st_size;
+	flags = O_WRONLY|O_APPEND;
+    }
+    if ((z->fd = open(z->name, flags, 0666)) < 0) {
+	zm_hexhdr(z, ZFERR, 0);
+	xfer_cancel(strerror(errno));
+	return;
+    }
+    z->phase = ZR_DATA;
+    z->errors = 0;
+    z->x.started = ev_now();
+    zm_hexhdr(z, ZRPOS, z->pos);
+}
+
+/* Done with this file; close it up and say so */
+static void
+zr_close(struct zm *z)
+{
+    struct timeval tv[2];
+    char buf[300];
+
+    close(z->fd);
+    z->fd = -1;
+    if (z->mtime > 0) {
+	tv[0].tv_sec = tv[1].tv_sec = z->mtime;
+	tv[0].tv_usec = tv[1].tv_usec = 0;
+	(void)utimes(z->name, tv);
+    }
+    xfer_progress(&z->x, "received", z->pos, z->pos);
+    snprintf(buf, sizeof(buf), "\r\n%s\r\n", z->name);
+    write(ttyfd, buf, strlen(buf));
+    z->phase = ZR_INIT;
+}
+
+static void
+zr_header(struct zm *z, int type, unsigned char *h)
+{
+    switch (type) {
+    case ZRQINIT:
+	if (z->phase == ZR_INIT) {
+	    zr_rinit(z);
+	}
+	break;
+
+    case ZSINIT:
+	zm_wantdata(z, type);
+	break;
+
+    case ZFILE:
+	z->zconv = h[3];
+	zm_wantdata(z, type);
+	break;
+
+    case ZDATA:
+	if (z->phase != ZR_DATA) {
+	    break;
+	}
+	if (zm_getpos(h) != (z->pos & 0xFFFFFFFFLL)) {
+	    zr_rpos(z);
+	    break;
+	}
+	zm_wantdata(z, type);
+	break;
+
+    /* ZEOF is only real once we have everything up to it */
+    case ZEOF:
+	if ((z->phase == ZR_DATA) &&
+		(zm_getpos(h) == (z->pos & 0xFFFFFFFFLL))) {
+	    zr_close(z);
+	    zr_rinit(z);
+	}
+	break;
+
+    case ZFIN:
+	zm_hexhdr(z, ZFIN, 0);
+	z->phase = ZR_FIN;
+	z->pstate = ZP_OO;
+	ev_timer(&z->x.timer, 1000000LL);
+	break;
+
+    case ZFREECNT:
+	zm_hexhdr(z, ZACK, 0);
+	break;
+
+    /* We don't run commands for the other end */
+    case ZCOMMAND:
+	zm_wantdata(z, type);
+	break;
+
+    case ZCAN:
+    case ZABORT:
+    case ZFERR:
+	xfer_finish("aborted by sender");
+	break;
+    }
+}
+
+static void
+zr_subpacket(struct zm *z, int ok)
+{
+    int fend = z->fend, n;
+
+    if (!ok) {
+	if (z->dfor == ZDATA) {
+	    zr_rpos(z);
+	} else {
+	    zm_hexhdr(z, ZNAK, 0);
+	}
+	return;
+    }
+    switch (z->dfor) {
+    case ZSINIT:
+	n = (z->plen < (int)sizeof(z->attn)) ? z->plen : (int)sizeof(z->attn)-1;
+	memcpy(z->attn, z->pkt, n);
+	z->attn[n] = '\0';
+	zm_hexhdr(z, ZACK, 1);
+	break;
+
+    /* Sender didn't hear our ZRPOS; say it again */
+    case ZFILE:
+	if (z->phase == ZR_DATA) {
+	    zm_hexhdr(z, ZRPOS, z->pos);
+	    break;
+	}
+	zr_file(z);
+	break;
+
+    case ZCOMMAND:
+	zm_hexhdr(z, ZCOMPL, 1);
+	break;
+
+    case ZDATA:
+	if (write(z->fd, z->pkt, z->plen) != z->plen) {
+	    zm_hexhdr(z, ZFERR, 0);
+	    xfer_cancel(strerror(errno));
+	    return;
+	}
+	z->pos += z->plen;
+	z->errors = 0;
+	xfer_progress(&z->x, z->name, z->pos, z->size);
+	if ((fend == ZCRCQ) || (fend == ZCRCW)) {
+	    zm_hexhdr(z, ZACK, z->pos);
+	}
+	if ((fend == ZCRCG) || (fend == ZCRCQ)) {
+	    zm_wantdata(z, ZDATA);
+	}
+	break;
+    }
+}
+
+/*
+ * Sending
+ */
+
+/* Offer the file: ZFILE, then name and particulars */
+static void
+zs_file(struct zm *z)
+{
+    char *base;
+    int len;
+    struct stat st;
+
+    fstat(z->fd, &st);
+    base = strrchr(z->name, '/') ? (strrchr(z->name, '/') + 1) : z->name;
+    len = snprintf((char *)z->buf, sizeof(z->buf), "%s", base) + 1;
+    len += snprintf((char *)z->buf + len, sizeof(z->buf) - len,
+	"%lld %llo %o 0 1 %lld", z->size, (long long)st.st_mtime,
+	(unsigned int)st.st_mode, z->size) + 1;
+    zm_binhdr(z, ZFILE, (long long)(xfer_resume ? ZCRESUM : ZCBIN) << 24);
+    zm_sdata(z, z->buf, len, ZCRCW);
+    z->phase = ZS_FILE;
+}
+
+/*
+ * zs_seek()
+ *	Receiver wants data from "pos" on
+ *
+ * Anything still queued is past the point of interest, so it's
+ * thrown away.  Repeated trouble means a noisy line, where smaller
+ * subpackets waste less on each retry.
+ */
+static void
+zs_seek(struct zm *z, long long pos)
+{
+    /* ZRPOS brings only 32 bits; take the nearest match */
+    pos |= (z->pos & ~0xFFFFFFFFLL);
+    if (((pos - z->pos) > 0x80000000LL) && (pos >= 0x100000000LL)) {
+	pos -= 0x100000000LL;
+    } else if ((z->pos - pos) > 0x80000000LL) {
+	pos += 0x100000000LL;
+    }
+    if ((pos < 0) || ((z->size >= 0) && (pos > z->size)) ||
+	    (lseek(z->fd, pos, SEEK_SET) < 0)) {
+	xfer_cancel("bad position from receiver");
+	return;
+    }
+    if ((z->phase == ZS_DATA) || (z->phase == ZS_WAIT) || (z->phase == ZS_EOF)) {
+	txoff = txlen = 0;
+	(void)tcflush(rs232, TCOFLUSH);
+	if (++z->errors > ZERRORS) {
+	    xfer_cancel("too many errors");
+	    return;
+	}
+	if (z->blk > 256) {
+	    z->blk /= 2;
+	}
+    }
+    z->pos = z->acked = pos;
+    zm_binhdr(z, ZDATA, pos);
+    z->phase = ZS_DATA;
+}
+
+static void
+zs_header(struct zm *z, int type, unsigned char *h)
+{
+    unsigned int crc;
+    long long left;
+    int n;
+
+    switch (type) {
+    case ZRINIT:
+	z->use32 = (h[3] & CANFC32) != 0;
+	z->escctl = (h[3] & ESCCTL) != 0;
+	z->rxlimit = h[0] | (h[1] << 8);
+	zm_setesc(z);
+	if ((z->phase == ZS_INIT) || (z->phase == ZS_FILE)) {
+	    zs_file(z);
+	} else if (z->phase == ZS_EOF) {
+	    xfer_progress(&z->x, "sent", z->pos, z->size);
+	    z->phase = ZS_FIN;
+	    zm_hexhdr(z, ZFIN, 0);
+	} else if (z->phase == ZS_FIN) {
+	    zm_hexhdr(z, ZFIN, 0);
+	}
+	break;
+
+    case ZRPOS:
+	if ((z->phase != ZS_INIT) && (z->phase != ZS_FIN)) {
+	    zs_seek(z, zm_getpos(h));
+	}
+	break;
+
+    case ZACK:
+	if ((z->phase == ZS_DATA) || (z->phase == ZS_WAIT)) {
+	    z->acked = z->pos - ((z->pos - zm_getpos(h)) & 0xFFFFFFFFLL);
+	    z->errors = 0;
+	    z->phase = ZS_DATA;
+	}
+	break;
+
+    case ZSKIP:
+	write(ttyfd, "\r\nskipped by receiver", 21);
+	z->phase = ZS_FIN;
+	zm_hexhdr(z, ZFIN, 0);
+	break;
+
+    /* The receiver would like a CRC of (the start of) the file */
+    case ZCRC:
+	left = zm_getpos(h);
+	crc = ~0U;
+	(void)lseek(z->fd, 0, SEEK_SET);
+	while ((n = read(z->fd, z->buf, sizeof(z->buf))) > 0) {
+	    if (left && (n >= left)) {
+		crc = crc32_upd(crc, z->buf, left);
+		break;
+	    }
+	    crc = crc32_upd(crc, z->buf, n);
+	    left -= left ? n : 0;
+	}
+	zm_binhdr(z, ZCRC, ~crc);
+	break;
+
+    case ZCHALLENGE:
+	zm_hexhdr(z, ZACK, zm_getpos(h));
+	break;
+
+    case ZNAK:
+	if (z->phase == ZS_INIT) {
+	    zm_hexhdr(z, ZRQINIT, 0);
+	} else if (z->phase == ZS_FILE) {
+	    zs_file(z);
+	} else if (z->phase == ZS_EOF) {
+	    zm_binhdr(z, ZEOF, z->pos);
+	}
+	break;
+
+    case ZFIN:
+	if (z->phase == ZS_FIN) {
+	    tx_put("OO", 2);
+	    xfer_done("done");
+	}
+	break;
+
+    case ZCAN:
+    case ZABORT:
+    case ZFERR:
+	xfer_finish("aborted by receiver");
+	break;
+    }
+}
+
+/*
+ * zs_pump()
+ *	Stream the file while there's room in the transmit queue
+ *
+ * The last subpacket ends the frame (ZCRCE) and ZEOF follows.  If
+ * the receiver has a limited buffer we stop with a ZCRCW when it's
+ * full and wait for its ZACK.
+ */
+static void
+zs_pump(struct xfer *x)
+{
+    struct zm *z = (struct zm *)x;
+    int n, want, fend;
+
+    while ((z->phase == ZS_DATA) && (tx_room() >= (2 * z->blk + 64))) {
+	want = z->blk;
+	if (z->rxlimit && ((z->rxlimit - (z->pos - z->acked)) < want)) {
+	    want = z->rxlimit - (z->pos - z->acked);
+	}
+	if ((n = read(z->fd, z->buf, want)) < 0) {
+	    zm_binhdr(z, ZFERR, 0);
+	    xfer_cancel(strerror(errno));
+	    return;
+	}
+	z->pos += n;
+	if ((n == 0) || ((z->size >= 0) && (z->pos >= z->size))) {
+	    zm_sdata(z, z->buf, n, ZCRCE);
+	    zm_binhdr(z, ZEOF, z->pos);
+	    z->phase = ZS_EOF;
+	} else {
+	    fend = ZCRCG;
+	    if (z->rxlimit && ((z->pos - z->acked) >= z->rxlimit)) {
+		fend = ZCRCW;
+		z->phase = ZS_WAIT;
+	    }
+	    zm_sdata(z, z->buf, n, fend);
+	}
+	xfer_progress(x, z->name, z->pos, z->size);
+	zm_heard(z);
+    }
+}
+
+/*
+ * zm_timeout()
+ *	Nothing heard for a while; say it again
+ */
+static void
+zm_timeout(struct evtimer *t)
+{
+    struct zm *z = (struct zm *)t;
+
+    if (!z->sending && (z->phase == ZR_FIN)) {
+	xfer_done("done");
+	return;
+    }
+    if (++z->retries > ZRETRIES) {
+	xfer_cancel("timed out");
+	return;
+    }
+    ev_timer(t, ZTIMEOUT * 1000000LL);
+    if (!z->sending) {
+	if (z->phase == ZR_INIT) {
+	    zr_rinit(z);
+	} else {
+	    zr_rpos(z);
+	}
+    } else switch (z->phase) {
+    case ZS_INIT:
+	zm_hexhdr(z, ZRQINIT, 0);
+	break;
+    case ZS_FILE:
+	zs_file(z);
+	break;
+    case ZS_WAIT:
+	zs_seek(z, z->acked);
+	break;
+    case ZS_EOF:
+	zm_binhdr(z, ZEOF, z->pos);
+	break;
+    case ZS_FIN:
+	zm_hexhdr(z, ZFIN, 0);
+	break;
+    }
+    tx_flush();
+}
+
+/*
+ * zm_gothdr()
+ *	A complete header; check it and pass it on
+ */
+static void
+zm_gothdr(struct zm *z)
+{
+    int ok;
+
+    if (z->kind == ZBIN32) {
+	ok = (crc32_upd(~0U, z->hdr, 9) == 0xDEBB20E3);
+    } else {
+	ok = (crc16_upd(0, z->hdr, 7) == 0);
+    }
+    z->pstate = ZP_HUNT;
+    if (!ok) {
+	if (!z->sending && (z->phase == ZR_DATA)) {
+	    zr_rpos(z);
+	}
+	return;
+    }
+    zm_heard(z);
+    if (z->sending) {
+	zs_header(z, z->hdr[0], z->hdr + 1);
+    } else {
+	zr_header(z, z->hdr[0], z->hdr + 1);
+    }
+}
+
+/*
+ * zm_unesc()
+ *	Undo ZDLE escaping, one byte at a time
+ *
+ * Returns the byte, 0x100 plus the code for a subpacket end, -1 if
+ * there's nothing yet, or -2 for nonsense.  Bare XON/XOFF are
+ * flow control picked up along the way, never data.
+ */
+static int
+zm_unesc(struct zm *z, int c)
+{
+    if ((c & 0177) == 021 || (c & 0177) == 023) {
+	return(-1);
+    }
+    if (!z->esc) {
+	if (c == ZDLE) {
+	    z->esc = 1;
+	    return(-1);
+	}
+	return(c);
+    }
+    if (c == ZDLE) {
+	return(-1);
+    }
+    z->esc = 0;
+    if ((c >= ZCRCE) && (c <= ZCRCW)) {
+	return(0x100 | c);
+    }
+    if (c == ZRUB0) {
+	return(0177);
+    }
+    if (c == ZRUB1) {
+	return(0377);
+    }
+    if ((c & 0140) == 0100) {
+	return(c ^ 0100);
+    }
+    return(-2);
+}
+
+static int
+zm_hexval(int c)
+{
+    if ((c >= '0') && (c <= '9')) {
+	return(c - '0');
+    }
+    if ((c >= 'a') && (c <= 'f')) {
+	return(c - 'a' + 10);
+    }
+    return(-1);
+}
+
+/*
+ * zm_input()
+ *	Received data, in whatever pieces it arrives
+ *
+ * Anything we call may finish the transfer, which frees "z"; so
+ * after each one make sure we're still the one running.
+ */
+static void
+zm_input(struct xfer *x, unsigned char *buf, int len)
+{
+    struct zm *z = (struct zm *)x;
+    unsigned char *p = buf, *end = buf + len;
+    int c, v;
+
+    while (p < end) {
+	/*
+	 * The bulk of a data subpacket needs nothing done to it;
+	 * take runs of that straight across.
+	 */
+	if ((z->pstate == ZP_DATA) && !z->esc) {
+	    while ((p < end) && (z->plen < ZMAXBLK) &&
+		    !z->esctab[*p] && (*p != ZDLE)) {
+		z->pkt[z->plen++] = *p++;
+	    }
+	    if (p == end) {
+		break;
+	    }
+	}
+	c = *p++;
+
+	/* Five CANs in a row is the other end giving up */
+	if (c == ZDLE) {
+	    if (++z->cans >= 5) {
+		xfer_finish("cancelled by remote");
+		return;
+	    }
+	} else {
+	    z->cans = 0;
+	}
+
+	switch (z->pstate) {
+	case ZP_HUNT:
+	    if ((c & 0177) == ZPAD) {
+		z->pstate = ZP_PAD;
+	    }
+	    break;
+
+	case ZP_PAD:
+	    if ((c & 0177) != ZPAD) {
+		z->pstate = (c == ZDLE) ? ZP_KIND : ZP_HUNT;
+	    }
+	    break;
+
+	case ZP_KIND:
+	    z->kind = c & 0177;
+	    z->hlen = 0;
+	    z->esc = 0;
+	    if ((z->kind == ZBIN) || (z->kind == ZBIN32)) {
+		z->hneed = (z->kind == ZBIN32) ? 9 : 7;
+		z->pstate = ZP_BHDR;
+	    } else if (z->kind == ZHEX) {
+		z->hneed = 14;
+		z->pstate = ZP_HHDR;
+	    } else {
+		z->pstate = (z->kind == ZPAD) ? ZP_PAD : ZP_HUNT;
+	    }
+	    break;
+
+	case ZP_BHDR:
+	    if ((v = zm_unesc(z, c)) == -1) {
+		break;
+	    }
+	    if ((v < 0) || (v & 0x100)) {
+		z->pstate = ZP_HUNT;
+		break;
+	    }
+	    z->hdr[z->hlen++] = v;
+	    if (z->hlen == z->hneed) {
+		zm_gothdr(z);
+	    }
+	    break;
+
+	case ZP_HHDR:
+	    c &= 0177;
+	    if ((c == 021) || (c == 023)) {
+		break;
+	    }
+	    if ((v = zm_hexval(c)) < 0) {
+		z->pstate = ZP_HUNT;
+		break;
+	    }
+	    if (z->hlen & 1) {
+		z->hdr[z->hlen >> 1] |= v;
+	    } else {
+		z->hdr[z->hlen >> 1] = v << 4;
+	    }
+	    if (++z->hlen == z->hneed) {
+		zm_gothdr(z);
+	    }
+	    break;
+
+	case ZP_DATA:
+	    if ((v = zm_unesc(z, c)) == -1) {
+		break;
+	    }
+	    if ((v == -2) || (z->plen >= ZMAXBLK)) {
+		bad:
+		z->pstate = ZP_HUNT;
+		if (z->sending) {
+		    break;
+		}
+		if (z->dfor == ZDATA) {
+		    zr_rpos(z);
+		}
+		break;
+	    }
+	    if (v & 0x100) {
+		z->fend = v & 0xFF;
+		z->hlen = 0;
+		z->hneed = z->data32 ? 4 : 2;
+		z->pstate = ZP_DCRC;
+		break;
+	    }
+	    z->pkt[z->plen++] = v;
+	    break;
+
+	case ZP_DCRC:
+	    if ((v = zm_unesc(z, c)) == -1) {
+		break;
+	    }
+	    if ((v < 0) || (v & 0x100)) {
+		goto bad;
+	    }
+	    z->hdr[z->hlen++] = v;
+	    if (z->hlen == z->hneed) {
+		unsigned char f = z->fend;
+		int ok;
+
+		if (z->data32) {
+		    ok = (crc32_upd(crc32_upd(crc32_upd(~0U, z->pkt, z->plen),
+			&f, 1), z->hdr, 4) == 0xDEBB20E3);
+		} else {
+		    ok = (crc16_upd(crc16_upd(crc16_upd(0, z->pkt, z->plen),
+			&f, 1), z->hdr, 2) == 0);
+		}
+		z->pstate = ZP_HUNT;
+		if (ok) {
+		    zm_heard(z);
+		}
+		if (!z->sending) {
+		    zr_subpacket(z, ok);
+		}
+	    }
+	    break;
+
+	case ZP_OO:
+	    if ((c == 'O') && (++z->oos == 2)) {
+		xfer_done("done");
+		xfer_rest = end - p;
+		return;
+	    }
+	    break;
+	}
+	if (xfer != x) {
+	    xfer_rest = end - p;
+	    return;
+	}
+    }
+    tx_flush();
+}
+
+/*
+ * zm_new()
+ *	Set up a ZMODEM transfer, either direction
+ */
+static struct zm *
+zm_new(int sending)
+{
+    struct zm *z;
+
+    crc_init();
+    if ((z = calloc(1, sizeof(struct zm))) == NULL) {
+	write(ttyfd, "No memory for transfer\r\n", 24);
+	return(NULL);
+    }
+    z->x.timer.handler = zm_timeout;
+    z->x.proto = "ZMODEM";
+    z->x.input = zm_input;
+    z->x.pump = sending ? zs_pump : NULL;
+    z->x.key = xfer_stopkey;
+    z->x.end = zm_end;
+    z->sending = sending;
+    z->fd = -1;
+    z->size = -1;
+    z->blk = xfer_blk ? xfer_blk : ZMAXBLK;
+    zm_setesc(z);
+    return(z);
+}
+
+/*
+ * zm_send()
+ *	Send a file; "rz\r" first, to start a receiver if there's a
+ *	shell at the other end
+ */
+static void
+zm_send(char *fname)
+{
+    struct zm *z;
+    struct stat st;
+    int fd;
+
+    if (((fd = open(fname, O_RDONLY)) < 0) || (fstat(fd, &st) < 0)) {
+	fprintf(stderr, "%s: %s\r\n", fname, strerror(errno));
+	if (fd >= 0) {
+	    close(fd);
+	}
+	return;
+    }
+    if ((z = zm_new(1)) == NULL) {
+	close(fd);
+	return;
+    }
+    z->fd = fd;
+    z->size = S_ISREG(st.st_mode) ? st.st_size : -1;
+    snprintf(z->name, sizeof(z->name), "%s", fname);
+    tx_put("rz\r", 3);
+    zm_hexhdr(z, ZRQINIT, 0);
+    z->phase = ZS_INIT;
+    zm_heard(z);
+    xfer_begin(&z->x);
+}
+
+/*
+ * zm_recv()
+ *	Receive whatever the other end sends
+ */
+static void
+zm_recv(void)
+{
+    struct zm *z;
+
+    if ((z = zm_new(0)) == NULL) {
+	return;
+    }
+    zr_rinit(z);
+    z->phase = ZR_INIT;
+    zm_heard(z);
+    xfer_begin(&z->x);
+}
+
+/*
+ * XMODEM and YMODEM
+ *
+ * We send 1K blocks with CRC-16 whenever the receiver asks for CRCs
+ * (128-byte blocks and checksums for those that don't), and read
+ * each block from the file while the one before it is on the wire
+ * or waiting to be acknowledged.  If a YMODEM receiver asks with a
+ * 'G' we stream (YMODEM-G): no acknowledgements, and any error
+ * ends the transfer.  We only ask for that ourselves when told to
+ * (-p y,stream), since it can't recover from line noise.
+ */
+#define SOH (001)		/* 128-byte block */
+#define STX (002)		/* 1K block */
+#define EOT (004)
+#define ACK (006)
+#define NAK (025)
+#define CAN (030)
+#define CPMEOF (032)		/* Padding */
+
+#define XTIMEOUT (10)		/* Seconds without a response */
+#define XSTART (60)		/*  ...for the other end to get going */
+#define XRETRIES (10)
+#define XPURGE (200000)		/* usec of quiet after a bad block */
+
+#define XS_START (0)		/* Sender: waiting for 'C', 'G' or NAK */
+#define XS_HDR (1)		/*  ...sent YMODEM block 0 */
+#define XS_DATA (2)		/*  ...sending data */
+#define XS_EOT (3)		/*  ...sent EOT */
+#define XS_END (4)		/*  ...waiting to send the empty block 0 */
+#define XS_FIN (5)		/*  ...sent it */
+#define XR_START (0)		/* Receiver: waiting for block 0 or 1 */
+#define XR_DATA (1)		/*  ...taking data */
+
+#define XP_HUNT (0)		/* Receive parser: want SOH/STX/EOT/CAN */
+#define XP_BLOCK (1)		/*  ...in a block */
+#define XP_PURGE (2)		/*  ...skipping to quiet, then NAK */
+
+struct xblk {
+    int len;			/* Bytes on the wire, 0 for none */
+    int data;			/*  ...of which file data */
+    unsigned char buf[1029];
+};
+
+struct xm {
+    struct xfer x;		/* Must be first */
+    int sending, ymodem;
+    int phase;			/* XS_* or XR_* */
+    int crc;			/* CRC-16, not checksum */
+    int stream;			/* YMODEM-G */
+    int retries;
+    int cans;
+    unsigned char seq;		/* Block to send/expect next */
+
+    /* Receive parser */
+    int pstate;			/* XP_* */
+    int need, have;
+    unsigned char pkt[1029];
+
+    /* Sending: block on the wire, and the one read ahead of it */
+    struct xblk *cur, *next;
+    struct xblk blk[2];
+
+    int fd;
+    char name[256];
+    long long size;		/* -1 if not known */
+    long long pos;		/* Acknowledged (sent), or written */
+    long long mtime;
+};
+
+/* Put "c" on the wire as is */
+static void
+xm_putc(int c)
+{
+    char ch = c;
+
+    tx_put(&ch, 1);
+}
+
+/*
+ * xm_frame()
+ *	Number and checksum a block in place
+ *
+ * b->buf[3] on holds "size" bytes of data.
+ */
+static void
+xm_frame(struct xm *x, struct xblk *b, int seq, int size)
+{
+    unsigned short crc;
+    unsigned char *p = b->buf + 3;
+    int i, sum;
+
+    b->buf[0] = (size == 1024) ? STX : SOH;
+    b->buf[1] = seq;
+    b->buf[2] = ~seq;
+    if (x->crc) {
+	crc = crc16_upd(0, p, size);
+	p[size] = crc >> 8;
+	p[size+1] = crc & 0xFF;
+	b->len = size + 5;
+    } else {
+	for (i = sum = 0; i < size; ++i) {
+	    sum += p[i];
+	}
+	p[size] = sum & 0xFF;
+	b->len = size + 4;
+    }
+}
+
+/*
+ * xs_read()
+ *	Read the next block of the file into "b"
+ *
+ * A short final block goes as a 128-byte one when it fits, as does
+ * everything for a receiver which only does checksums (they're
+ * usually too old for 1K), or if asked for with -p ,block=128.
+ */
+static int
+xs_read(struct xm *x, struct xblk *b)
+{
+    int size, n, got;
+
+    size = (x->crc && (!xfer_blk || (xfer_blk >= 1024))) ? 1024 : 128;
+    for (got = 0; got < size; got += n) {
+	if ((n = read(x->fd, b->buf + 3 + got, size - got)) < 0) {
+	    return(-1);
+	}
+	if (n == 0) {
+	    break;
+	}
+    }
+    b->data = got;
+    if (got == 0) {
+	b->len = 0;
+	return(0);
+    }
+    if (got <= 128) {
+	size = 128;
+    }
+    memset(b->buf + 3 + got, CPMEOF, size - got);
+    xm_frame(x, b, x->seq++, size);
+    return(got);
+}
+
+/* Queue the current block (or EOT), and read ahead the next one */
+static void
+xs_block(struct xm *x)
+{
+    if (x->cur->len == 0) {
+	xm_putc(EOT);
+	x->phase = XS_EOT;
+	return;
+    }
+    tx_put((char *)x->cur->buf, x->cur->len);
+    if ((x->next->data < 0) && (xs_read(x, x->next) < 0)) {
+	xfer_cancel(strerror(errno));
+    }
+}
+
+/* The current block is done with; move on to the next */
+static void
+xs_advance(struct xm *x)
+{
+    struct xblk *b = x->cur;
+
+    x->pos += b->data;
+    xfer_progress(&x->x, x->name, x->pos, x->size);
+    x->cur = x->next;
+    x->next = b;
+    b->len = 0;
+    b->data = -1;		/* Not read yet */
+}
+
+/* The receiver's ready; YMODEM starts with block 0, the file details */
+static void
+xs_begin(struct xm *x)
+{
+    struct xblk *b = x->cur;
+    struct stat st;
+    char *base;
+    int len;
+
+    if (x->ymodem && (x->phase == XS_START)) {
+	fstat(x->fd, &st);
+	base = strrchr(x->name, '/') ? (strrchr(x->name, '/') + 1) : x->name;
+	memset(b->buf + 3, 0, 1024);
+	len = snprintf((char *)b->buf + 3, 1024, "%s", base) + 1;
+	snprintf((char *)b->buf + 3 + len, 1024 - len, "%lld %llo %o 0",
+	    x->size, (long long)st.st_mtime, (unsigned int)st.st_mode & 07777);
+	len += strlen((char *)b->buf + 3 + len);
+	b->data = 0;
+	xm_frame(x, b, 0, (len < 128) ? 128 : 1024);
+	tx_put((char *)b->buf, b->len);
+	x->phase = XS_HDR;
+	return;
+    }
+    if (xs_read(x, x->cur) < 0) {
+	xfer_cancel(strerror(errno));
+	return;
+    }
+    x->next->data = -1;
+    x->phase = XS_DATA;
+    x->x.started = ev_now();
+    if (!x->stream) {
+	xs_block(x);
+    }
+}
+
+/*
+ * xs_pump()
+ *	YMODEM-G: keep the queue full of blocks; nobody ACKs them
+ */
+static void
+xs_pump(struct xfer *xp)
+{
+    struct xm *x = (struct xm *)xp;
+
+    while (x->stream && (x->phase == XS_DATA) && (tx_room() >= 1029)) {
+	if ((x->next->data < 0) && (xs_read(x, x->next) < 0)) {
+	    xfer_cancel(strerror(errno));
+	    return;
+	}
+	if (x->cur->len == 0) {
+	    xm_putc(EOT);
+	    x->phase = XS_EOT;
+	    break;
+	}
+	tx_put((char *)x->cur->buf, x->cur->len);
+	xs_advance(x);
+	ev_timer(&x->x.timer, XTIMEOUT * 1000000LL);
+    }
+}
+
+static void
+xs_input(struct xm *x, int c)
+{
+    switch (x->phase) {
+    case XS_START:
+	if ((c == 'C') || (c == NAK) || ((c == 'G') && x->ymodem)) {
+	    x->crc = (c != NAK);
+	    x->stream = (c == 'G');
+	    xs_begin(x);
+	}
+	break;
+
+    /* ACK, then 'C' or 'G' again; a 'G' receiver may skip the ACK */
+    case XS_HDR:
+	if (c == NAK) {
+	    tx_put((char *)x->cur->buf, x->cur->len);
+	} else if ((c == 'C') || (c == 'G')) {
+	    x->stream = (c == 'G');
+	    xs_begin(x);
+	}
+	break;
+
+    case XS_DATA:
+	if (x->stream) {
+	    break;
+	}
+	if (c == ACK) {
+	    xs_advance(x);
+	    x->retries = 0;
+	    xs_block(x);
+	} else if (c == NAK) {
+	    xs_block(x);
+	}
+	break;
+
+    case XS_EOT:
+	if (c == NAK) {
+	    xm_putc(EOT);
+	} else if (c == ACK) {
+	    if (!x->ymodem) {
+		xfer_done("done");
+		return;
+	    }
+	    x->phase = XS_END;
+	}
+	break;
+
+    /* The empty block 0 which ends a YMODEM batch */
+    case XS_END:
+	if ((c == 'C') || (c == 'G')) {
+	    x->crc = 1;
+	    memset(x->cur->buf + 3, 0, 128);
+	    xm_frame(x, x->cur, 0, 128);
+	    tx_put((char *)x->cur->buf, x->cur->len);
+	    x->phase = XS_FIN;
+	}
+	break;
+
+    case XS_FIN:
+	if (c == ACK) {
+	    xfer_done("done");
+	    return;
+	}
+	if (c == NAK) {
+	    tx_put((char *)x->cur->buf, x->cur->len);
+	}
+	break;
+    }
+    ev_timer(&x->x.timer, XTIMEOUT * 1000000LL);
+}
+
+/*
+ * Receiving
+ */
+
+/* Ask for (more) blocks: 'G' to stream, 'C' for CRCs, NAK checksums */
+static void
+xr_ask(struct xm *x)
+{
+    xm_putc(x->stream ? 'G' : (x->crc ? 'C' : NAK));
+}
+
+/*
+ * xr_header()
+ *	YMODEM block 0: name, then "size mtime mode ..."
+ *
+ * As with ZMODEM, only into the current directory, and we don't
+ * overwrite anything.
+ */
+static void
+xr_header(struct xm *x, int len)
+{
+    char *name = (char *)x->pkt + 2, *base, buf[300];
+    long long size = -1, mtime = 0;
+
+    if (!*name) {
+	xm_putc(ACK);
+	xfer_done("done");
+	return;
+    }
+    name[len - 1] = '\0';
+    (void)sscanf(name + strlen(name) + 1, "%lld %llo", &size, &mtime);
+    base = strrchr(name, '/') ? (strrchr(name, '/') + 1) : name;
+    if (!*base || !strcmp(base, ".") || !strcmp(base, "..")) {
+	xfer_cancel("bad file name from sender");
+	return;
+    }
+    snprintf(x->name, sizeof(x->name), "%s", base);
+    if ((x->fd = open(x->name, O_WRONLY|O_CREAT|O_EXCL, 0666)) < 0) {
+	snprintf(buf, sizeof(buf), "%s: %s", x->name, strerror(errno));
+	xfer_cancel(buf);
+	return;
+    }
+    x->size = size;
+    x->mtime = mtime;
+    x->pos = 0;
+    x->seq = 1;
+    x->phase = XR_DATA;
+    x->x.started = ev_now();
+    xm_putc(ACK);
+    xr_ask(x);
+}
 
-	/* Set even parity */
-	case 'e':
-	    if (parodd) {
-		bad_parity();
-	    }
-	    pareven = 1;
-	    break;
+/* EOT; done with this file */
+static void
+xr_close(struct xm *x)
+{
+    struct timeval tv[2];
+    char buf[300];
 
-	/* Set seven bit format (else 8) */
-	case '7':
-	    seven_bits = 1;
-	    break;
+    xm_putc(ACK);
+    close(x->fd);
+    x->fd = -1;
+    if (x->mtime > 0) {
+	tv[0].tv_sec = tv[1].tv_sec = x->mtime;
+	tv[0].tv_usec = tv[1].tv_usec = 0;
+	(void)utimes(x->name, tv);
+    }
+    xfer_progress(&x->x, "received", x->pos, x->pos);
+    if (!x->ymodem) {
+	xfer_done("done");
+	return;
+    }
+    snprintf(buf, sizeof(buf), "\r\n%s\r\n", x->name);
+    write(ttyfd, buf, strlen(buf));
 
-	/* Raw keyboard */
-	case 'r':
-	    raw_kbd = 1;
-	    break;
+    /* On to the next file, or the empty block 0 ending the batch */
+    x->phase = XR_START;
+    x->seq = 0;
+    xr_ask(x);
+}
 
-	default:
-	    printf("Illegal option: %c\n", x);
-	    usage();
+/*
+ * xr_block()
+ *	A whole block; check it, then take it or ask again
+ */
+static void
+xr_block(struct xm *x)
+{
+    unsigned char *p = x->pkt + 2;
+    int size = x->need - 2 - (x->crc ? 2 : 1), i, sum, n;
+
+    if (x->crc) {
+	i = (crc16_upd(0, p, size + 2) == 0);
+    } else {
+	for (i = sum = 0; i < size; ++i) {
+	    sum += p[i];
+	}
+	i = ((sum & 0xFF) == p[size]);
+    }
+    if (!i || (x->pkt[0] != (unsigned char)~x->pkt[1])) {
+	if (x->stream) {
+	    xfer_cancel("error while streaming");
+	    return;
 	}
+	x->pstate = XP_PURGE;
+	ev_timer(&x->x.timer, XPURGE);
+	return;
     }
+    x->retries = 0;
 
-    /* Trailing argument; terminal device */
-    if (optind < argc) {
-        tty = argv[optind++];
+    /* Our ACK got lost, and this is the last one again */
+    if ((x->pkt[0] == (unsigned char)(x->seq - 1)) && (x->phase == XR_DATA)) {
+	xm_putc(ACK);
+	return;
     }
-    if (optind != argc) {
-        printf("Trailing argument(s)\n");
-        usage();
+    if (x->pkt[0] != x->seq) {
+	xfer_cancel("blocks out of sequence");
+	return;
     }
+    if (x->ymodem && (x->phase == XR_START)) {
+	xr_header(x, size);
+	return;
+    }
+    x->phase = XR_DATA;
 
-    printf("Terminal starting up...\n");
-    printf("Use ^Z-q (control-Z, followed by q) to quit.\n");
-
-    /*
-     * The next bit of code makes assumptions about
-     *  how UNIX manages its file descriptors.  The goal
-     *  is to make the terminal device be our standard
-     *  input & output.
-     */
-    ttyfd = dup(1);
-    close(0); 
-    close(1);
-    if ((rs232 = open(tty, O_RDWR|O_EXCL|O_NDELAY)) < 0) {
-	perror(tty);
-	exit(1);
+    /* YMODEM tells us the size, so we can drop the padding */
+    n = size;
+    if ((x->size >= 0) && ((x->size - x->pos) < n)) {
+	n = x->size - x->pos;
     }
-    dup(rs232);
+    if ((n > 0) && (write(x->fd, p, n) != n)) {
+	xfer_cancel(strerror(errno));
+	return;
+    }
+    x->pos += n;
+    x->seq += 1;
+    xfer_progress(&x->x, x->name, x->pos, x->size);
+    if (!x->stream) {
+	xm_putc(ACK);
+    }
+}
 
-    /*
-     * Set up for raw TTY I/O
-     */
-    tcgetattr(ttyfd, &otty);
-    ntty = otty;
-    ntty.c_lflag &= ~(ECHO|ICANON|ISIG);
-    ntty.c_oflag &= ~OPOST;
-    ntty.c_iflag = 0;
-    ntty.c_cc[VMIN] = 1;
-    ntty.c_cc[VTIME] = 0;
-    tcsetattr(ttyfd, TCSAFLUSH, &ntty);
+static void
+xm_input(struct xfer *xp, unsigned char *buf, int len)
+{
+    struct xm *x = (struct xm *)xp;
+    unsigned char *end = buf + len;
+    int c, n;
+
+    while (buf < end) {
+	if (x->pstate == XP_BLOCK) {
+	    n = end - buf;
+	    if (n > (x->need - x->have)) {
+		n = x->need - x->have;
+	    }
+	    memcpy(x->pkt + x->have, buf, n);
+	    buf += n;
+	    if ((x->have += n) == x->need) {
+		x->pstate = XP_HUNT;
+		xr_block(x);
+	    }
+	} else if (x->pstate == XP_PURGE) {
+	    ev_timer(&x->x.timer, XPURGE);
+	    break;
+	} else {
+	    c = *buf++;
 
-    setup_serial(rs232);
+	    /* Two CANs in a row means they've given up */
+	    if (c == CAN) {
+		if (++x->cans >= 2) {
+		    xfer_finish("cancelled by remote");
+		    return;
+		}
+		continue;
+	    }
+	    x->cans = 0;
+	    if (x->sending) {
+		xs_input(x, c);
+	    } else if ((c == SOH) || (c == STX)) {
+		x->need = ((c == STX) ? 1024 : 128) + 2 + (x->crc ? 2 : 1);
+		x->have = 0;
+		x->pstate = XP_BLOCK;
+		ev_timer(&x->x.timer, XTIMEOUT * 1000000LL);
+	    } else if ((c == EOT) && (x->phase == XR_DATA)) {
+		xr_close(x);
+	    } else if (x->stream && (x->phase == XR_DATA)) {
+		/* Should have been the next block; we've lost our place */
+		xfer_cancel("error while streaming");
+		return;
+	    }
+	}
+	if (xfer != xp) {
+	    xfer_rest = end - buf;
+	    return;
+	}
+    }
+    tx_flush();
+}
 
-    if ((child = fork()) == 0) {
-	static char boot_msg[] = "Term ready.\r\n";
+/*
+ * xm_timeout()
+ *	Nothing heard for a while (or, purging, line's gone quiet)
+ */
+static void
+xm_timeout(struct evtimer *t)
+{
+    struct xm *x = (struct xm *)t;
 
+    if (!x->sending && (x->pstate == XP_PURGE)) {
+	x->pstate = XP_HUNT;
+	xm_putc(NAK);
+	ev_timer(t, XTIMEOUT * 1000000LL);
+	tx_flush();
+	return;
+    }
+    if (x->sending ? ((x->phase == XS_START) || (++x->retries > XRETRIES)) :
+	    (++x->retries > ((x->phase == XR_START) ? (XSTART / 3) : XRETRIES))) {
+	if (x->sending && (x->phase == XS_FIN)) {
+	    xfer_done("done");
+	} else {
+	    xfer_cancel("timed out");
+	}
+	return;
+    }
+    if (!x->sending) {
 	/*
-	 * This is the code which posts reads to the serial port
-	 * and then writes them on to the user (and, if -l was
-	 * used, to the log file too)
+	 * Ask every few seconds to start with; after a few tries
+	 * without an answer, maybe the sender only does checksums
+	 * (XMODEM) or can't stream (YMODEM).
 	 */
-	signal(SIGUSR1, usr1);
-	signal(SIGUSR2, usr2);
-	signal(SIGTERM, do_term);
-	write(ttyfd, boot_msg, sizeof(boot_msg)-1);
-	for (;;) {
-	    char *p, *q, buf[BUFSIZE];
-
-	    if ((x = read(rs232, buf, sizeof(buf))) < 0) {
-		if (errno == EINTR)
-		    continue;
-		perror("child");
-		exit(1);
+	if (x->phase == XR_START) {
+	    if (x->retries == 4) {
+		if (x->stream) {
+		    x->stream = 0;
+		} else if (!x->ymodem) {
+		    x->crc = 0;
+		}
 	    }
-	    p = buf; 
-	    q = buf+x;
-	    while (p < q) {
-		*p++ &= 0x7F;
-	    }
-	    write(ttyfd, buf, x);
-	    if (logfp) {
-		fwrite(buf, sizeof(char), x, logfp);
+	    xr_ask(x);
+	    ev_timer(t, 3000000LL);
+	} else {
+	    x->pstate = XP_HUNT;
+	    xm_putc(NAK);
+	    ev_timer(t, XTIMEOUT * 1000000LL);
+	}
+    } else {
+	switch (x->phase) {
+	case XS_HDR:
+	case XS_FIN:
+	    tx_put((char *)x->cur->buf, x->cur->len);
+	    break;
+	case XS_DATA:
+	    if (!x->stream) {
+		xs_block(x);
 	    }
+	    break;
+	case XS_EOT:
+	    xm_putc(EOT);
+	    break;
 	}
+	ev_timer(t, XTIMEOUT * 1000000LL);
     }
+    tx_flush();
+}
 
-    if (child < 0) {
-	perror("child fork");
-	exit(1);
+static void
+xm_end(struct xfer *xp)
+{
+    struct xm *x = (struct xm *)xp;
+
+    if (x->fd >= 0) {
+	close(x->fd);
     }
+    free(x);
+}
 
-    /*
-     * This is the code which posts reads to the user's keyboard and
-     * writes the data out to the serial port.
-     */
-    while ((x = read(ttyfd, &c, 1)) == 1) {
-	c &= 0x7F;
+static struct xm *
+xm_new(int sending, int ymodem)
+{
+    struct xm *x;
 
-	/* PROTO_CHAR (usually Control-Z) starts file transfers */
-	if (c == PROTO_CHAR) {
-	    kill(child, SIGUSR1);
-	    proto_xfer(ttyfd, rs232);
-	    kill(child, SIGUSR2);
-	    continue;
-	}
-	if (!raw_kbd && (c == '\n')) {
-	    c = '\r';
-	}
-	write(rs232, &c, 1);
+    crc_init();
+    if ((x = calloc(1, sizeof(struct xm))) == NULL) {
+	write(ttyfd, "No memory for transfer\r\n", 24);
+	return(NULL);
     }
-    if (x < 0) {
-	perror("parent");
-    }
-    done();
-    /*NOTREACHED*/
-    return(0);
+    x->x.timer.handler = xm_timeout;
+    x->x.proto = ymodem ? "YMODEM" : "XMODEM";
+    x->x.input = xm_input;
+    x->x.pump = sending ? xs_pump : NULL;
+    x->x.key = xfer_stopkey;
+    x->x.end = xm_end;
+    x->x.raw = 1;
+    x->sending = sending;
+    x->ymodem = ymodem;
+    x->fd = -1;
+    x->size = -1;
+    x->crc = 1;
+    x->cur = &x->blk[0];
+    x->next = &x->blk[1];
+    x->next->data = -1;
+    return(x);
 }
 
 /*
- * Ask for and receive a line in raw mode
+ * xm_send()
+ *	Send a file, XMODEM or YMODEM; the receiver goes first
  */
 static void
-prompt_read(int ttyfd, char *prompt, char *buf, int len)
+xm_send(char *fname, int ymodem)
 {
-    char c;
-
-    /* Leave room for null terminator */
-    len -= 1;
+    struct xm *x;
+    struct stat st;
+    int fd;
 
-    /* Prompt */
-    write(ttyfd, prompt, strlen(prompt));
-
-    /* Read chars until newline */
-    do {
-	while (read(ttyfd, &c, sizeof(c)) == 0) ;
-	c &= 0x7F;
-	write(ttyfd, &c, sizeof(c));
-	if (len) {
-	    *buf++ = c;
-	    --len;
+    if (((fd = open(fname, O_RDONLY)) < 0) || (fstat(fd, &st) < 0)) {
+	fprintf(stderr, "%s: %s\r\n", fname, strerror(errno));
+	if (fd >= 0) {
+	    close(fd);
 	}
-    } while ((c != '\n') && (c != '\r'));
-
-    /* Overwrite newline with terminator */
-    buf -= 1;
-    *buf = '\0';
+	return;
+    }
+    if ((x = xm_new(1, ymodem)) == NULL) {
+	close(fd);
+	return;
+    }
+    x->fd = fd;
+    x->size = S_ISREG(st.st_mode) ? st.st_size : -1;
+    snprintf(x->name, sizeof(x->name), "%s", fname);
+    x->phase = XS_START;
+    x->seq = 1;
+    ev_timer(&x->x.timer, XSTART * 1000000LL);
+    xfer_begin(&x->x);
 }
 
 /*
- * Execute a protocol receive
+ * xm_recv()
+ *	Receive into "fname" (XMODEM), or whatever the sender names
+ *	(YMODEM)
  */
 static void
-rx_xfer(int ttyfd)
+xm_recv(char *fname, int ymodem)
 {
-    char buf[80];
-    char fname[60];
+    struct xm *x;
 
-    switch (proto) {
+    if ((x = xm_new(0, ymodem)) == NULL) {
+	return;
+    }
+    if (!ymodem) {
+	if ((x->fd = open(fname, O_WRONLY|O_CREAT|O_TRUNC, 0666)) < 0) {
+	    fprintf(stderr, "%s: %s\r\n", fname, strerror(errno));
+	    free(x);
+	    return;
+	}
+	snprintf(x->name, sizeof(x->name), "%s", fname);
+	x->seq = 1;
+    }
+    x->stream = ymodem && xfer_stream;
+    x->phase = XR_START;
+    xr_ask(x);
+    ev_timer(&x->x.timer, 3000000LL);
+    xfer_begin(&x->x);
+}
 
-    case PROTO_RX:
-	/*
-	 * Xmodem doesn't send names, so we have to ask.  Bleh.
-	 */
-	prompt_read(ttyfd, "Receive file: ", fname, sizeof(fname));
-	sprintf(buf, "lrx %s", fname);
-	break;
+/*
+ * Text upload (-p txt)
+ *
+ * A file is typed at the port a line at a time, for device shells
+ * with no protocol of their own.  Each character can be followed by
+ * a pause (cdelay=), and each line by another (ldelay=).  Rather
+ * than guess at a worst-case delay, we can instead wait to see the
+ * line come back (echo) or the device ask for more (prompt=).
+ * What the port says is shown (and logged) as usual all along.
+ */
+#define TS_LINE (1024)		/* Longer lines go in pieces */
+#define TS_WAIT (10)		/* Seconds for echo or prompt to show up */
 
-    case PROTO_RY:
-	strcpy(buf, "lry");
-	break;
+#define TS_READY (0)		/* Next character (or line) may go */
+#define TS_DELAY (1)		/* Pausing, per cdelay or ldelay */
+#define TS_ECHO (2)		/* Line's out; waiting for echo/prompt */
 
-    case PROTO_RZ:
-	strcpy(buf, "lrz");
-	break;
+struct ts {
+    struct xfer x;		/* Must be first */
+    int fd;
+    int state;			/* TS_* */
+    char buf[4096];		/* Read from the file, buf[pos..len) */
+    int pos, len;
+    char line[TS_LINE];		/* Going out, line[lpos..llen) */
+    int lpos, llen;
+    int echoed;			/* How much of it has come back */
+    int pm;			/* How much of the prompt we've seen */
+    long long lines;
+};
 
-    default:
-	fprintf(stderr, "Receive not supported with this protocol.\r\n");
-	return;
+/*
+ * ts_getline()
+ *	Fill ts->line with the next line of the file
+ *
+ * Returns 0 at end of file.
+ */
+static int
+ts_getline(struct ts *t)
+{
+    char c;
+
+    t->lpos = t->llen = t->echoed = t->pm = 0;
+    while (t->llen < TS_LINE) {
+	if (t->pos == t->len) {
+	    t->pos = 0;
+	    if ((t->len = read(t->fd, t->buf, sizeof(t->buf))) <= 0) {
+		t->len = 0;
+		break;
+	    }
+	}
+	c = t->buf[t->pos++];
+	if ((c == '\n') && ts_cr) {
+	    c = '\r';
+	}
+	t->line[t->llen++] = c;
+	if ((c == '\n') || (c == '\r')) {
+	    break;
+	}
     }
-    system(buf);
+    return(t->llen);
 }
 
 /*
- * Execute a protocol transmit
+ * ts_wait()
+ *	Hold off for "msec", then carry on
  */
 static void
-tx_xfer(int ttyfd)
+ts_wait(struct ts *t, int msec)
+{
+    t->state = TS_DELAY;
+    ev_timer(&t->x.timer, msec * 1000LL);
+}
+
+/*
+ * ts_line_done()
+ *	The last of a line has been queued; decide when the next goes
+ */
+static void
+ts_line_done(struct ts *t)
+{
+    t->lines += 1;
+    if (ts_echo || ts_prompt) {
+	t->state = TS_ECHO;
+	ev_timer(&t->x.timer, TS_WAIT * 1000000LL);
+    } else if (ts_ldelay) {
+	ts_wait(t, ts_ldelay);
+    }
+}
+
+/* Our pump; type as much as the pacing allows */
+static void
+ts_pump(struct xfer *xp)
 {
+    struct ts *t = (struct ts *)xp;
     char buf[80];
-    char fname[60];
+    int n;
 
-    prompt_read(ttyfd, "Send file: ", fname, sizeof(fname));
+    while (t->state == TS_READY) {
+	if (t->lpos == t->llen) {
+	    if (!ts_getline(t)) {
+		if (txoff < txlen) {
+		    return;	/* Done once the last of it's out */
+		}
+		snprintf(buf, sizeof(buf), "sent %lld lines", t->lines);
+		xfer_done(buf);
+		return;
+	    }
+	}
+	n = ts_cdelay ? 1 : (t->llen - t->lpos);
+	if (n > tx_room()) {
+	    return;		/* tx_flush() will be back */
+	}
+	memcpy(txbuf + txlen, t->line + t->lpos, n);
+	txlen += n;
+	t->lpos += n;
+	if (t->lpos == t->llen) {
+	    ts_line_done(t);
+	} else if (ts_cdelay) {
+	    ts_wait(t, ts_cdelay);
+	}
+    }
+}
 
-    switch (proto) {
+/*
+ * ts_saw()
+ *	Has what came back finished off the line we're waiting on?
+ *
+ * An echo counts once each of the line's characters (line ends
+ * aside) has come back, in order; anything else the device says in
+ * between is skipped.  The prompt has to show up whole.
+ */
+static int
+ts_saw(struct ts *t, unsigned char *buf, int len)
+{
+    int x, k, c, want, plen = ts_prompt ? strlen(ts_prompt) : 0;
 
-    case PROTO_RX:
-	strcpy(buf, "lsx");
-	break;
+    for (want = 0; (want < t->llen) && (t->line[want] != '\r') &&
+	    (t->line[want] != '\n'); ++want) {
+	;
+    }
+    for (x = 0; x < len; ++x) {
+	c = buf[x];
+	if (ts_echo && (t->echoed < want) && (c == (t->line[t->echoed] & 0xFF))) {
+	    t->echoed += 1;
+	}
+	if (plen) {
+	    while ((t->pm > 0) && (c != (ts_prompt[t->pm] & 0xFF))) {
+		for (k = t->pm - 1; (k > 0) &&
+			memcmp(ts_prompt, ts_prompt + t->pm - k, k); --k) {
+		    ;
+		}
+		t->pm = k;
+	    }
+	    if (c == (ts_prompt[t->pm] & 0xFF)) {
+		t->pm += 1;
+	    }
+	}
+	if ((!ts_echo || (t->echoed == want)) && (!plen || (t->pm == plen))) {
+	    return(1);
+	}
+    }
+    return(0);
+}
 
-    case PROTO_RY:
-	strcpy(buf, "lsy");
-	break;
+/* Received data: the user sees it as usual, and we watch it */
+static void
+ts_input(struct xfer *xp, unsigned char *buf, int len)
+{
+    struct ts *t = (struct ts *)xp;
+    int ready = (t->state == TS_ECHO) && ts_saw(t, buf, len);
 
-    case PROTO_RZ:
-	strcpy(buf, "lsz");
-	break;
+    rx_show(cur, (char *)buf, len);
+    if (ready) {
+	ev_untimer(&t->x.timer);
+	t->state = TS_READY;
+	if (ts_ldelay) {
+	    ts_wait(t, ts_ldelay);
+	}
+	tx_flush();
+    }
+}
 
-    case PROTO_TXT:
-	strcpy(buf, "cat");
-	break;
+/* Pause over, or the device never answered */
+static void
+ts_timeout(struct evtimer *tp)
+{
+    struct ts *t = (struct ts *)tp;
+    char buf[80];
 
-    default:
-	fprintf(stderr, "Transmit not supported with this protocol.\r\n");
+    if (t->state == TS_ECHO) {
+	snprintf(buf, sizeof(buf), "no %s after line %lld",
+	    ts_prompt ? "prompt" : "echo", t->lines);
+	xfer_finish(buf);
 	return;
     }
-
-    sprintf(buf, "%s %s", buf, fname);
-    system(buf);
+    t->state = TS_READY;
+    tx_flush();
 }
 
 /*
- * Figure out what they want to do, drive a protcol transfer
+ * ts_key()
+ *	^X or ^C stops the upload
+ *
+ * Unlike the protocols there's nobody to send CANs to; what's left
+ * in the queue is just thrown away.  Any other key is ignored until
+ * the upload's over, as it would land in the middle of a line.
  */
 static void
-proto_xfer(int ttyfd, int rs232)
+ts_key(struct xfer *xp, int c)
 {
-    char c;
-    register char c2;
-    static char helpmsg[] = "Options are: <r>eceive, <s>end, <q>uit\r\n";
-
-    /* Get next char to see what they want to do */
-    while (read(ttyfd, &c, sizeof(c)) == 0)
-	    ;
-    c &= 0x7F;
-
-    /* Send char through literally */
-    if (c == PROTO_CHAR) {
-	write(rs232, &c, sizeof(c));
-	return;
+    if ((c == 030) || (c == 003)) {
+	txoff = txlen = 0;
+	(void)tcflush(rs232, TCOFLUSH);
+	xfer_finish("cancelled");
     }
+}
 
-    /* 'q' or 'Q' means quit */
-    if ((c == 'q') || (c == 'Q')) {
-	done();
-    }
+static void
+ts_end(struct xfer *xp)
+{
+    struct ts *t = (struct ts *)xp;
 
-    /* Receive? */
-    c2 = c;
-    if ((c2 == 'r') || (c2 == 'R')) {
-	rx_xfer(ttyfd);
-	setup_serial(rs232);
+    close(t->fd);
+    free(t);
+}
 
-    /* Send? */
-    } else if ((c2 == 's') || (c2 == 'S') || (c2 == 't') ||
-	    (c2 == 'T')) {
-	tx_xfer(ttyfd);
-	setup_serial(rs232);
+/*
+ * ts_send()
+ *	Start typing "fname" at the port
+ */
+static void
+ts_send(char *fname)
+{
+    struct ts *t;
+    int fd;
 
-    /* Dunno */
-    } else {
-	write(ttyfd, helpmsg, sizeof(helpmsg)-1);
+    if ((fd = open(fname, O_RDONLY)) < 0) {
+	fprintf(stderr, "%s: %s\r\n", fname, strerror(errno));
+	return;
+    }
+    if ((t = calloc(1, sizeof(struct ts))) == NULL) {
+	write(ttyfd, "No memory for transfer\r\n", 24);
+	close(fd);
+	return;
     }
+    t->x.timer.handler = ts_timeout;
+    t->x.proto = "text";
+    t->x.input = ts_input;
+    t->x.pump = ts_pump;
+    t->x.key = ts_key;
+    t->x.end = ts_end;
+    t->fd = fd;
+    xfer_begin(&t->x);
 }